@@ -8,6 +8,7 @@ see LICENSE for license information
 *******************************************************************************/
 
 #include "rima_solver_tools.h"
+#include "rima_coin_tools.h"
 extern "C"
 {
 #include "lauxlib.h"
@@ -16,31 +17,93 @@ LUALIB_API int luaopen_rima_cbc_core(lua_State *L);
 
 #include "OsiClpSolverInterface.hpp"
 #include "CbcModel.hpp"
+#include "CbcHeuristic.hpp"
+#include "CbcHeuristicFPump.hpp"
+#include "CbcHeuristicLocal.hpp"
+#include "CbcHeuristicRINS.hpp"
+#include "CglProbing.hpp"
+#include "CglGomory.hpp"
+#include "CglKnapsackCover.hpp"
+#include "CglClique.hpp"
+#include "CglMixedIntegerRounding2.hpp"
+#include "CglFlowCover.hpp"
+#include "CglTwomir.hpp"
+#include "CoinPackedMatrix.hpp"
+
+#include <cmath>
 
 static const char metatable_name[] = "rima.cbc";
 
 
 /*============================================================================*/
 
-static OsiSolverInterface *get_model(lua_State *L)
+// Rather than adding rows and columns one at a time (each of which can
+// reallocate the solver's matrix), we collect the whole problem and hand it to
+// the solver in one loadProblem when we solve.
+// The solver is kept between solves and changed in place.  Each solve restarts
+// the LP relaxation from the last basis and then hands a copy to a fresh
+// CbcModel (which clones the solver it's given) for the branch and bound.
+struct rima_cbc_model
 {
-  CbcModel *cbc = (CbcModel*)luaL_checkudata(L, 1, metatable_name);
-  return cbc->solver();
+  rima_cbc_model() : model(0), loaded(false), solved(false), changes(0) {}
+  ~rima_cbc_model() { delete model; }
+
+  OsiClpSolverInterface solver;
+  CbcModel *model;
+  linear_problem problem;
+  bool loaded, solved;
+  unsigned changes;
+  std::vector<int> start_columns;       // A (possibly partial) starting solution
+  std::vector<double> start_values;
+};
+
+
+static rima_cbc_model *get_model(lua_State *L)
+{
+  return (rima_cbc_model*)luaL_checkudata(L, 1, metatable_name);
+}
+
+
+static void load_model(rima_cbc_model *M)
+{
+  if (M->loaded) return;
+
+  linear_problem P;
+  P.swap(M->problem);
+  if (P.row_starts.empty())
+    P.row_starts.push_back(0);
+
+  std::vector<int> lengths(P.row_count());
+  for (unsigned i = 0; i != P.row_count(); ++i)
+    lengths[i] = P.row_starts[i+1] - P.row_starts[i];
+
+  CoinPackedMatrix matrix(false, P.column_count(), P.row_count(), P.non_zero_count(),
+    vector_data(P.values), vector_data(P.columns), vector_data(P.row_starts), vector_data(lengths));
+
+  OsiSolverInterface *solver = &M->solver;
+  solver->loadProblem(matrix,
+    vector_data(P.column_lower), vector_data(P.column_upper), vector_data(P.costs),
+    vector_data(P.row_lower), vector_data(P.row_upper));
+  for (unsigned i = 0; i != P.column_count(); ++i)
+    if (P.integer[i])
+      solver->setInteger(i);
+  solver->setObjSense(P.maximise ? -1.0 : 1.0);
+  M->loaded = true;
+  M->solved = false;
 }
 
 
 static int rima_new(lua_State *L)
 {
-  CbcModel *model;
+  rima_cbc_model *M;
 
   try
   {
-    OsiClpSolverInterface osiclp;
-    model = new(lua_newuserdata(L, sizeof(CbcModel))) CbcModel(osiclp);
+    M = new(lua_newuserdata(L, sizeof(rima_cbc_model))) rima_cbc_model();
 
     luaL_getmetatable(L, metatable_name);
     lua_setmetatable(L, -2);
-    model->setLogLevel(0);
+    M->solver.messageHandler()->setLogLevel(0);
   }
   catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
   catch (std::exception &e)     { return error(L, e.what()); }
@@ -50,133 +113,722 @@ static int rima_new(lua_State *L)
 }
 
 
-static const char *build_constraint(void *M, unsigned non_zeroes, int *columns, double *coefficients, double lower, double upper)
+// Read a model from an MPS file straight into the solver, keeping its row
+// and column names.  COIN reads gzipped files if it was built with zlib.
+static int rima_read_mps(lua_State *L)
 {
-  ((OsiSolverInterface*)M)->addRow(non_zeroes, &columns[0], &coefficients[0], lower, upper);
-  return 0;
+  const char *filename = luaL_checkstring(L, 1);
+  rima_cbc_model *M;
+
+  try
+  {
+    M = new(lua_newuserdata(L, sizeof(rima_cbc_model))) rima_cbc_model();
+
+    luaL_getmetatable(L, metatable_name);
+    lua_setmetatable(L, -2);
+    M->solver.messageHandler()->setLogLevel(0);
+    M->solver.setIntParam(OsiNameDiscipline, 2);
+    if (M->solver.readMps(filename, "") != 0)
+      return error(L, "Couldn't read the MPS file");
+    M->loaded = true;
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+
+  return 1;
 }
 
 
 static int rima_build_rows(lua_State *L)
 {
-  OsiSolverInterface *model = get_model(L);
+  rima_cbc_model *M = get_model(L);
   luaL_checktype(L, 2, LUA_TTABLE);
-  unsigned constraint_count = lua_objlen(L, 2);
-  unsigned column_count = model->getNumCols();
-
-  unsigned max_non_zeroes = 0;
-  const char *err = check_constraints(L, constraint_count, column_count, max_non_zeroes);
-  if (err) return error(L, err);
 
-  err = build_constraints(L, max_non_zeroes, constraint_count, -1, build_constraint, model);
-  if (err) return error(L, err);
+  try
+  {
+    if (!M->loaded)
+    {
+      // read_constraints leaves the problem as it was if it fails
+      const char *err = read_constraints(L, 2, M->problem.column_count(), M->problem);
+      if (err) return error(L, err);
+    }
+    else
+    {
+      OsiSolverInterface *solver = &M->solver;
+      linear_problem P;
+      const char *err = read_constraints(L, 2, solver->getNumCols(), P);
+      if (err) return error(L, err);
+      solver->addRows(P.row_count(), vector_data(P.row_starts), vector_data(P.columns), vector_data(P.values),
+        vector_data(P.row_lower), vector_data(P.row_upper));
+      M->changes |= MATRIX_CHANGED;
+    }
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
 
   lua_pushboolean(L, 1);
   return 1;
 }
 
 
-static const char *build_variable(void *M, unsigned index, double cost, double lower, double upper, bool integer)
-{
-  ((OsiSolverInterface*)M)->addCol(0, 0, 0, lower, upper, cost);
-  if (integer)
-    ((OsiSolverInterface*)M)->setInteger(index);
-  return 0;
-}
-
-
 static int rima_set_objective(lua_State *L)
 {
-  OsiSolverInterface *model = get_model(L);
+  rima_cbc_model *M = get_model(L);
   luaL_checktype(L, 2, LUA_TTABLE);
   luaL_checktype(L, 3, LUA_TSTRING);
   unsigned variable_count = lua_objlen(L, 2);
 
-  double optimization_direction = 0.0;
+  bool maximise = false;
   const char *sense = lua_tostring(L, 3);
   if (std::strncmp(sense, "minimise", 8) == 0)
-    optimization_direction = 1.0;
+    maximise = false;
   else if (std::strncmp(sense, "maximise", 8) == 0)
-    optimization_direction = -1.0;
+    maximise = true;
   else
     return error(L, "The the optimisation direction must be 'minimise' or 'maximise'");
 
-  const char *err = check_variables(L, variable_count);
-  if (err) return error(L, err);
+  unsigned column_count = M->loaded ? M->solver.getNumCols() : M->problem.column_count();
+  if ((M->loaded || M->problem.row_count() > 0) && variable_count != column_count)
+    return error(L, "The length of the objective vector does not match the number of variables in the problem");
 
-  err = build_variables(L, variable_count, build_variable, model);
-  if (err) return error(L, err);
-
-  model->setObjSense(optimization_direction);
+  try
+  {
+    linear_problem P;
+    const char *err = read_variables(L, 2, P);
+    if (err) return error(L, err);
+
+    if (!M->loaded)
+    {
+      M->problem.column_lower.swap(P.column_lower);
+      M->problem.column_upper.swap(P.column_upper);
+      M->problem.costs.swap(P.costs);
+      M->problem.integer.swap(P.integer);
+      M->problem.maximise = maximise;
+    }
+    else
+    {
+      OsiSolverInterface *solver = &M->solver;
+      for (unsigned i = 0; i != column_count; ++i)
+      {
+        solver->setObjCoeff(i, P.costs[i]);
+        solver->setColBounds(i, P.column_lower[i], P.column_upper[i]);
+        if (P.integer[i])
+          solver->setInteger(i);
+        else
+          solver->setContinuous(i);
+      }
+      solver->setObjSense(maximise ? -1.0 : 1.0);
+      M->changes |= BOUNDS_CHANGED | COSTS_CHANGED;
+    }
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
 
   lua_pushboolean(L, 1);
   return 1;  
 }
 
 
-static int rima_solve(lua_State *L)
+static int rima_load_problem(lua_State *L)
+{
+  rima_cbc_model *M = get_model(L);
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  try
+  {
+    linear_problem P;
+    const char *err = read_linear_problem(L, 2, P);
+    if (err) return error(L, err);
+
+    M->problem.swap(P);
+    M->loaded = false;
+    M->start_columns.clear();
+    M->start_values.clear();
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+// Load a model from a cache file written by write_cache.  Returns the model
+// and the names saved with it.
+static int rima_read_cache(lua_State *L)
 {
-  CbcModel *model = (CbcModel*)luaL_checkudata(L, 1, metatable_name);
+  const char *filename = luaL_checkstring(L, 1);
+  rima_cbc_model *M;
 
-  model->branchAndBound();
+  try
+  {
+    mapped_problem C;
+    const char *err = C.open(filename);
+    if (err) return error(L, err);
+
+    M = new(lua_newuserdata(L, sizeof(rima_cbc_model))) rima_cbc_model();
+    luaL_getmetatable(L, metatable_name);
+    lua_setmetatable(L, -2);
+    M->solver.messageHandler()->setLogLevel(0);
+
+    C.copy(M->problem);
+    push_cache_names(L, C);
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+
+  return 2;
+}
+
+
+// Changes to a loaded model are made directly on the solver.  Before the
+// problem is loaded, they're made on the pending problem.
+static unsigned column_count(rima_cbc_model *M)
+{
+  return M->loaded ? M->solver.getNumCols() : M->problem.column_count();
+}
+
+
+static unsigned row_count(rima_cbc_model *M)
+{
+  return M->loaded ? M->solver.getNumRows() : M->problem.row_count();
+}
+
+
+static int rima_set_column_bounds(lua_State *L)
+{
+  rima_cbc_model *M = get_model(L);
+  int column = luaL_checkinteger(L, 2) - 1;
+  double lower = luaL_checknumber(L, 3), upper = luaL_checknumber(L, 4);
+  if (column < 0 || (unsigned)column >= column_count(M))
+    return error(L, "bad argument #1 to 'set_column_bounds' (column index out of range)");
+
+  if (M->loaded)
+  {
+    M->solver.setColBounds(column, lower, upper);
+    M->changes |= BOUNDS_CHANGED;
+  }
+  else
+  {
+    M->problem.column_lower[column] = lower;
+    M->problem.column_upper[column] = upper;
+  }
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int rima_set_row_bounds(lua_State *L)
+{
+  rima_cbc_model *M = get_model(L);
+  int row = luaL_checkinteger(L, 2) - 1;
+  double lower = luaL_checknumber(L, 3), upper = luaL_checknumber(L, 4);
+  if (row < 0 || (unsigned)row >= row_count(M))
+    return error(L, "bad argument #1 to 'set_row_bounds' (row index out of range)");
+
+  if (M->loaded)
+  {
+    M->solver.setRowBounds(row, lower, upper);
+    M->changes |= BOUNDS_CHANGED;
+  }
+  else
+  {
+    M->problem.row_lower[row] = lower;
+    M->problem.row_upper[row] = upper;
+  }
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int rima_set_cost(lua_State *L)
+{
+  rima_cbc_model *M = get_model(L);
+  int column = luaL_checkinteger(L, 2) - 1;
+  double cost = luaL_checknumber(L, 3);
+  if (column < 0 || (unsigned)column >= column_count(M))
+    return error(L, "bad argument #1 to 'set_cost' (column index out of range)");
+
+  if (M->loaded)
+  {
+    M->solver.setObjCoeff(column, cost);
+    M->changes |= COSTS_CHANGED;
+  }
+  else
+    M->problem.costs[column] = cost;
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int rima_set_coefficient(lua_State *L)
+{
+  rima_cbc_model *M = get_model(L);
+  int row = luaL_checkinteger(L, 2) - 1, column = luaL_checkinteger(L, 3) - 1;
+  double value = luaL_checknumber(L, 4);
+  if (row < 0 || (unsigned)row >= row_count(M))
+    return error(L, "bad argument #1 to 'set_coefficient' (row index out of range)");
+  if (column < 0 || (unsigned)column >= column_count(M))
+    return error(L, "bad argument #2 to 'set_coefficient' (column index out of range)");
+
+  try
+  {
+    // The solver interface has no way of changing a single element, so we go
+    // through the underlying Clp model
+    load_model(M);
+    M->solver.getModelPtr()->modifyCoefficient(row, column, value);
+    M->changes |= MATRIX_CHANGED;
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+// Options for the branch and bound.  Zero means "leave CBC's default".
+struct cbc_options
+{
+  cbc_options() : threads(0), node_limit(0), time_limit(0), relative_gap(0), absolute_gap(0) {}
+
+  int threads, node_limit;
+  double time_limit, relative_gap, absolute_gap;
+  std::vector<const char*> cuts, heuristics;
+};
+
+
+static const char *cut_generator_names[] =
+  { "probing", "gomory", "knapsack", "clique", "mir", "flow", "twomir", 0 };
+static const char *heuristic_names[] =
+  { "rounding", "fpump", "local", "rins", 0 };
+
+
+static bool all_known(const std::vector<const char*> &names, const char **known)
+{
+  for (unsigned i = 0; i != names.size(); ++i)
+  {
+    const char **k = known;
+    while (*k && std::strcmp(*k, names[i]) != 0) ++k;
+    if (!*k) return false;
+  }
+  return true;
+}
+
+
+static const char *read_cbc_options(lua_State *L, int index, cbc_options &o)
+{
+  const char *err;
+  if ((err = read_option(L, index, "threads", o.threads)) ||
+      (err = read_option(L, index, "node_limit", o.node_limit)) ||
+      (err = read_option(L, index, "time_limit", o.time_limit)) ||
+      (err = read_option(L, index, "relative_gap", o.relative_gap)) ||
+      (err = read_option(L, index, "absolute_gap", o.absolute_gap)) ||
+      (err = read_option(L, index, "cuts", o.cuts)) ||
+      (err = read_option(L, index, "heuristics", o.heuristics)))
+    return err;
+
+  if (!all_known(o.cuts, cut_generator_names))
+    return "bad option 'cuts' (expected a list of 'probing', 'gomory', 'knapsack', 'clique', 'mir', 'flow' or 'twomir')";
+  if (!all_known(o.heuristics, heuristic_names))
+    return "bad option 'heuristics' (expected a list of 'rounding', 'fpump', 'local' or 'rins')";
+  return 0;
+}
+
+
+// CbcModel takes copies of the cut generators and heuristics it's given
+static void add_cut_generator(CbcModel *model, const char *name)
+{
+  // -1 means "at the root, and then only if they were any use"
+  if (std::strcmp(name, "probing") == 0)
+  {
+    CglProbing probing;
+    probing.setUsingObjective(1);
+    probing.setMaxPass(3);
+    probing.setMaxProbe(100);
+    probing.setMaxLook(50);
+    probing.setRowCuts(3);
+    model->addCutGenerator(&probing, -1, "Probing");
+  }
+  else if (std::strcmp(name, "gomory") == 0)
+  {
+    CglGomory gomory;
+    gomory.setLimit(300);
+    model->addCutGenerator(&gomory, -1, "Gomory");
+  }
+  else if (std::strcmp(name, "knapsack") == 0)
+  {
+    CglKnapsackCover knapsack;
+    model->addCutGenerator(&knapsack, -1, "Knapsack");
+  }
+  else if (std::strcmp(name, "clique") == 0)
+  {
+    CglClique clique;
+    model->addCutGenerator(&clique, -1, "Clique");
+  }
+  else if (std::strcmp(name, "mir") == 0)
+  {
+    CglMixedIntegerRounding2 mir;
+    model->addCutGenerator(&mir, -1, "MixedIntegerRounding2");
+  }
+  else if (std::strcmp(name, "flow") == 0)
+  {
+    CglFlowCover flow;
+    model->addCutGenerator(&flow, -1, "FlowCover");
+  }
+  else if (std::strcmp(name, "twomir") == 0)
+  {
+    CglTwomir twomir;
+    model->addCutGenerator(&twomir, -1, "TwoMirCuts");
+  }
+}
 
-  if (!model->isProvenOptimal())
-    return error(L, "Model not solved to optimality");
+
+static void add_heuristic(CbcModel *model, const char *name)
+{
+  if (std::strcmp(name, "rounding") == 0)
+  {
+    CbcRounding rounding(*model);
+    model->addHeuristic(&rounding);
+  }
+  else if (std::strcmp(name, "fpump") == 0)
+  {
+    CbcHeuristicFPump pump(*model);
+    model->addHeuristic(&pump);
+  }
+  else if (std::strcmp(name, "local") == 0)
+  {
+    CbcHeuristicLocal local(*model);
+    model->addHeuristic(&local);
+  }
+  else if (std::strcmp(name, "rins") == 0)
+  {
+    CbcHeuristicRINS rins(*model);
+    model->addHeuristic(&rins);
+  }
+}
+
+
+static void set_cbc_options(CbcModel *model, const cbc_options &o)
+{
+  // Threads only make a difference if CBC was built with CBC_THREAD
+  if (o.threads > 0) model->setNumberThreads(o.threads);
+  if (o.node_limit > 0) model->setMaximumNodes(o.node_limit);
+  if (o.time_limit > 0) model->setMaximumSeconds(o.time_limit);
+  if (o.relative_gap > 0) model->setAllowableFractionGap(o.relative_gap);
+  if (o.absolute_gap > 0) model->setAllowableGap(o.absolute_gap);
+  for (unsigned i = 0; i != o.cuts.size(); ++i)
+    add_cut_generator(model, o.cuts[i]);
+  for (unsigned i = 0; i != o.heuristics.size(); ++i)
+    add_heuristic(model, o.heuristics[i]);
+}
+
+
+// "optimal", "infeasible", "unbounded", "feasible" (stopped on a limit with
+// an incumbent), "limit" (stopped on a limit without one) or "abandoned".
+// If a limit was hit, limit says which.
+static const char *solve_status(const CbcModel *model, const char *&limit)
+{
+  limit = 0;
+  if (model->isProvenOptimal()) return "optimal";
+  if (model->isProvenInfeasible()) return "infeasible";
+  if (model->isContinuousUnbounded() || model->isProvenDualInfeasible()) return "unbounded";
+
+  if (model->isSecondsLimitReached())
+    limit = "time";
+  else if (model->isNodeLimitReached())
+    limit = "nodes";
+  else if (model->isSolutionLimitReached())
+    limit = "solutions";
+  else
+    return "abandoned";
+
+  return model->bestSolution() ? "feasible" : "limit";
+}
+
+
+// Set a starting solution from a table of {[column]=value}.  The start
+// doesn't have to cover every column.  An empty table clears the start.
+static int rima_set_start(lua_State *L)
+{
+  rima_cbc_model *M = get_model(L);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  unsigned columns = column_count(M);
+
+  std::vector<int> start_columns;
+  std::vector<double> start_values;
+  try
+  {
+    lua_pushnil(L);
+    while (lua_next(L, 2))
+    {
+      if (lua_type(L, -2) != LUA_TNUMBER || lua_type(L, -1) != LUA_TNUMBER)
+        return error(L, "The start must be a table of numbers indexed by column number");
+      lua_Number c = lua_tonumber(L, -2);
+      if (c != (int)c || c < 1 || c > columns)
+        return error(L, "Column index out of range in the start");
+      start_columns.push_back((int)c - 1);
+      start_values.push_back(lua_tonumber(L, -1));
+      lua_pop(L, 1);
+    }
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+
+  M->start_columns.swap(start_columns);
+  M->start_values.swap(start_values);
 
   lua_pushboolean(L, 1);
   return 1;
 }
 
 
+// Turn a start into a full solution by fixing the integer variables we've got
+// values for, and then solving the LP for everything else.  Returns false if
+// the start can't be completed.
+static bool complete_start(const OsiSolverInterface &solver,
+  const std::vector<int> &columns, const std::vector<double> &values,
+  std::vector<double> &solution, double &objective)
+{
+  OsiSolverInterface *s = solver.clone();
+  bool solved;
+  try
+  {
+    for (unsigned i = 0; i != columns.size(); ++i)
+    {
+      if (!s->isInteger(columns[i])) continue;
+      double v = std::floor(values[i] + 0.5);
+      s->setColBounds(columns[i], v, v);
+    }
+    s->resolve();
+    solved = s->isProvenOptimal();
+    if (solved)
+    {
+      const double *x = s->getColSolution();
+      solution.assign(x, x + s->getNumCols());
+      // CBC works in the minimisation sense
+      objective = s->getObjValue() * s->getObjSense();
+    }
+  }
+  catch (...)
+  {
+    delete s;
+    throw;
+  }
+  delete s;
+  return solved;
+}
+
+
+static int rima_solve(lua_State *L)
+{
+  rima_cbc_model *M = get_model(L);
+
+  try
+  {
+    cbc_options options;
+    const char *err = read_cbc_options(L, 2, options);
+    if (err) return error(L, err);
+
+    // Start from the values we've been given, or, if we're re-solving the same
+    // problem, from the last incumbent.
+    std::vector<int> start_columns(M->start_columns);
+    std::vector<double> start_values(M->start_values);
+    if (start_columns.empty() && M->loaded && M->solved && M->model && M->model->bestSolution())
+    {
+      const double *x = M->model->bestSolution();
+      start_values.assign(x, x + M->model->getNumCols());
+      for (unsigned i = 0; i != start_values.size(); ++i)
+        start_columns.push_back(i);
+    }
+
+    load_model(M);
+
+    // Solve the relaxation here so that a re-solve can start from the last
+    // basis.  The CbcModel gets a copy of the solver, basis and all.
+    if (M->solved)
+      M->solver.resolve();
+    else
+      M->solver.initialSolve();
+    M->solved = true;
+    M->changes = 0;
+
+    delete M->model;
+    M->model = 0;
+    M->model = new CbcModel(M->solver);
+    M->model->setLogLevel(0);
+    set_cbc_options(M->model, options);
+
+    std::vector<double> solution;
+    double objective;
+    if (!start_columns.empty() &&
+        complete_start(M->solver, start_columns, start_values, solution, objective))
+      M->model->setBestSolution(vector_data(solution), solution.size(), objective, true);
+
+    M->model->branchAndBound();
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+
+  // A solve that stops short of optimality isn't an error: get_solution
+  // returns the incumbent if there is one, along with the status
+  const char *limit;
+  lua_pushstring(L, solve_status(M->model, limit));
+  return 1;
+}
+
+
 static int rima_get_solution(lua_State *L)
 {
-  CbcModel *model = (CbcModel*)luaL_checkudata(L, 1, metatable_name);
+  CbcModel *model = get_model(L)->model;
 
-  if (!model->isProvenOptimal())
+  if (!model)
+    return error(L, "Model has not been solved");
+
+  const char *limit;
+  const char *status = solve_status(model, limit);
+  const double *primal_vars = model->bestSolution();
+  if (!primal_vars && std::strcmp(status, "optimal") == 0)
+    primal_vars = model->getColSolution();
+  if (!primal_vars)
+  {
+    if (std::strcmp(status, "infeasible") == 0)
+      return error(L, "Model is infeasible");
+    if (std::strcmp(status, "unbounded") == 0)
+      return error(L, "Model is unbounded");
+    if (std::strcmp(status, "limit") == 0)
+      return error(L, "Stopped on a limit before finding a feasible solution");
     return error(L, "Model not solved to optimality");
+  }
+
+  // The row activities of the solver might not be for the incumbent
+  unsigned row_count = model->getNumRows();
+  std::vector<double> primal_constraints(row_count);
+  model->solver()->getMatrixByRow()->times(primal_vars, vector_data(primal_constraints));
+
+  double objective = model->getObjValue(), bound = model->getBestPossibleObjValue();
+  double gap = std::fabs(objective - bound) / std::max(std::fabs(objective), 1e-10);
 
   lua_newtable(L);
-  lua_pushnumber(L, model->getObjValue());
+  lua_pushstring(L, status);
+  lua_setfield(L, -2, "status");
+  if (limit)
+  {
+    lua_pushstring(L, limit);
+    lua_setfield(L, -2, "limit");
+  }
+  lua_pushnumber(L, objective);
   lua_setfield(L, -2, "objective");
+  lua_pushnumber(L, bound);
+  lua_setfield(L, -2, "bound");
+  lua_pushnumber(L, gap);
+  lua_setfield(L, -2, "gap");
 
   unsigned column_count = model->getNumCols();
-  const double *primal_vars = model->getColSolution();
-  const double *dual_vars = model->getReducedCost();
+  solution_arrays *S = new_solution(L);
+  S->column_primal.assign(primal_vars, primal_vars + column_count);
+  S->column_dual.assign(model->getReducedCost(), model->getReducedCost() + column_count);
+  S->row_primal.swap(primal_constraints);
+  S->row_dual.assign(model->getRowPrice(), model->getRowPrice() + row_count);
+  lua_setfield(L, -2, "solution");
+
+  return 1;
+}
+
+
+// The names of the columns and rows, as { columns = {...}, rows = {...} }.
+// Models read from files keep the names in the file; others have generated
+// names.
+static int rima_get_names(lua_State *L)
+{
+  rima_cbc_model *M = get_model(L);
+  try
+  {
+    load_model(M);
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+
+  OsiSolverInterface *solver = &M->solver;
+  int column_count = solver->getNumCols(), row_count = solver->getNumRows();
+
+  lua_createtable(L, 0, 2);
   lua_createtable(L, column_count, 0);
-  for (unsigned i = 0; i != column_count; ++i)
+  for (int i = 0; i != column_count; ++i)
   {
-    lua_newtable(L);
-    lua_pushnumber(L, primal_vars[i]);
-    lua_setfield(L, -2, "p");
-    lua_pushnumber(L, dual_vars[i]);
-    lua_setfield(L, -2, "d");
+    lua_pushstring(L, solver->getColName(i).c_str());
     lua_rawseti(L, -2, i + 1);
   }
-  lua_setfield(L, -2, "variables");
-
-  unsigned row_count = model->getNumRows();
-  const double *primal_constraints = model->getRowActivity();
-  const double *dual_constraints = model->getRowPrice();
+  lua_setfield(L, -2, "columns");
   lua_createtable(L, row_count, 0);
-  for (unsigned i = 0; i != row_count; ++i)
+  for (int i = 0; i != row_count; ++i)
   {
-    lua_newtable(L);
-    lua_pushnumber(L, primal_constraints[i]);
-    lua_setfield(L, -2, "p");
-    lua_pushnumber(L, dual_constraints[i]);
-    lua_setfield(L, -2, "d");
+    lua_pushstring(L, solver->getRowName(i).c_str());
     lua_rawseti(L, -2, i + 1);
   }
-  lua_setfield(L, -2, "constraints");
+  lua_setfield(L, -2, "rows");
+
+  return 1;
+}
+
+
+// The optimisation direction, "minimise" or "maximise"
+static int rima_get_sense(lua_State *L)
+{
+  rima_cbc_model *M = get_model(L);
+  bool maximise = M->loaded ? M->solver.getObjSense() < 0 : M->problem.maximise;
+  lua_pushstring(L, maximise ? "maximise" : "minimise");
+  return 1;
+}
+
+
+// Write the model to an MPS or LP file (see write_options)
+static int rima_write(lua_State *L)
+{
+  rima_cbc_model *M = get_model(L);
+  const char *filename = luaL_checkstring(L, 2);
+
+  write_options o;
+  const char *err = read_write_options(L, 3, column_count(M), row_count(M), o);
+  if (err) return error(L, err);
+
+  try
+  {
+    load_model(M);
+    OsiSolverInterface *solver = &M->solver;
+
+    std::vector<char> integer(solver->getNumCols());
+    for (unsigned i = 0; i != integer.size(); ++i)
+      integer[i] = solver->isInteger(i);
+
+    err = write_coin_problem(filename, o, *solver->getMatrixByRow(),
+      solver->getColLower(), solver->getColUpper(), solver->getObjCoefficients(),
+      vector_data(integer), solver->getRowLower(), solver->getRowUpper(),
+      solver->getObjSense() < 0);
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+  if (err) return error(L, err);
 
+  lua_pushboolean(L, 1);
   return 1;
 }
 
 
 static int rima_delete(lua_State *L)
 {
-  CbcModel *model = (CbcModel*)luaL_checkudata(L, 1, metatable_name);
-  model->~CbcModel();
+  get_model(L)->~rima_cbc_model();
   return 0;
 }
 
@@ -186,6 +838,12 @@ static int rima_delete(lua_State *L)
 static luaL_Reg rima_functions[] =
 {
   {"new",  rima_new},
+  {"wall_time",  push_wall_time},
+  {"read_mps",  rima_read_mps},
+  {"read_cache",  rima_read_cache},
+  {"write_cache",  write_cache},
+  {"cache_info",  cache_info},
+  {"cache_key",  cache_key},
   {NULL, NULL}
 };
 
@@ -195,8 +853,17 @@ static luaL_Reg rima_methods[] =
   {"__gc", rima_delete},
   {"build_rows", rima_build_rows},
   {"set_objective", rima_set_objective},
+  {"load_problem", rima_load_problem},
+  {"set_column_bounds", rima_set_column_bounds},
+  {"set_row_bounds", rima_set_row_bounds},
+  {"set_cost", rima_set_cost},
+  {"set_coefficient", rima_set_coefficient},
+  {"set_start", rima_set_start},
   {"solve", rima_solve},
   {"get_solution", rima_get_solution},
+  {"get_names", rima_get_names},
+  {"get_sense", rima_get_sense},
+  {"write", rima_write},
   {NULL, NULL}
 };
 
@@ -8,6 +8,7 @@ see LICENSE for license information
 *******************************************************************************/
 
 #include "rima_solver_tools.h"
+#include "rima_coin_tools.h"
 extern "C"
 {
 #include "lauxlib.h"
@@ -15,30 +16,72 @@ LUALIB_API int luaopen_rima_clp_core(lua_State *L);
 }
 
 #include "ClpSimplex.hpp"
-#include "CoinBuild.hpp"
+#include "ClpInterior.hpp"
+#include "ClpCholeskyBase.hpp"
+#include "ClpCholeskyDense.hpp"
+#include "ClpSolve.hpp"
+#include "CoinPackedMatrix.hpp"
 
 static const char metatable_name[] = "rima.clp";
 
 
 /*============================================================================*/
 
-static ClpSimplex *get_model(lua_State *L)
+// The model stays alive between solves, so we keep track of what's changed
+// since the last solve to choose how to restart from the old basis.
+struct rima_clp_model
 {
-  return (ClpSimplex*)luaL_checkudata(L, 1, metatable_name);
+  rima_clp_model() : changes(0), solved(false), algorithm(0) {}
+
+  ClpSimplex model;
+  unsigned changes;
+  bool solved;
+  const char *algorithm;                // The algorithm used for the last solve
+};
+
+
+static rima_clp_model *get_model(lua_State *L)
+{
+  return (rima_clp_model*)luaL_checkudata(L, 1, metatable_name);
 }
 
 
 static int rima_new(lua_State *L)
 {
-  ClpSimplex *model = 0;
+  rima_clp_model *M = 0;
+
+  try
+  {
+    M = new(lua_newuserdata(L, sizeof(rima_clp_model))) rima_clp_model();
+
+    luaL_getmetatable(L, metatable_name);
+    lua_setmetatable(L, -2);
+    M->model.setLogLevel(0);
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+
+  return 1;
+}
+
+
+// Read a model from an MPS file, keeping its row and column names.  COIN
+// reads gzipped files if it was built with zlib.
+static int rima_read_mps(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  rima_clp_model *M = 0;
 
   try
   {
-    model = new(lua_newuserdata(L, sizeof(ClpSimplex))) ClpSimplex();
+    M = new(lua_newuserdata(L, sizeof(rima_clp_model))) rima_clp_model();
 
     luaL_getmetatable(L, metatable_name);
     lua_setmetatable(L, -2);
-    model->setLogLevel(0);
+    M->model.setLogLevel(0);
+    if (M->model.readMps(filename, true) != 0)
+      return error(L, "Couldn't read the MPS file");
   }
   catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
   catch (std::exception &e)     { return error(L, e.what()); }
@@ -50,61 +93,50 @@ static int rima_new(lua_State *L)
 
 static int rima_resize(lua_State *L)
 {
-  ClpSimplex *model = (ClpSimplex*)luaL_checkudata(L, 1, metatable_name);
+  rima_clp_model *M = get_model(L);
   luaL_checkinteger(L, 2);
   luaL_checkinteger(L, 3);
   int rows = lua_tointeger(L, 2), columns = lua_tointeger(L, 3);
   if (rows < 0) return error(L, "bad argument #1 to 'resize' (positive integer number of rows expected)");
   if (columns < 0) return error(L, "bad argument #2 to 'resize' (positive integer number of rows expected)");
 
-  model->resize(rows, columns);
+  M->model.resize(rows, columns);
+  M->solved = false;
 
   lua_pushboolean(L, 1);
   return 1;
 }
 
 
-static const char *build_constraint(void *M, unsigned non_zeroes, int *columns, double *coefficients, double lower, double upper)
-{
-  ((CoinBuild*)M)->addRow(non_zeroes, &columns[0], &coefficients[0], lower, upper);
-  return 0;
-}
-
-
 static int rima_build_rows(lua_State *L)
 {
-  ClpSimplex *model = get_model(L);
+  rima_clp_model *M = get_model(L);
+  ClpSimplex *model = &M->model;
   luaL_checktype(L, 2, LUA_TTABLE);
-  unsigned constraint_count = lua_objlen(L, 2);
-  unsigned column_count = model->getNumCols();
 
-  unsigned max_non_zeroes = 0;
-  const char *err = check_constraints(L, constraint_count, column_count, max_non_zeroes);
+  linear_problem P;
+  const char *err = read_constraints(L, 2, model->getNumCols(), P);
   if (err) return error(L, err);
 
-  CoinBuild builder;
-  err = build_constraints(L, max_non_zeroes, constraint_count, -1, build_constraint, &builder);
-  if (err) return error(L, err);
-  model->addRows(builder);
+  try
+  {
+    model->addRows(P.row_count(), vector_data(P.row_lower), vector_data(P.row_upper),
+      vector_data(P.row_starts), vector_data(P.columns), vector_data(P.values));
+    M->changes |= MATRIX_CHANGED;
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
 
   lua_pushboolean(L, 1);
   return 1;
 }
 
 
-static const char *build_variable(void *M, unsigned index, double cost, double lower, double upper, bool integer)
-{
-  ((ClpSimplex*)M)->setObjectiveCoefficient(index, cost);
-  ((ClpSimplex*)M)->setColumnBounds(index, lower, upper);
-  if (integer)
-    ((ClpSimplex*)M)->setInteger(index);
-  return 0;
-}
-
-
 static int rima_set_objective(lua_State *L)
 {
-  ClpSimplex *model = get_model(L);
+  rima_clp_model *M = get_model(L);
+  ClpSimplex *model = &M->model;
   luaL_checktype(L, 2, LUA_TTABLE);
   luaL_checktype(L, 3, LUA_TSTRING);
   unsigned variable_count = lua_objlen(L, 2);
@@ -122,24 +154,256 @@ static int rima_set_objective(lua_State *L)
   else
     return error(L, "The the optimisation direction must be 'minimise' or 'maximise'");
 
-  const char *err = check_variables(L, variable_count);
-  if (err) return error(L, err);
-
-  err = build_variables(L, variable_count, build_variable, model);
+  linear_problem P;
+  const char *err = read_variables(L, 2, P);
   if (err) return error(L, err);
 
+  for (unsigned i = 0; i != column_count; ++i)
+  {
+    model->setObjectiveCoefficient(i, P.costs[i]);
+    model->setColumnBounds(i, P.column_lower[i], P.column_upper[i]);
+    if (P.integer[i])
+      model->setInteger(i);
+  }
   model->setOptimizationDirection(optimization_direction);
+  M->changes |= BOUNDS_CHANGED | COSTS_CHANGED;
 
   lua_pushboolean(L, 1);
   return 1;  
 }
 
 
+static void load(rima_clp_model *M, linear_problem &P)
+{
+  ClpSimplex *model = &M->model;
+
+  std::vector<int> lengths(P.row_count());
+  for (unsigned i = 0; i != P.row_count(); ++i)
+    lengths[i] = P.row_starts[i+1] - P.row_starts[i];
+
+  CoinPackedMatrix matrix(false, P.column_count(), P.row_count(), P.non_zero_count(),
+    vector_data(P.values), vector_data(P.columns), vector_data(P.row_starts), vector_data(lengths));
+
+  model->loadProblem(matrix,
+    vector_data(P.column_lower), vector_data(P.column_upper), vector_data(P.costs),
+    vector_data(P.row_lower), vector_data(P.row_upper));
+  for (unsigned i = 0; i != P.column_count(); ++i)
+    if (P.integer[i])
+      model->setInteger(i);
+  model->setOptimizationDirection(P.maximise ? -1.0 : 1.0);
+  M->solved = false;
+}
+
+
+static int rima_load_problem(lua_State *L)
+{
+  rima_clp_model *M = get_model(L);
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  linear_problem P;
+  const char *err = read_linear_problem(L, 2, P);
+  if (err) return error(L, err);
+
+  try
+  {
+    load(M, P);
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+// Load a model from a cache file written by write_cache.  Returns the model
+// and the names saved with it.
+static int rima_read_cache(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  rima_clp_model *M = 0;
+
+  try
+  {
+    mapped_problem C;
+    const char *err = C.open(filename);
+    if (err) return error(L, err);
+
+    M = new(lua_newuserdata(L, sizeof(rima_clp_model))) rima_clp_model();
+    luaL_getmetatable(L, metatable_name);
+    lua_setmetatable(L, -2);
+    M->model.setLogLevel(0);
+
+    linear_problem P;
+    C.copy(P);
+    load(M, P);
+    push_cache_names(L, C);
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+
+  return 2;
+}
+
+
+static int rima_set_column_bounds(lua_State *L)
+{
+  rima_clp_model *M = get_model(L);
+  int column = luaL_checkinteger(L, 2) - 1;
+  double lower = luaL_checknumber(L, 3), upper = luaL_checknumber(L, 4);
+  if (column < 0 || column >= M->model.getNumCols())
+    return error(L, "bad argument #1 to 'set_column_bounds' (column index out of range)");
+
+  M->model.setColumnBounds(column, lower, upper);
+  M->changes |= BOUNDS_CHANGED;
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int rima_set_row_bounds(lua_State *L)
+{
+  rima_clp_model *M = get_model(L);
+  int row = luaL_checkinteger(L, 2) - 1;
+  double lower = luaL_checknumber(L, 3), upper = luaL_checknumber(L, 4);
+  if (row < 0 || row >= M->model.getNumRows())
+    return error(L, "bad argument #1 to 'set_row_bounds' (row index out of range)");
+
+  M->model.setRowBounds(row, lower, upper);
+  M->changes |= BOUNDS_CHANGED;
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int rima_set_cost(lua_State *L)
+{
+  rima_clp_model *M = get_model(L);
+  int column = luaL_checkinteger(L, 2) - 1;
+  double cost = luaL_checknumber(L, 3);
+  if (column < 0 || column >= M->model.getNumCols())
+    return error(L, "bad argument #1 to 'set_cost' (column index out of range)");
+
+  M->model.setObjectiveCoefficient(column, cost);
+  M->changes |= COSTS_CHANGED;
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int rima_set_coefficient(lua_State *L)
+{
+  rima_clp_model *M = get_model(L);
+  int row = luaL_checkinteger(L, 2) - 1, column = luaL_checkinteger(L, 3) - 1;
+  double value = luaL_checknumber(L, 4);
+  if (row < 0 || row >= M->model.getNumRows())
+    return error(L, "bad argument #1 to 'set_coefficient' (row index out of range)");
+  if (column < 0 || column >= M->model.getNumCols())
+    return error(L, "bad argument #2 to 'set_coefficient' (column index out of range)");
+
+  try
+  {
+    M->model.modifyCoefficient(row, column, value);
+    M->changes |= MATRIX_CHANGED;
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+// Solve with the interior point method, and then, unless asked not to, cross
+// over to a basic solution with a values pass of primal
+static void barrier(ClpSimplex *model, bool dense, bool crossover)
+{
+  ClpInterior interior;
+  interior.borrowModel(*model);
+  ClpCholeskyBase *cholesky = dense ? new ClpCholeskyDense() : new ClpCholeskyBase();
+  cholesky->setKKTFlag(false);
+  interior.setCholesky(cholesky);           // interior owns the factorization
+  interior.primalDual();
+  interior.returnModel(*model);
+
+  if (crossover)
+    model->primal(1);
+}
+
+
 static int rima_solve(lua_State *L)
 {
-  ClpSimplex *model = get_model(L);
+  rima_clp_model *M = get_model(L);
+  ClpSimplex *model = &M->model;
 
-  model->primal();
+  const char *algorithm = "default", *cholesky = "sparse";
+  bool crossover = true;
+  const char *err;
+  if ((err = read_option(L, 2, "algorithm", algorithm)) ||
+      (err = read_option(L, 2, "cholesky", cholesky)) ||
+      (err = read_option(L, 2, "crossover", crossover)))
+    return error(L, err);
+
+  bool dense = std::strcmp(cholesky, "dense") == 0;
+  if (!dense && std::strcmp(cholesky, "sparse") != 0)
+    return error(L, "bad option 'cholesky' ('sparse' or 'dense' expected)");
+
+  try
+  {
+    if (std::strcmp(algorithm, "default") == 0)
+    {
+      // Both primal and dual start from the last basis if there is one.  If
+      // only the costs have changed the old basis is still primal feasible,
+      // otherwise it's (most likely) still dual feasible.
+      if (!M->solved || M->changes == COSTS_CHANGED)
+      {
+        model->primal();
+        M->algorithm = "primal";
+      }
+      else
+      {
+        model->dual();
+        M->algorithm = "dual";
+      }
+    }
+    else if (std::strcmp(algorithm, "primal") == 0)
+    {
+      model->primal();
+      M->algorithm = "primal";
+    }
+    else if (std::strcmp(algorithm, "dual") == 0)
+    {
+      model->dual();
+      M->algorithm = "dual";
+    }
+    else if (std::strcmp(algorithm, "barrier") == 0)
+    {
+      barrier(model, dense, crossover);
+      M->algorithm = crossover ? "barrier with crossover" : "barrier";
+    }
+    else if (std::strcmp(algorithm, "automatic") == 0)
+    {
+      // Let Clp choose an algorithm by looking at the shape of the problem
+      ClpSolve options;
+      options.setSolveType(ClpSolve::automatic);
+      model->initialSolve(options);
+      M->algorithm = "automatic";
+    }
+    else
+      return error(L, "bad option 'algorithm' ('default', 'primal', 'dual', 'barrier' or 'automatic' expected)");
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+
+  M->solved = true;
+  M->changes = 0;
 
   if (!model->isProvenOptimal())
     return error(L, "Model not solved to optimality");
@@ -151,52 +415,97 @@ static int rima_solve(lua_State *L)
 
 static int rima_get_solution(lua_State *L)
 {
-  ClpSimplex *model = get_model(L);
+  rima_clp_model *M = get_model(L);
+  ClpSimplex *model = &M->model;
 
   if (!model->isProvenOptimal())
     return error(L, "Model not solved to optimality");
 
   lua_newtable(L);
+  lua_pushstring(L, M->algorithm);
+  lua_setfield(L, -2, "algorithm");
   lua_pushnumber(L, model->getObjValue());
   lua_setfield(L, -2, "objective");
 
-  unsigned column_count = model->getNumCols();
-  const double *primal_vars = model->getColSolution();
-  const double *dual_vars = model->getReducedCost();
+  unsigned column_count = model->getNumCols(), row_count = model->getNumRows();
+  solution_arrays *S = new_solution(L);
+  S->column_primal.assign(model->getColSolution(), model->getColSolution() + column_count);
+  S->column_dual.assign(model->getReducedCost(), model->getReducedCost() + column_count);
+  S->row_primal.assign(model->getRowActivity(), model->getRowActivity() + row_count);
+  S->row_dual.assign(model->getRowPrice(), model->getRowPrice() + row_count);
+  lua_setfield(L, -2, "solution");
+
+  return 1;
+}
+
+
+// The names of the columns and rows, as { columns = {...}, rows = {...} }.
+// Models read from files keep the names in the file; others have generated
+// names.
+static int rima_get_names(lua_State *L)
+{
+  ClpSimplex *model = &get_model(L)->model;
+  int column_count = model->getNumCols(), row_count = model->getNumRows();
+
+  lua_createtable(L, 0, 2);
   lua_createtable(L, column_count, 0);
-  for (unsigned i = 0; i != column_count; ++i)
+  for (int i = 0; i != column_count; ++i)
   {
-    lua_newtable(L);
-    lua_pushnumber(L, primal_vars[i]);
-    lua_setfield(L, -2, "p");
-    lua_pushnumber(L, dual_vars[i]);
-    lua_setfield(L, -2, "d");
+    lua_pushstring(L, model->getColumnName(i).c_str());
     lua_rawseti(L, -2, i + 1);
   }
-  lua_setfield(L, -2, "variables");
-
-  unsigned row_count = model->getNumRows();
-  const double *primal_constraints = model->getRowActivity();
-  const double *dual_constraints = model->getRowPrice();
+  lua_setfield(L, -2, "columns");
   lua_createtable(L, row_count, 0);
-  for (unsigned i = 0; i != row_count; ++i)
+  for (int i = 0; i != row_count; ++i)
   {
-    lua_newtable(L);
-    lua_pushnumber(L, primal_constraints[i]);
-    lua_setfield(L, -2, "p");
-    lua_pushnumber(L, dual_constraints[i]);
-    lua_setfield(L, -2, "d");
+    lua_pushstring(L, model->getRowName(i).c_str());
     lua_rawseti(L, -2, i + 1);
   }
-  lua_setfield(L, -2, "constraints");
+  lua_setfield(L, -2, "rows");
 
   return 1;
 }
 
 
+// The optimisation direction, "minimise" or "maximise"
+static int rima_get_sense(lua_State *L)
+{
+  lua_pushstring(L, get_model(L)->model.optimizationDirection() < 0 ? "maximise" : "minimise");
+  return 1;
+}
+
+
+// Write the model to an MPS or LP file (see write_options)
+static int rima_write(lua_State *L)
+{
+  rima_clp_model *M = get_model(L);
+  ClpSimplex *model = &M->model;
+  const char *filename = luaL_checkstring(L, 2);
+
+  write_options o;
+  const char *err = read_write_options(L, 3, model->getNumCols(), model->getNumRows(), o);
+  if (err) return error(L, err);
+
+  try
+  {
+    err = write_coin_problem(filename, o, *model->matrix(),
+      model->getColLower(), model->getColUpper(), model->getObjCoefficients(),
+      model->integerInformation(), model->getRowLower(), model->getRowUpper(),
+      model->optimizationDirection() < 0);
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+  if (err) return error(L, err);
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
 static int rima_delete(lua_State *L)
 {
-  get_model(L)->~ClpSimplex();
+  get_model(L)->~rima_clp_model();
   return 0;
 }
 
@@ -206,6 +515,11 @@ static int rima_delete(lua_State *L)
 static luaL_Reg rima_functions[] =
 {
   {"new",  rima_new},
+  {"read_mps",  rima_read_mps},
+  {"read_cache",  rima_read_cache},
+  {"write_cache",  write_cache},
+  {"cache_info",  cache_info},
+  {"cache_key",  cache_key},
   {NULL, NULL}
 };
 
@@ -216,8 +530,16 @@ static luaL_Reg rima_methods[] =
   {"resize", rima_resize},
   {"build_rows", rima_build_rows},
   {"set_objective", rima_set_objective},
+  {"load_problem", rima_load_problem},
+  {"set_column_bounds", rima_set_column_bounds},
+  {"set_row_bounds", rima_set_row_bounds},
+  {"set_cost", rima_set_cost},
+  {"set_coefficient", rima_set_coefficient},
   {"solve", rima_solve},
   {"get_solution", rima_get_solution},
+  {"get_names", rima_get_names},
+  {"get_sense", rima_get_sense},
+  {"write", rima_write},
   {NULL, NULL}
 };
 
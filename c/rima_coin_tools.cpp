@@ -0,0 +1,86 @@
+/*******************************************************************************
+
+rima_coin_tools.cpp
+
+Copyright (c) 2012 Incremental IP Limited
+see LICENSE for license information
+
+*******************************************************************************/
+
+#include "rima_coin_tools.h"
+
+#include "CoinPackedMatrix.hpp"
+#include "CoinMpsIO.hpp"
+#include "CoinLpIO.hpp"
+
+#include <vector>
+#include <cstring>
+
+
+/*============================================================================*/
+
+const char *write_coin_problem(const char *filename, const write_options &o,
+  const CoinPackedMatrix &matrix,
+  const double *column_lower, const double *column_upper, const double *costs,
+  const char *integer, const double *row_lower, const double *row_upper,
+  bool maximise)
+{
+  unsigned column_count = matrix.getNumCols();
+
+  std::vector<double> minimise_costs;
+  if (maximise)
+  {
+    minimise_costs.resize(column_count);
+    for (unsigned i = 0; i != column_count; ++i)
+      minimise_costs[i] = -costs[i];
+    costs = vector_data(minimise_costs);
+  }
+
+  std::vector<char> no_integers;
+  if (!integer)
+  {
+    no_integers.resize(column_count, 0);
+    integer = vector_data(no_integers);
+  }
+
+  const char *const *column_names = o.column_names.empty() ? 0 : &o.column_names[0];
+  const char *const *row_names = o.row_names.empty() ? 0 : &o.row_names[0];
+
+  if (std::strcmp(o.format, "lp") == 0)
+  {
+    if (std::strcmp(o.compression, "none") != 0)
+      return "COIN can't compress LP files";
+
+    CoinLpIO writer;
+    writer.setLpDataWithoutRowAndColNames(matrix, column_lower, column_upper, costs, integer,
+      row_lower, row_upper);
+
+    // The LP writer wants a name for the objective after the rows
+    std::vector<const char*> lp_row_names;
+    if (column_names || row_names)
+    {
+      if (!column_names || !row_names)
+        return "To write names to an LP file, both rows and columns need names";
+      lp_row_names.assign(o.row_names.begin(), o.row_names.end());
+      lp_row_names.push_back("objective");
+      writer.setLpDataRowAndColNames(vector_data(lp_row_names), column_names);
+    }
+    if (writer.writeLp(filename, row_names != 0) != 0)
+      return "Couldn't write the LP file";
+  }
+  else
+  {
+    int compression = std::strcmp(o.compression, "gzip") == 0 ? 1 :
+      std::strcmp(o.compression, "bzip2") == 0 ? 2 : 0;
+
+    CoinMpsIO writer;
+    writer.setMpsData(matrix, 1e30, column_lower, column_upper, costs, integer,
+      row_lower, row_upper, column_names, row_names);
+    if (writer.writeMps(filename, compression) != 0)
+      return "Couldn't write the MPS file";
+  }
+  return 0;
+}
+
+
+/*============================================================================*/
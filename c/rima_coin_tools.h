@@ -0,0 +1,30 @@
+/*******************************************************************************
+
+rima_coin_tools.h
+
+Copyright (c) 2012 Incremental IP Limited
+see LICENSE for license information
+
+*******************************************************************************/
+
+#ifndef rima_coin_tools_h
+#define rima_coin_tools_h
+
+#include "rima_solver_tools.h"
+
+class CoinPackedMatrix;
+
+/*============================================================================*/
+
+// Write a problem held by CLP or CBC to a file with COIN's own MPS or LP
+// writer.  integer can be null if there are no integer columns.  Both
+// formats are written as minimisations, so a maximisation's costs are
+// negated.  Returns an error message, or null.
+const char *write_coin_problem(const char *filename, const write_options &o,
+  const CoinPackedMatrix &matrix,
+  const double *column_lower, const double *column_upper, const double *costs,
+  const char *integer, const double *row_lower, const double *row_upper,
+  bool maximise);
+
+/*============================================================================*/
+#endif
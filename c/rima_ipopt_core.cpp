@@ -15,14 +15,87 @@ LUALIB_API int luaopen_rima_ipopt_core(lua_State *L);
 }
 #include "IpTNLP.hpp"
 #include "IpIpoptApplication.hpp"
+#include "IpRegOptions.hpp"
+#include "rima_tape.h"
+#include "rima_solver_tools.h"
 
 #include <limits>
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
 
 #include <cstdio>
 #include <cassert>
 
 static const char metatable_name[] = "rima.ipopt";
+static const char buffer_metatable_name[] = "rima.ipopt.buffer";
+
+
+/*============================================================================*/
+
+// A window onto an array of doubles owned by the core or by IPOPT.  Compiled
+// functions index these directly (1-based), so we don't have to copy x,
+// lambda and the results in and out of Lua tables at every evaluation.
+
+struct rima_buffer
+{
+  double *data;
+  int size;
+  bool writable;
+};
+
+
+static rima_buffer *new_buffer(lua_State *L, bool writable)
+{
+  rima_buffer *b = (rima_buffer*)lua_newuserdata(L, sizeof(rima_buffer));
+  b->data = 0;
+  b->size = 0;
+  b->writable = writable;
+  luaL_getmetatable(L, buffer_metatable_name);
+  lua_setmetatable(L, -2);
+  return b;
+}
+
+
+static void point_buffer(rima_buffer *b, const double *data, int size)
+{
+  b->data = const_cast<double*>(data);
+  b->size = size;
+}
+
+
+static int buffer_index(lua_State *L)
+{
+  rima_buffer *b = (rima_buffer*)luaL_checkudata(L, 1, buffer_metatable_name);
+  int i = luaL_checkint(L, 2);
+  if (i < 1 || i > b->size)
+    lua_pushnil(L);
+  else
+    lua_pushnumber(L, b->data[i-1]);
+  return 1;
+}
+
+
+static int buffer_newindex(lua_State *L)
+{
+  rima_buffer *b = (rima_buffer*)luaL_checkudata(L, 1, buffer_metatable_name);
+  int i = luaL_checkint(L, 2);
+  if (!b->writable)
+    return luaL_error(L, "rima.ipopt: buffer is read-only");
+  if (i < 1 || i > b->size)
+    return luaL_error(L, "rima.ipopt: buffer index %d out of range (1-%d)", i, b->size);
+  b->data[i-1] = luaL_checknumber(L, 3);
+  return 0;
+}
+
+
+static int buffer_len(lua_State *L)
+{
+  rima_buffer *b = (rima_buffer*)luaL_checkudata(L, 1, buffer_metatable_name);
+  lua_pushinteger(L, b->size);
+  return 1;
+}
 
 /*============================================================================*/
 
@@ -88,6 +161,17 @@ class rima_ipopt_problem : public Ipopt::TNLP
                         bool new_lambda, Index nele_hess, Index* iRow,
                         Index* jCol, Number* values);
 
+    /** Called at the end of each iteration.  Returning false stops the solve */
+    virtual bool intermediate_callback(Ipopt::AlgorithmMode mode,
+                                       Index iter, Number obj_value,
+                                       Number inf_pr, Number inf_du,
+                                       Number mu, Number d_norm,
+                                       Number regularization_size,
+                                       Number alpha_du, Number alpha_pr,
+                                       Index ls_trials,
+                                       const IpoptData* ip_data,
+                                       IpoptCalculatedQuantities* ip_cq);
+
     /** This method is called when the algorithm is complete so the TNLP can store/write the solution */
     virtual void finalize_solution(SolverReturn status,
                                    Index n, const Number* x, const Number* z_L, const Number* z_U,
@@ -104,6 +188,106 @@ class rima_ipopt_problem : public Ipopt::TNLP
       hessian_count_,
       model_index_;
 
+    // f, grad f, g and the varying part of the constraint jacobian at the
+    // last x, in that order
+    bool evaluate(const Number *x, bool new_x);
+    bool cache_valid_;
+    std::vector<double> cache_;
+
+    // The constraint jacobian.  Entries that don't depend on x are filled in
+    // once, and the varying ones copied in after each evaluation.
+    std::vector<double> jacobian_;
+    std::vector<int> cj_varying_;
+
+    // Hessian entries that are constant multiples of sigma or of a lambda are
+    // added to the varying ones as terms, rather than being evaluated
+    std::vector<int>
+      hessian_varying_,
+      hessian_term_entries_,
+      hessian_term_multipliers_;        // 0 for sigma, i for lambda[i-1]
+    std::vector<double>
+      hessian_term_values_,
+      hessian_scratch_;
+
+    // What IPOPT can treat as constant
+    bool
+      equality_jacobian_constant_,
+      inequality_jacobian_constant_,
+      hessian_constant_;
+
+    // If IPOPT approximates the hessian, we never build or evaluate it
+    bool limited_memory_;
+
+    // Bounds and the starting point, which can be changed between solves
+    void read_bounds();
+    std::vector<double>
+      x_l_,
+      x_u_,
+      g_l_,
+      g_u_,
+      initial_;
+
+    // The last solution, which a later solve can start from
+    bool has_solution_, warm_start_;
+    std::vector<double>
+      solution_x_,
+      solution_z_L_,
+      solution_z_U_,
+      solution_lambda_;
+
+    // Statistics for the current solve: what IPOPT reported at each
+    // iteration, how often each eval_* callback was called and how long it
+    // took, and the last evaluation error
+    enum callback { EVAL_F, EVAL_GRAD_F, EVAL_G, EVAL_JAC_G, EVAL_H, CALLBACK_COUNT };
+    void reset_statistics();
+    void evaluation_failed(const char *message);
+    int callback_calls_[CALLBACK_COUNT];
+    double callback_times_[CALLBACK_COUNT];
+    std::vector<double>
+      iteration_objective_,
+      iteration_infeasibility_,
+      iteration_dual_infeasibility_,
+      iteration_mu_;
+    int evaluation_failures_;
+    std::string evaluation_error_;
+
+    // A Lua function to call after each iteration, or LUA_NOREF.  If it
+    // returns false, or fails, the solve stops.
+    int iteration_hook_;
+    bool hook_stopped_;
+    std::string hook_error_;
+
+    // If the expressions could be put on tapes, we evaluate them here rather
+    // than calling back into Lua
+    bool use_tapes_;
+    expression_tape
+      fused_tape_,
+      hessian_tape_;
+    std::vector<double> work_;
+
+    // With automatic differentiation there's one tape, for f and g, and we
+    // get the derivatives by sweeping back (and forward) over it
+    bool use_ad_;
+    expression_tape tape_;
+    tape_derivatives derivatives_;
+    std::vector<double>
+      outputs_,
+      gradient_;
+    std::vector<int> jacobian_starts_;
+    bool linear_rows_ready_;            // linear rows of the jacobian are filled in
+
+    // Buffers for the compiled Lua functions, and the sparsity structure,
+    // read once when the problem is built
+    rima_buffer
+      *x_buffer_,
+      *lambda_buffer_,
+      *result_buffer_;
+    std::vector<int>
+      cj_rows_,
+      cj_cols_,
+      hessian_rows_,
+      hessian_cols_;
+
 #ifdef false
 virtual bool get_scaling_parameters(Number& obj_scaling,
                                     bool& use_x_scaling, Index n,
@@ -129,8 +313,70 @@ rima_ipopt_problem::rima_ipopt_problem(
   constraint_count_(constraint_count),
   cj_count_(cj_count),
   hessian_count_(hessian_count),
-  model_index_(model_index)
+  model_index_(model_index),
+  cache_valid_(false),
+  cache_(1 + variable_count + constraint_count),
+  jacobian_(cj_count),
+  equality_jacobian_constant_(false),
+  inequality_jacobian_constant_(false),
+  hessian_constant_(false),
+  limited_memory_(false),
+  has_solution_(false),
+  warm_start_(false),
+  use_tapes_(false),
+  use_ad_(false),
+  linear_rows_ready_(false),
+  x_buffer_(0),
+  lambda_buffer_(0),
+  result_buffer_(0)
 {
+  reset_statistics();
+  iteration_hook_ = LUA_NOREF;
+}
+
+
+/*============================================================================*/
+
+// Counts a call to an eval_* callback, and adds the time until it returns
+class callback_timer
+{
+  public:
+    callback_timer(rima_ipopt_problem &model, rima_ipopt_problem::callback c) :
+      model_(model), c_(c), start_(wall_time())
+    {
+    }
+    ~callback_timer()
+    {
+      ++model_.callback_calls_[c_];
+      model_.callback_times_[c_] += wall_time() - start_;
+    }
+
+  private:
+    rima_ipopt_problem &model_;
+    rima_ipopt_problem::callback c_;
+    double start_;
+};
+
+
+void rima_ipopt_problem::reset_statistics()
+{
+  std::fill(callback_calls_, callback_calls_ + CALLBACK_COUNT, 0);
+  std::fill(callback_times_, callback_times_ + CALLBACK_COUNT, 0.0);
+  iteration_objective_.clear();
+  iteration_infeasibility_.clear();
+  iteration_dual_infeasibility_.clear();
+  iteration_mu_.clear();
+  evaluation_failures_ = 0;
+  evaluation_error_.clear();
+  hook_stopped_ = false;
+  hook_error_.clear();
+}
+
+
+void rima_ipopt_problem::evaluation_failed(const char *message)
+{
+  ++evaluation_failures_;
+  evaluation_error_ = message ? message : "unknown error";
 }
 
 
@@ -147,9 +393,16 @@ bool rima_ipopt_problem::get_nlp_info(Index& n, Index& m, Index& nnz_jac_g,
 }
 
 
-bool rima_ipopt_problem::get_bounds_info(Index n, Number* x_l, Number* x_u,
-                                         Index m, Number* g_l, Number* g_u)
+// Bounds and the starting point are read from the model table once, so that
+// they can be changed between solves
+void rima_ipopt_problem::read_bounds()
 {
+  x_l_.resize(variable_count_);
+  x_u_.resize(variable_count_);
+  initial_.resize(variable_count_);
+  g_l_.resize(constraint_count_);
+  g_u_.resize(constraint_count_);
+
   lua_rawgeti(L_, LUA_REGISTRYINDEX, model_index_);
 
   lua_pushstring(L_, "variables");
@@ -162,15 +415,21 @@ bool rima_ipopt_problem::get_bounds_info(Index n, Number* x_l, Number* x_u,
 
     lua_pushstring(L_, "lower");
     lua_rawget(L_, -2);
-    x_l[i-1] = lua_tonumber(L_, -1);
+    x_l_[i-1] = lua_tonumber(L_, -1);
     lua_pop(L_, 1);
 
     lua_pushstring(L_, "upper");
     lua_rawget(L_, -2);
-    x_u[i-1] = lua_tonumber(L_, -1);
+    x_u_[i-1] = lua_tonumber(L_, -1);
+    lua_pop(L_, 1);
+
     lua_pop(L_, 1);
 
+    lua_pushstring(L_, "initial");
+    lua_rawget(L_, -2);
+    initial_[i-1] = lua_tonumber(L_, -1);
     lua_pop(L_, 1);
+
     lua_pop(L_, 1);
   }
   lua_pop(L_, 1);
@@ -183,18 +442,27 @@ bool rima_ipopt_problem::get_bounds_info(Index n, Number* x_l, Number* x_u,
 
     lua_pushstring(L_, "lower");
     lua_rawget(L_, -2);
-    g_l[i-1] = lua_tonumber(L_, -1);
+    g_l_[i-1] = lua_tonumber(L_, -1);
     lua_pop(L_, 1);
 
     lua_pushstring(L_, "upper");
     lua_rawget(L_, -2);
-    g_u[i-1] = lua_tonumber(L_, -1);
+    g_u_[i-1] = lua_tonumber(L_, -1);
     lua_pop(L_, 1);
     
     lua_pop(L_, 1);
   }
-  lua_pop(L_, 1);
+  lua_pop(L_, 2);
+}
 
+
+bool rima_ipopt_problem::get_bounds_info(Index n, Number* x_l, Number* x_u,
+                                         Index m, Number* g_l, Number* g_u)
+{
+  std::copy(x_l_.begin(), x_l_.end(), x_l);
+  std::copy(x_u_.begin(), x_u_.end(), x_u);
+  std::copy(g_l_.begin(), g_l_.end(), g_l);
+  std::copy(g_u_.begin(), g_u_.end(), g_u);
   return true;
 }
 
@@ -204,113 +472,119 @@ bool rima_ipopt_problem::get_starting_point(Index n, bool init_x, Number* x,
                                             Index m, bool init_lambda,
                                             Number* lambda)
 {
-  assert(init_x == true);
-  assert(init_z == false);
-  assert(init_lambda == false);
-
-  lua_rawgeti(L_, LUA_REGISTRYINDEX, model_index_);
-
-  lua_pushstring(L_, "variables");
-  lua_rawget(L_, -2);
-  for (int i = 1; i <= variable_count_; ++i)
+  // IPOPT only asks for z and lambda if we've asked for a warm start
+  if (init_x)
   {
-    lua_rawgeti(L_, -1, i);
-
-    lua_pushstring(L_, "initial");
-    lua_rawget(L_, -2);
-    x[i-1] = lua_tonumber(L_, -1);
-    lua_pop(L_, 1);
-    
-    lua_pop(L_, 1);
+    const std::vector<double> &start = warm_start_ ? solution_x_ : initial_;
+    std::copy(start.begin(), start.end(), x);
+  }
+  if (init_z)
+  {
+    if (!warm_start_) return false;
+    std::copy(solution_z_L_.begin(), solution_z_L_.end(), z_L);
+    std::copy(solution_z_U_.begin(), solution_z_U_.end(), z_U);
+  }
+  if (init_lambda)
+  {
+    if (!warm_start_) return false;
+    std::copy(solution_lambda_.begin(), solution_lambda_.end(), lambda);
   }
-  lua_pop(L_, 1);
-
   return true;
 }
 
 
-static void push_variables(lua_State *L, int stack_index, const char *name, int variable_count, const Number *x)
+// f, grad f, g and the constraint jacobian share most of their work, so we
+// compute them all in one go whenever x changes, and cache the results for
+// the other callbacks at the same point.
+bool rima_ipopt_problem::evaluate(const Number *x, bool new_x)
 {
-  lua_pushstring(L, name);
-  lua_rawget(L, stack_index-1);
-  for (int i = 1; i <= variable_count; ++i)
+  if (new_x) cache_valid_ = false;
+  if (cache_valid_) return true;
+
+  if (use_ad_)
   {
-    lua_pushnumber(L, x[i-1]);
-    lua_rawseti(L, -2, i);
-  }
-}
+    evaluate_tape(tape_, x, 0.0, 0, &work_[0], &outputs_[0]);
+    cache_[0] = outputs_[0];
+    std::copy(outputs_.begin() + 1, outputs_.end(), &cache_[0] + 1 + variable_count_);
+
+    double *grad = &cache_[0] + 1;
+    std::fill(grad, grad + variable_count_, 0.0);
+    const std::vector<int> &columns = derivatives_.columns[0];
+    if (!columns.empty())
+    {
+      tape_gradient(tape_, derivatives_, 0, &work_[0], &gradient_[0]);
+      for (unsigned j = 0; j != columns.size(); ++j)
+        grad[columns[j]] = gradient_[j];
+    }
 
+    // The jacobian rows of linear constraints don't change
+    for (int i = 1; i <= constraint_count_; ++i)
+      if (!linear_rows_ready_ || derivatives_.degrees[i] > 1)
+        tape_gradient(tape_, derivatives_, i, &work_[0], &jacobian_[0] + jacobian_starts_[i-1]);
+    linear_rows_ready_ = true;
+  }
+  else if (use_tapes_)
+    evaluate_tape(fused_tape_, x, 0.0, 0, &work_[0], &cache_[0]);
+  else
+  {
+    lua_rawgeti(L_, LUA_REGISTRYINDEX, model_index_);
+    lua_getfield(L_, -1, "fused_function");
+    lua_getfield(L_, -2, "x_buffer");
+    lua_getfield(L_, -3, "result_buffer");
+    point_buffer(x_buffer_, x, variable_count_);
+    point_buffer(result_buffer_, &cache_[0], cache_.size());
+
+    int err = lua_pcall(L_, 2, 0, 0);
+    point_buffer(x_buffer_, 0, 0);
+    point_buffer(result_buffer_, 0, 0);
+    if (err)
+    {
+      evaluation_failed(lua_tostring(L_, -1));
+      lua_settop(L_, 0);
+      return false;
+    }
+    lua_settop(L_, 0);
+  }
 
-static void read_result(lua_State *L, int result_count, Number *x)
-{
-  for (int i = 1; i <= result_count; ++i)
+  if (!use_ad_)
   {
-    lua_rawgeti(L, -1, i);
-    x[i-1] = lua_tonumber(L, -1);
-    lua_pop(L, 1);
+    const double *varying = &cache_[0] + 1 + variable_count_ + constraint_count_;
+    for (unsigned k = 0; k != cj_varying_.size(); ++k)
+      jacobian_[cj_varying_[k]] = varying[k];
   }
+
+  cache_valid_ = true;
+  return true;
 }
 
 
 bool rima_ipopt_problem::eval_f(Index n, const Number *x, bool new_x, Number &obj_value)
 {
-  lua_rawgeti(L_, LUA_REGISTRYINDEX, model_index_);
-  lua_pushstring(L_, "objective_function");
-  lua_rawget(L_, -2);
-  push_variables(L_, -2, "variable_table", variable_count_, x);
-
-  int err = lua_pcall(L_, 1, 1, 0);
-  if (err)
-  {
-    std::fprintf(stderr, "Error evaluating objective function for ipopt: %s\n", lua_tostring(L_, -1));
-    return false;
-  }
-
-  obj_value = lua_tonumber(L_, -1);
-  lua_settop(L_, 0);
+  callback_timer timer(*this, EVAL_F);
 
+  if (!evaluate(x, new_x)) return false;
+  obj_value = cache_[0];
   return true;
 }
 
 
 bool rima_ipopt_problem::eval_grad_f(Index n, const Number *x, bool new_x, Number *grad_f)
 {
-  lua_rawgeti(L_, LUA_REGISTRYINDEX, model_index_);
-  lua_pushstring(L_, "objective_jacobian");
-  lua_rawget(L_, -2);
-  push_variables(L_, -2, "variable_table", variable_count_, x);
-
-  int err = lua_pcall(L_, 1, 1, 0);
-  if (err)
-  {
-    std::fprintf(stderr, "Error evaluating objective jacobian for ipopt: %s\n", lua_tostring(L_, -1));
-    return false;
-  }
-
-  read_result(L_, variable_count_, grad_f);
-  lua_settop(L_, 0);
+  callback_timer timer(*this, EVAL_GRAD_F);
 
+  if (!evaluate(x, new_x)) return false;
+  std::copy(&cache_[1], &cache_[1] + variable_count_, grad_f);
   return true;
 }
 
 
 bool rima_ipopt_problem::eval_g(Index n, const Number* x, bool new_x, Index m, Number* g)
 {
-  lua_rawgeti(L_, LUA_REGISTRYINDEX, model_index_);
-  lua_pushstring(L_, "constraint_function");
-  lua_rawget(L_, -2);
-  push_variables(L_, -2, "variable_table", variable_count_, x);
-
-  int err = lua_pcall(L_, 1, 1, 0);
-  if (err)
-  {
-    std::fprintf(stderr, "Error evaluating constraints for ipopt: %s\n", lua_tostring(L_, -1));
-    return false;
-  }
-
-  read_result(L_, constraint_count_, g);
-  lua_settop(L_, 0);
+  callback_timer timer(*this, EVAL_G);
 
+  if (!evaluate(x, new_x)) return false;
+  const double *start = &cache_[0] + 1 + variable_count_;
+  std::copy(start, start + constraint_count_, g);
   return true;
 }
 
@@ -319,39 +593,17 @@ bool rima_ipopt_problem::eval_jac_g(Index n, const Number* x, bool new_x,
                                     Index m, Index nele_jac, Index* iRow, Index *jCol,
                                     Number* values)
 {
-  lua_rawgeti(L_, LUA_REGISTRYINDEX, model_index_);
+  callback_timer timer(*this, EVAL_JAC_G);
 
   if (values != 0)
   {
-    lua_pushstring(L_, "constraint_jacobian");
-    lua_rawget(L_, -2);
-    push_variables(L_, -2, "variable_table", variable_count_, x);
-
-    int err = lua_pcall(L_, 1, 1, 0);
-    if (err)
-    {
-      std::fprintf(stderr, "Error evaluating constraint jacobian for ipopt: %s\n", lua_tostring(L_, -1));
-      return false;
-    }
-
-    read_result(L_, cj_count_, values);
-    lua_settop(L_, 0);
+    if (!evaluate(x, new_x)) return false;
+    std::copy(jacobian_.begin(), jacobian_.end(), values);
   }
   else
   {
-    lua_pushstring(L_, "cj_sparsity");
-    lua_rawget(L_, -2);
-    for (int i = 0; i != nele_jac; ++i)
-    {
-      lua_rawgeti(L_, -1, i+1);
-      lua_rawgeti(L_, -1, 1);
-      iRow[i] = lua_tonumber(L_, -1) - 1;
-      lua_pop(L_, 1);
-      lua_rawgeti(L_, -1, 2);
-      jCol[i] = lua_tonumber(L_, -1) - 1;
-      lua_pop(L_, 1);
-      lua_pop(L_, 1);
-    } 
+    std::copy(cj_rows_.begin(), cj_rows_.end(), iRow);
+    std::copy(cj_cols_.begin(), cj_cols_.end(), jCol);
   }
   return true;
 }
@@ -362,52 +614,138 @@ bool rima_ipopt_problem::eval_h(Index n, const Number* x, bool new_x,
                                 bool new_lambda, Index nele_hess, Index* iRow,
                                 Index* jCol, Number* values)
 {
-  lua_rawgeti(L_, LUA_REGISTRYINDEX, model_index_);
+  callback_timer timer(*this, EVAL_H);
 
-  if (values != 0)
+  // The hessian isn't in the fused evaluation, but if we've moved to a new x,
+  // the cached results are out of date
+  if (new_x) cache_valid_ = false;
+
+  if (limited_memory_) return false;
+
+  if (values != 0 && use_ad_)
   {
-    lua_pushstring(L_, "hessian");
-    lua_rawget(L_, -2);
-    push_variables(L_, -2, "variable_table", variable_count_, x);
-    lua_pushnumber(L_, sigma);
-    push_variables(L_, -4, "lambda_table", constraint_count_, lambda);
+    // The reverse sweeps need the tape's values at x, which are still in
+    // work_ if we've evaluated there
+    if (!evaluate(x, new_x)) return false;
+    tape_hessian(tape_, derivatives_, &work_[0], sigma, lambda, values);
+    return true;
+  }
 
-    int err = lua_pcall(L_, 3, 1, 0);
-    if (err)
+  if (values != 0)
+  {
+    // Evaluate the entries that depend on x, and then add the constant terms
+    std::fill(values, values + hessian_count_, 0.0);
+    if (hessian_varying_.empty())
+      ;
+    else if (use_tapes_)
+      evaluate_tape(hessian_tape_, x, sigma, lambda, &work_[0], &hessian_scratch_[0]);
+    else
     {
-      std::fprintf(stderr, "Error evaluating hessian for ipopt: %s\n", lua_tostring(L_, -1));
-      return false;
+      lua_rawgeti(L_, LUA_REGISTRYINDEX, model_index_);
+      lua_getfield(L_, -1, "hessian");
+      lua_getfield(L_, -2, "x_buffer");
+      lua_pushnumber(L_, sigma);
+      lua_getfield(L_, -4, "lambda_buffer");
+      lua_getfield(L_, -5, "result_buffer");
+      point_buffer(x_buffer_, x, variable_count_);
+      point_buffer(lambda_buffer_, lambda, constraint_count_);
+      point_buffer(result_buffer_, &hessian_scratch_[0], hessian_varying_.size());
+
+      int err = lua_pcall(L_, 4, 0, 0);
+      point_buffer(x_buffer_, 0, 0);
+      point_buffer(lambda_buffer_, 0, 0);
+      point_buffer(result_buffer_, 0, 0);
+      if (err)
+      {
+        evaluation_failed(lua_tostring(L_, -1));
+        lua_settop(L_, 0);
+        return false;
+      }
+      lua_settop(L_, 0);
     }
 
-    read_result(L_, hessian_count_, values);
-    lua_settop(L_, 0);
+    for (unsigned k = 0; k != hessian_varying_.size(); ++k)
+      values[hessian_varying_[k]] = hessian_scratch_[k];
+    for (unsigned t = 0; t != hessian_term_entries_.size(); ++t)
+    {
+      int multiplier = hessian_term_multipliers_[t];
+      values[hessian_term_entries_[t]] +=
+        (multiplier == 0 ? sigma : lambda[multiplier-1]) * hessian_term_values_[t];
+    }
   }
   else
   {
-    lua_pushstring(L_, "hessian_sparsity");
-    lua_rawget(L_, -2);
-    for (int i = 0; i != nele_hess; ++i)
-    {
-      lua_rawgeti(L_, -1, i+1);
-      lua_rawgeti(L_, -1, 1);
-      iRow[i] = lua_tonumber(L_, -1) - 1;
-      lua_pop(L_, 1);
-      lua_rawgeti(L_, -1, 2);
-      jCol[i] = lua_tonumber(L_, -1) - 1;
-      lua_pop(L_, 1);
-      lua_pop(L_, 1);
-    } 
+    std::copy(hessian_rows_.begin(), hessian_rows_.end(), iRow);
+    std::copy(hessian_cols_.begin(), hessian_cols_.end(), jCol);
   }
   return true;
 }
 
 
+bool rima_ipopt_problem::intermediate_callback(Ipopt::AlgorithmMode mode,
+                                               Index iter, Number obj_value,
+                                               Number inf_pr, Number inf_du,
+                                               Number mu, Number d_norm,
+                                               Number regularization_size,
+                                               Number alpha_du, Number alpha_pr,
+                                               Index ls_trials,
+                                               const IpoptData* ip_data,
+                                               IpoptCalculatedQuantities* ip_cq)
+{
+  iteration_objective_.push_back(obj_value);
+  iteration_infeasibility_.push_back(inf_pr);
+  iteration_dual_infeasibility_.push_back(inf_du);
+  iteration_mu_.push_back(mu);
+
+  if (iteration_hook_ == LUA_NOREF) return true;
+
+  lua_rawgeti(L_, LUA_REGISTRYINDEX, iteration_hook_);
+  lua_createtable(L_, 0, 6);
+  lua_pushinteger(L_, iter);
+  lua_setfield(L_, -2, "iteration");
+  lua_pushnumber(L_, obj_value);
+  lua_setfield(L_, -2, "objective");
+  lua_pushnumber(L_, inf_pr);
+  lua_setfield(L_, -2, "infeasibility");
+  lua_pushnumber(L_, inf_du);
+  lua_setfield(L_, -2, "dual_infeasibility");
+  lua_pushnumber(L_, mu);
+  lua_setfield(L_, -2, "mu");
+  lua_pushboolean(L_, mode == Ipopt::RestorationPhaseMode);
+  lua_setfield(L_, -2, "restoration");
+
+  if (lua_pcall(L_, 1, 1, 0))
+  {
+    hook_error_ = lua_tostring(L_, -1) ? lua_tostring(L_, -1) : "error in iteration callback";
+    lua_pop(L_, 1);
+    hook_stopped_ = true;
+    return false;
+  }
+  bool stop = lua_isboolean(L_, -1) && !lua_toboolean(L_, -1);
+  lua_pop(L_, 1);
+  hook_stopped_ = stop;
+  return !stop;
+}
+
+
 void rima_ipopt_problem::finalize_solution(SolverReturn status,
                                            Index n, const Number* x, const Number* z_L, const Number* z_U,
                                            Index m, const Number* g, const Number* lambda,
                                            Number obj_value, const IpoptData* ip_data,
                                            IpoptCalculatedQuantities* ip_cq)
 {
+  if (status == Ipopt::SUCCESS || status == Ipopt::STOP_AT_ACCEPTABLE_POINT)
+  {
+    solution_x_.assign(x, x + n);
+    if (z_L) solution_z_L_.assign(z_L, z_L + n);
+    else solution_z_L_.assign(n, 0.0);
+    if (z_U) solution_z_U_.assign(z_U, z_U + n);
+    else solution_z_U_.assign(n, 0.0);
+    if (lambda) solution_lambda_.assign(lambda, lambda + m);
+    else solution_lambda_.assign(m, 0.0);
+    has_solution_ = true;
+  }
+
   lua_rawgeti(L_, LUA_REGISTRYINDEX, model_index_);
   lua_createtable(L_, 0, 3);
   lua_pushstring(L_, "results");
@@ -459,16 +797,108 @@ void rima_ipopt_problem::finalize_solution(SolverReturn status,
 /*============================================================================*/
 
 
-static int error(lua_State *L, const char *s)
+static const char *read_model_tape(lua_State *L, int index, const char *name, int output_count,
+  const rima_ipopt_problem &model, expression_tape &T)
 {
-  lua_settop(L, 0);
-  lua_pushnil(L);
-  lua_pushstring(L, s);
-  return 2;
+  lua_getfield(L, index, name);
+  const char *err = read_tape(L, -1, model.variable_count_, model.constraint_count_, T);
+  lua_pop(L, 1);
+  if (err) return err;
+  if (T.output_count() != (unsigned)output_count)
+    return "A tape has the wrong number of outputs";
+  return 0;
 }
 
 
-/*============================================================================*/
+// Sparsity comes as flat arrays of 1-based indices, which we check and
+// convert to IPOPT's C-style indices once, up front.  If count is negative,
+// the array can be any length.
+static const char *read_sparsity(lua_State *L, int index, const char *name, int count, int limit,
+  std::vector<int> &indices)
+{
+  lua_getfield(L, index, name);
+  if (lua_istable(L, -1) && count < 0)
+    count = lua_objlen(L, -1);
+  if (!lua_istable(L, -1) || (int)lua_objlen(L, -1) != count)
+  {
+    lua_pop(L, 1);
+    return "Sparsity arrays must be tables of the same length";
+  }
+  indices.resize(count);
+  for (int i = 0; i != count; ++i)
+  {
+    lua_rawgeti(L, -1, i+1);
+    int j = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (j < 1 || j > limit)
+    {
+      lua_pop(L, 1);
+      return "Sparsity index out of range";
+    }
+    indices[i] = j - 1;
+  }
+  lua_pop(L, 1);
+  return 0;
+}
+
+
+static const char *read_numbers(lua_State *L, int index, const char *name, int count,
+  std::vector<double> &values)
+{
+  lua_getfield(L, index, name);
+  if (!lua_istable(L, -1) || (int)lua_objlen(L, -1) != count)
+  {
+    lua_pop(L, 1);
+    return "Constant jacobian and hessian values must match their entries";
+  }
+  values.resize(count);
+  for (int i = 0; i != count; ++i)
+  {
+    lua_rawgeti(L, -1, i+1);
+    values[i] = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return 0;
+}
+
+
+// Work out which parts of the problem IPOPT can treat as constant: the
+// jacobians of the equality and of the inequality constraints if none of
+// their rows vary, and the hessian if it's made only of constant multiples
+// of sigma
+static void find_constant_parts(rima_ipopt_problem &model)
+{
+  std::vector<bool> constant_row(model.constraint_count_, true);
+  if (model.use_ad_)
+  {
+    for (int i = 0; i != model.constraint_count_; ++i)
+      constant_row[i] = model.derivatives_.degrees[i+1] <= 1;
+    model.hessian_constant_ = model.derivatives_.degrees[0] <= 2;
+    for (int i = 0; i != model.constraint_count_; ++i)
+      if (!constant_row[i]) model.hessian_constant_ = false;
+  }
+  else
+  {
+    for (unsigned k = 0; k != model.cj_varying_.size(); ++k)
+      constant_row[model.cj_rows_[model.cj_varying_[k]]] = false;
+    model.hessian_constant_ = model.hessian_varying_.empty();
+    for (unsigned t = 0; t != model.hessian_term_multipliers_.size(); ++t)
+      if (model.hessian_term_multipliers_[t] != 0) model.hessian_constant_ = false;
+  }
+
+  model.equality_jacobian_constant_ = true;
+  model.inequality_jacobian_constant_ = true;
+  for (int i = 0; i != model.constraint_count_; ++i)
+    if (!constant_row[i])
+    {
+      if (model.g_l_[i] == model.g_u_[i])
+        model.equality_jacobian_constant_ = false;
+      else
+        model.inequality_jacobian_constant_ = false;
+    }
+}
+
 
 static int rima_new(lua_State *L)
 {
@@ -485,24 +915,85 @@ static int rima_new(lua_State *L)
   int constraint_count = lua_objlen(L, -1);
   lua_pop(L, 1);
 
-  lua_pushstring(L, "cj_sparsity");
-  lua_rawget(L, -2);
-  int cj_count = lua_objlen(L, -1);
+  // "exact", "limited-memory", or "automatic", which uses limited-memory if
+  // there are at least 100 variables and the hessian would have more than
+  // hessian_density of its possible entries
+  const char *approximation = "exact";
+  double density = 1.0;
+  const char *err;
+  if ((err = read_option(L, 1, "hessian_approximation", approximation)) ||
+      (err = read_option(L, 1, "hessian_density", density)))
+    return error(L, err);
+  bool limited_memory = std::strcmp(approximation, "limited-memory") == 0;
+  if (!limited_memory &&
+      std::strcmp(approximation, "exact") != 0 &&
+      std::strcmp(approximation, "automatic") != 0)
+    return error(L, "bad option 'hessian_approximation' ('exact', 'limited-memory' or 'automatic' expected)");
+
+  // If we're given a tape of f and g to differentiate, we work out the
+  // sparsity ourselves
+  expression_tape ad_tape;
+  tape_derivatives derivatives;
+  lua_getfield(L, 1, "tape");
+  bool use_ad = !lua_isnil(L, -1);
   lua_pop(L, 1);
 
-  lua_pushstring(L, "hessian_sparsity");
-  lua_rawget(L, -2);
-  int hessian_count = lua_objlen(L, -1);
-  lua_pop(L, 1);
+  int cj_count, hessian_count;
+  if (use_ad)
+  {
+    try
+    {
+      lua_getfield(L, 1, "tape");
+      err = read_tape(L, -1, variable_count, constraint_count, ad_tape);
+      lua_pop(L, 1);
+      if (err) return error(L, err);
+      if (ad_tape.output_count() != (unsigned)constraint_count + 1)
+        return error(L, "The tape must have the objective and every constraint as outputs");
+      prepare_derivatives(ad_tape, variable_count, derivatives, !limited_memory);
+    }
+    catch (std::bad_alloc)      { return error(L, "Memory allocation failure"); }
+    cj_count = derivatives.jacobian_rows.size();
+    hessian_count = derivatives.hessian_rows.size();
+
+    if (std::strcmp(approximation, "automatic") == 0 && variable_count >= 100 &&
+        hessian_count > density * 0.5 * variable_count * (variable_count + 1.0))
+      limited_memory = true;
+    if (limited_memory)
+    {
+      derivatives.hessian_rows.clear();
+      derivatives.hessian_cols.clear();
+      derivatives.hessian_columns.clear();
+      hessian_count = 0;
+    }
+  }
+  else if (limited_memory)
+  {
+    lua_pushstring(L, "cj_rows");
+    lua_rawget(L, -2);
+    cj_count = lua_objlen(L, -1);
+    lua_pop(L, 1);
+    hessian_count = 0;
+  }
+  else
+  {
+    lua_pushstring(L, "cj_rows");
+    lua_rawget(L, -2);
+    cj_count = lua_objlen(L, -1);
+    lua_pop(L, 1);
+
+    lua_pushstring(L, "hessian_rows");
+    lua_rawget(L, -2);
+    hessian_count = lua_objlen(L, -1);
+    lua_pop(L, 1);
+  }
 
-  lua_pushstring(L, "variable_table");
-  lua_createtable(L, variable_count, 0);
-  lua_settable(L, -3);
+  rima_buffer *x_buffer = new_buffer(L, false);
+  lua_setfield(L, 1, "x_buffer");
+  rima_buffer *lambda_buffer = new_buffer(L, false);
+  lua_setfield(L, 1, "lambda_buffer");
+  rima_buffer *result_buffer = new_buffer(L, true);
+  lua_setfield(L, 1, "result_buffer");
 
-  lua_pushstring(L, "lambda_table");
-  lua_createtable(L, constraint_count, 0);
-  lua_settable(L, -3);
-  
   int model_index = luaL_ref(L, LUA_REGISTRYINDEX);
 
   rima_ipopt_problem *model = 0;
@@ -520,6 +1011,71 @@ static int rima_new(lua_State *L)
     model->AddRef((Ipopt::Referencer*)L);
     luaL_getmetatable(L, metatable_name);
     lua_setmetatable(L, -2);
+
+    model->x_buffer_ = x_buffer;
+    model->lambda_buffer_ = lambda_buffer;
+    model->result_buffer_ = result_buffer;
+
+    model->limited_memory_ = limited_memory;
+    model->read_bounds();
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, model_index);
+    int problem = lua_gettop(L);
+    if (use_ad)
+    {
+      model->cj_rows_ = derivatives.jacobian_rows;
+      model->cj_cols_ = derivatives.jacobian_cols;
+      model->hessian_rows_ = derivatives.hessian_rows;
+      model->hessian_cols_ = derivatives.hessian_cols;
+      model->tape_.code.swap(ad_tape.code);
+      model->tape_.outputs.swap(ad_tape.outputs);
+      std::swap(model->derivatives_, derivatives);
+      model->work_.resize(std::max(model->tape_.size(), 1u));
+      model->outputs_.resize(constraint_count + 1);
+      model->gradient_.resize(std::max(variable_count, 1));
+      model->jacobian_starts_.resize(constraint_count);
+      for (int i = 0, start = 0; i != constraint_count; ++i)
+      {
+        model->jacobian_starts_[i] = start;
+        start += model->derivatives_.columns[i+1].size();
+      }
+      model->use_ad_ = true;
+    }
+    else
+    {
+      std::vector<int> &multipliers = model->hessian_term_multipliers_;
+      if ((err = read_sparsity(L, problem, "cj_rows", cj_count, constraint_count, model->cj_rows_)) ||
+          (err = read_sparsity(L, problem, "cj_cols", cj_count, variable_count, model->cj_cols_)) ||
+          (err = read_numbers(L, problem, "cj_values", cj_count, model->jacobian_)) ||
+          (err = read_sparsity(L, problem, "cj_varying", -1, cj_count, model->cj_varying_)))
+        return error(L, err);
+      if (!limited_memory &&
+         ((err = read_sparsity(L, problem, "hessian_rows", hessian_count, variable_count, model->hessian_rows_)) ||
+          (err = read_sparsity(L, problem, "hessian_cols", hessian_count, variable_count, model->hessian_cols_)) ||
+          (err = read_sparsity(L, problem, "hessian_varying", -1, hessian_count, model->hessian_varying_)) ||
+          (err = read_sparsity(L, problem, "hessian_term_entries", -1, hessian_count, model->hessian_term_entries_)) ||
+          (err = read_sparsity(L, problem, "hessian_term_multipliers", model->hessian_term_entries_.size(), constraint_count + 1, multipliers)) ||
+          (err = read_numbers(L, problem, "hessian_term_values", model->hessian_term_entries_.size(), model->hessian_term_values_))))
+        return error(L, err);
+      model->cache_.resize(model->cache_.size() + model->cj_varying_.size());
+      model->hessian_scratch_.resize(std::max(model->hessian_varying_.size(), (size_t)1));
+    }
+
+    lua_getfield(L, -1, "fused_tape");
+    bool has_tapes = !use_ad && !lua_isnil(L, -1);
+    lua_pop(L, 1);
+    if (has_tapes)
+    {
+      if ((err = read_model_tape(L, problem, "fused_tape", model->cache_.size(), *model, model->fused_tape_)) ||
+          (!limited_memory &&
+           (err = read_model_tape(L, problem, "hessian_tape", model->hessian_varying_.size(), *model, model->hessian_tape_))))
+        return error(L, err);
+
+      unsigned work_size = std::max(model->fused_tape_.size(), model->hessian_tape_.size());
+      model->work_.resize(std::max(work_size, 1u));
+      model->use_tapes_ = true;
+    }
+    lua_pop(L, 1);
   }
   catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
   catch (std::exception &e)     { return error(L, e.what()); }
@@ -529,26 +1085,254 @@ static int rima_new(lua_State *L)
 }
 
 
+// Set the options in a table of IPOPT options ({ name = value }), using
+// IPOPT's own idea of each option's type
+static const char *set_ipopt_options(lua_State *L, int index, Ipopt::IpoptApplication &app)
+{
+  lua_getfield(L, index, "ipopt");
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+    return 0;
+  }
+  if (!lua_istable(L, -1))
+  {
+    lua_pop(L, 1);
+    return "bad option 'ipopt' (table expected)";
+  }
+
+  static char message[200];
+  for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1))
+  {
+    const char *name = lua_type(L, -2) == LUA_TSTRING ? lua_tostring(L, -2) : 0;
+    Ipopt::SmartPtr<const Ipopt::RegisteredOption> option;
+    if (name) option = app.RegOptions()->GetOption(name);
+    if (!name || Ipopt::IsNull(option))
+    {
+      std::snprintf(message, sizeof(message), "unknown IPOPT option '%s'", name ? name : "?");
+      lua_pop(L, 3);
+      return message;
+    }
+
+    bool ok = false;
+    switch (option->Type())
+    {
+    case Ipopt::OT_Number:
+      ok = lua_type(L, -1) == LUA_TNUMBER &&
+        app.Options()->SetNumericValue(name, lua_tonumber(L, -1));
+      break;
+    case Ipopt::OT_Integer:
+      ok = lua_type(L, -1) == LUA_TNUMBER &&
+        app.Options()->SetIntegerValue(name, (Ipopt::Index)lua_tointeger(L, -1));
+      break;
+    case Ipopt::OT_String:
+      if (lua_type(L, -1) == LUA_TBOOLEAN)
+        ok = app.Options()->SetStringValue(name, lua_toboolean(L, -1) ? "yes" : "no");
+      else
+        ok = lua_type(L, -1) == LUA_TSTRING &&
+          app.Options()->SetStringValue(name, lua_tostring(L, -1));
+      break;
+    default:
+      break;
+    }
+    if (!ok)
+    {
+      std::snprintf(message, sizeof(message), "bad value for IPOPT option '%s'", name);
+      lua_pop(L, 3);
+      return message;
+    }
+  }
+  lua_pop(L, 1);
+  return 0;
+}
+
+
+static void push_list(lua_State *L, const std::vector<double> &v)
+{
+  lua_createtable(L, v.size(), 0);
+  for (unsigned i = 0; i != v.size(); ++i)
+  {
+    lua_pushnumber(L, v[i]);
+    lua_rawseti(L, -2, i+1);
+  }
+}
+
+
+// Push a table of what happened during the last solve
+static void push_statistics(lua_State *L, const rima_ipopt_problem &model, double total_time)
+{
+  static const char *callback_names[rima_ipopt_problem::CALLBACK_COUNT] =
+    { "eval_f", "eval_grad_f", "eval_g", "eval_jac_g", "eval_h" };
+
+  lua_createtable(L, 0, 10);
+
+  lua_pushinteger(L, model.iteration_objective_.size());
+  lua_setfield(L, -2, "iterations");
+  push_list(L, model.iteration_objective_);
+  lua_setfield(L, -2, "objective");
+  push_list(L, model.iteration_infeasibility_);
+  lua_setfield(L, -2, "infeasibility");
+  push_list(L, model.iteration_dual_infeasibility_);
+  lua_setfield(L, -2, "dual_infeasibility");
+  push_list(L, model.iteration_mu_);
+  lua_setfield(L, -2, "mu");
+
+  double callback_time = 0;
+  lua_createtable(L, 0, rima_ipopt_problem::CALLBACK_COUNT);
+  for (int c = 0; c != rima_ipopt_problem::CALLBACK_COUNT; ++c)
+  {
+    lua_createtable(L, 0, 2);
+    lua_pushinteger(L, model.callback_calls_[c]);
+    lua_setfield(L, -2, "calls");
+    lua_pushnumber(L, model.callback_times_[c]);
+    lua_setfield(L, -2, "time");
+    lua_setfield(L, -2, callback_names[c]);
+    callback_time += model.callback_times_[c];
+  }
+  lua_setfield(L, -2, "callbacks");
+
+  lua_pushnumber(L, callback_time);
+  lua_setfield(L, -2, "callback_time");
+  lua_pushnumber(L, total_time - callback_time);
+  lua_setfield(L, -2, "ipopt_time");
+  lua_pushnumber(L, total_time);
+  lua_setfield(L, -2, "total_time");
+
+  lua_pushinteger(L, model.evaluation_failures_);
+  lua_setfield(L, -2, "evaluation_failures");
+  if (!model.evaluation_error_.empty())
+  {
+    lua_pushstring(L, model.evaluation_error_.c_str());
+    lua_setfield(L, -2, "evaluation_error");
+  }
+}
+
+
 static int rima_solve(lua_State *L)
 {
   rima_ipopt_problem &model = *(rima_ipopt_problem*)luaL_checkudata(L, 1, metatable_name);
 
+  double tol = 1e-9;
+  int print_level = 0, max_iter = 3000, history = 6;
+  bool warm_start = true;
+  const char *err;
+  if ((err = read_option(L, 2, "tol", tol)) ||
+      (err = read_option(L, 2, "print_level", print_level)) ||
+      (err = read_option(L, 2, "max_iter", max_iter)) ||
+      (err = read_option(L, 2, "limited_memory_max_history", history)) ||
+      (err = read_option(L, 2, "warm_start", warm_start)))
+    return error(L, err);
+
+  if (lua_istable(L, 2))
+  {
+    lua_getfield(L, 2, "iteration_callback");
+    if (!lua_isnil(L, -1) && !lua_isfunction(L, -1))
+      return error(L, "bad option 'iteration_callback' (function expected)");
+    lua_pop(L, 1);
+  }
+
+  find_constant_parts(model);
+
   Ipopt::IpoptApplication app;
-  app.Options()->SetNumericValue("tol", 1e-9);
-  app.Options()->SetIntegerValue("print_level", 0);
+  app.Options()->SetNumericValue("tol", tol);
+  app.Options()->SetIntegerValue("print_level", print_level);
+  app.Options()->SetIntegerValue("max_iter", max_iter);
   app.Options()->SetStringValue("mu_strategy", "adaptive");
+  if (model.equality_jacobian_constant_)
+    app.Options()->SetStringValue("jac_c_constant", "yes");
+  if (model.inequality_jacobian_constant_)
+    app.Options()->SetStringValue("jac_d_constant", "yes");
+  if (model.limited_memory_)
+  {
+    app.Options()->SetStringValue("hessian_approximation", "limited-memory");
+    app.Options()->SetIntegerValue("limited_memory_max_history", history);
+  }
+  else if (model.hessian_constant_)
+    app.Options()->SetStringValue("hessian_constant", "yes");
+
+  // Restart from the last primal-dual solution if there is one.  The point
+  // is (nearly) optimal, so we don't push it far from the bounds, and start
+  // with a small barrier parameter.
+  model.warm_start_ = warm_start && model.has_solution_;
+  if (model.warm_start_)
+  {
+    app.Options()->SetStringValue("warm_start_init_point", "yes");
+    app.Options()->SetNumericValue("warm_start_bound_push", 1e-6);
+    app.Options()->SetNumericValue("warm_start_bound_frac", 1e-6);
+    app.Options()->SetNumericValue("warm_start_slack_bound_push", 1e-6);
+    app.Options()->SetNumericValue("warm_start_slack_bound_frac", 1e-6);
+    app.Options()->SetNumericValue("warm_start_mult_bound_push", 1e-6);
+    app.Options()->SetNumericValue("mu_init", 1e-6);
+  }
+
+  // Anything in the ipopt table overrides all of the above
+  if (lua_istable(L, 2) && (err = set_ipopt_options(L, 2, app)))
+    return error(L, err);
+
+  // Forget the last solve's results, so they can't be mistaken for these
+  lua_rawgeti(L, LUA_REGISTRYINDEX, model.model_index_);
+  lua_pushnil(L);
+  lua_setfield(L, -2, "results");
+  lua_pop(L, 1);
+
+  model.reset_statistics();
+  if (lua_istable(L, 2))
+  {
+    lua_getfield(L, 2, "iteration_callback");
+    if (lua_isfunction(L, -1))
+      model.iteration_hook_ = luaL_ref(L, LUA_REGISTRYINDEX);
+    else
+      lua_pop(L, 1);
+  }
+
+  double start = wall_time();
   app.Initialize();
   Ipopt::ApplicationReturnStatus status = app.OptimizeTNLP(&model);
-  if (status != Ipopt::Solve_Succeeded)
-    return error(L, "Solve failed");
+  double total_time = wall_time() - start;
+
+  luaL_unref(L, LUA_REGISTRYINDEX, model.iteration_hook_);
+  model.iteration_hook_ = LUA_NOREF;
 
+  lua_settop(L, 1);
   lua_rawgeti(L, LUA_REGISTRYINDEX, model.model_index_);
   lua_getfield(L, -1, "results");
-  lua_getfield(L, -1, "success");
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, "results");
+  }
+  lua_remove(L, -2);
+
+  // The statistics are kept with the results even if the solve fails, so
+  // get_solution can show what went wrong
+  push_statistics(L, model, total_time);
+  lua_setfield(L, -2, "statistics");
+
+  if (model.hook_stopped_)
+  {
+    if (!model.hook_error_.empty())
+      return error(L, ("Error in iteration callback: " + model.hook_error_).c_str());
+    return error(L, "Solve stopped by the iteration callback");
+  }
+  if (status != Ipopt::Solve_Succeeded)
+  {
+    if (!model.evaluation_error_.empty())
+      return error(L, ("Solve failed: " + model.evaluation_error_).c_str());
+    return error(L, "Solve failed");
+  }
 
+  lua_getfield(L, -1, "success");
   unsigned success = lua_toboolean(L, -1);
   lua_pop(L, 1);
-  lua_remove(L, -2);
+
+  lua_pushstring(L, model.limited_memory_ ? "limited-memory" : "exact");
+  lua_setfield(L, -2, "hessian_approximation");
+  lua_pushboolean(L, model.warm_start_);
+  lua_setfield(L, -2, "warm_start");
+  lua_pushinteger(L, app.Statistics()->IterationCount());
+  lua_setfield(L, -2, "iterations");
 
   if (success)
     return 1;
@@ -557,6 +1341,44 @@ static int rima_solve(lua_State *L)
 }
 
 
+// The results of the last solve
+static int rima_get_solution(lua_State *L)
+{
+  rima_ipopt_problem &model = *(rima_ipopt_problem*)luaL_checkudata(L, 1, metatable_name);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, model.model_index_);
+  lua_getfield(L, -1, "results");
+  if (lua_isnil(L, -1))
+    return error(L, "The model hasn't been solved");
+  return 1;
+}
+
+
+static int set_bounds(lua_State *L, std::vector<double> &lower, std::vector<double> &upper)
+{
+  int i = luaL_checkint(L, 2);
+  if (i < 1 || i > (int)lower.size())
+    return error(L, "Index out of range");
+  lower[i-1] = luaL_checknumber(L, 3);
+  upper[i-1] = luaL_checknumber(L, 4);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int rima_set_column_bounds(lua_State *L)
+{
+  rima_ipopt_problem &model = *(rima_ipopt_problem*)luaL_checkudata(L, 1, metatable_name);
+  return set_bounds(L, model.x_l_, model.x_u_);
+}
+
+
+static int rima_set_row_bounds(lua_State *L)
+{
+  rima_ipopt_problem &model = *(rima_ipopt_problem*)luaL_checkudata(L, 1, metatable_name);
+  return set_bounds(L, model.g_l_, model.g_u_);
+}
+
+
 static int rima_eval(lua_State *L)
 {
   rima_ipopt_problem &model = *(rima_ipopt_problem*)luaL_checkudata(L, 1, metatable_name);
@@ -658,11 +1480,98 @@ static int rima_eval(lua_State *L)
 }
 
 
+// Time each callback: call it "repeats" times (default 1000) at points that
+// alternate between the starting point and a point just off it, so nothing
+// is cached between calls.  f, grad f, g and the jacobian share one fused
+// evaluation, so each of their times includes that evaluation.
+// Returns a table of { calls, ns_per_call, ns_per_nonzero } for each callback.
+static int rima_benchmark(lua_State *L)
+{
+  rima_ipopt_problem &model = *(rima_ipopt_problem*)luaL_checkudata(L, 1, metatable_name);
+  int repeats = luaL_optint(L, 2, 1000);
+  if (repeats < 1)
+    return error(L, "bad argument #1 to 'benchmark' (positive number of repeats expected)");
+
+  int n = model.variable_count_, m = model.constraint_count_;
+  std::vector<double>
+    x0(std::max(n, 1)),
+    x1(x0.size()),
+    lambda(std::max(m, 1), 1.0),
+    grad(x0.size()),
+    g(lambda.size()),
+    cj(std::max(model.cj_count_, 1)),
+    h(std::max(model.hessian_count_, 1));
+  std::vector<int>
+    cj_rows(cj.size()), cj_cols(cj.size()),
+    h_rows(h.size()), h_cols(h.size());
+
+  model.get_starting_point(n, true, &x0[0], false, 0, 0, m, false, 0);
+  for (int i = 0; i != n; ++i)
+    x1[i] = x0[i] + 1e-3;
+
+  // IPOPT asks for the structure before any values
+  model.eval_jac_g(n, &x0[0], true, m, model.cj_count_, &cj_rows[0], &cj_cols[0], 0);
+  bool hessian = !model.limited_memory_;
+  if (hessian)
+    model.eval_h(n, &x0[0], true, 1.0, m, &lambda[0], true, model.hessian_count_, &h_rows[0], &h_cols[0], 0);
+
+  static const char *names[rima_ipopt_problem::CALLBACK_COUNT] = { "f", "grad_f", "g", "jacobian", "hessian" };
+  int nonzeros[rima_ipopt_problem::CALLBACK_COUNT] = { 1, n, m, model.cj_count_, model.hessian_count_ };
+  lua_createtable(L, 0, rima_ipopt_problem::CALLBACK_COUNT);
+
+  for (int c = 0; c != rima_ipopt_problem::CALLBACK_COUNT; ++c)
+  {
+    if (c == rima_ipopt_problem::EVAL_H && !hessian) continue;
+
+    double start = wall_time(), f;
+    bool ok = true;
+    for (int r = 0; r != repeats && ok; ++r)
+    {
+      const double *x = r % 2 ? &x1[0] : &x0[0];
+      switch (c)
+      {
+      case rima_ipopt_problem::EVAL_F:
+        ok = model.eval_f(n, x, true, f);
+        break;
+      case rima_ipopt_problem::EVAL_GRAD_F:
+        ok = model.eval_grad_f(n, x, true, &grad[0]);
+        break;
+      case rima_ipopt_problem::EVAL_G:
+        ok = model.eval_g(n, x, true, m, &g[0]);
+        break;
+      case rima_ipopt_problem::EVAL_JAC_G:
+        ok = model.eval_jac_g(n, x, true, m, model.cj_count_, 0, 0, &cj[0]);
+        break;
+      case rima_ipopt_problem::EVAL_H:
+        ok = model.eval_h(n, x, true, 1.0, m, &lambda[0], true, model.hessian_count_, 0, 0, &h[0]);
+        break;
+      }
+    }
+    if (!ok)
+      return error(L, ("Evaluation failed: " + model.evaluation_error_).c_str());
+    double ns = (wall_time() - start) * 1e9 / repeats;
+
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, repeats);
+    lua_setfield(L, -2, "calls");
+    lua_pushnumber(L, ns);
+    lua_setfield(L, -2, "ns_per_call");
+    lua_pushnumber(L, nonzeros[c] > 0 ? ns / nonzeros[c] : 0.0);
+    lua_setfield(L, -2, "ns_per_nonzero");
+    lua_pushinteger(L, nonzeros[c]);
+    lua_setfield(L, -2, "nonzeros");
+    lua_setfield(L, -2, names[c]);
+  }
+  return 1;
+}
+
+
 static int rima_delete(lua_State *L)
 {
   rima_ipopt_problem *model = (rima_ipopt_problem*)luaL_checkudata(L, 1, metatable_name);
   int model_index = model->model_index_;
   model->ReleaseRef((Ipopt::Referencer*)model->L_);
+  model->~rima_ipopt_problem();
   luaL_unref(L, LUA_REGISTRYINDEX, model_index);
 
   return 0;
@@ -683,14 +1592,31 @@ static luaL_Reg rima_methods[] =
 //  {"resize", rima_resize},
 //  {"build_rows", rima_build_rows},
 //  {"set_objective", rima_set_objective},
+  {"set_column_bounds", rima_set_column_bounds},
+  {"set_row_bounds", rima_set_row_bounds},
   {"solve", rima_solve},
-//  {"get_solution", rima_get_solution},
+  {"get_solution", rima_get_solution},
   {"eval", rima_eval},
+  {"benchmark", rima_benchmark},
+  {NULL, NULL}
+};
+
+static luaL_Reg buffer_methods[] =
+{
+  {"__index", buffer_index},
+  {"__newindex", buffer_newindex},
+  {"__len", buffer_len},
   {NULL, NULL}
 };
 
 LUALIB_API int luaopen_rima_ipopt_core(lua_State *L)
 {
+  // Buffers only have metamethods
+  luaL_newmetatable(L, buffer_metatable_name);
+  luaL_register(L, NULL, buffer_methods);
+  lua_pop(L, 1);
+
+
   // Create a metatable for our object
   luaL_newmetatable(L, metatable_name);
   
@@ -25,9 +25,18 @@ static const char metatable_name[] = "rima.lpsolve";
 
 /*============================================================================*/
 
-static lprec *get_model(lua_State *L)
+// lp_solve restarts from the last basis by itself, but we keep track of
+// what's changed since the last solve so we can choose the simplex phases.
+struct rima_lpsolve_model
 {
-  return *(lprec**)luaL_checkudata(L, 1, metatable_name);
+  lprec *lp;
+  unsigned changes;
+};
+
+
+static rima_lpsolve_model *get_model(lua_State *L)
+{
+  return (rima_lpsolve_model*)luaL_checkudata(L, 1, metatable_name);
 }
 
 
@@ -39,15 +48,44 @@ static int rima_new(lua_State *L)
   if (rows < 0) return error(L, "bad argument #1 to 'new' (positive integer number of rows expected)");
   if (columns < 0) return error(L, "bad argument #2 to 'new' (positive integer number of rows expected)");
   
-  lprec **model = 0;
+  rima_lpsolve_model *M = 0;
+  try
+  {
+    M = (rima_lpsolve_model*)lua_newuserdata(L, sizeof(rima_lpsolve_model));
+    M->lp = 0;
+    M->changes = 0;
+    luaL_getmetatable(L, metatable_name);
+    lua_setmetatable(L, -2);
+    M->lp = make_lp(0, columns);
+    if (!M->lp) return error(L, "Memory allocation failure");
+    resize_lp(M->lp, rows, columns);
+    set_verbose(M->lp, 0);
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+
+  return 1;
+}
+
+
+// Read a model from a (fixed format, uncompressed) MPS file, keeping its row
+// and column names
+static int rima_read_mps(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+
+  rima_lpsolve_model *M = 0;
   try
   {
-    model = (lprec**)lua_newuserdata(L, sizeof(lprec*));
-    *model = make_lp(0, columns);
-    resize_lp(*model, rows, columns);
+    M = (rima_lpsolve_model*)lua_newuserdata(L, sizeof(rima_lpsolve_model));
+    M->lp = 0;
+    M->changes = 0;
     luaL_getmetatable(L, metatable_name);
     lua_setmetatable(L, -2);
-    set_verbose(*model, 0);
+    M->lp = read_MPS((char*)filename, CRITICAL);
+    if (!M->lp) return error(L, "Couldn't read the MPS file");
+    set_verbose(M->lp, 0);
   }
   catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
   catch (std::exception &e)     { return error(L, e.what()); }
@@ -59,7 +97,7 @@ static int rima_new(lua_State *L)
 
 static int rima_resize(lua_State *L)
 {
-  lprec *model = get_model(L);
+  lprec *model = get_model(L)->lp;
   luaL_checkinteger(L, 2);
   luaL_checkinteger(L, 3);
   int rows = lua_tointeger(L, 2), columns = lua_tointeger(L, 3);
@@ -73,68 +111,125 @@ static int rima_resize(lua_State *L)
 }
 
 
-static const char *build_constraint(void *M, unsigned non_zeroes, int *columns, double *coefficients, double lower, double upper)
+static void row_type(double lower, double upper, int &constraint_type, double &rhs, bool &ranged)
 {
-  int constraint_type;
-  double rhs;
+  ranged = false;
   if (lower == -std::numeric_limits<double>::infinity())
   {
     rhs = upper;
-    constraint_type = 1;
+    constraint_type = LE;
   }
   else if (upper == std::numeric_limits<double>::infinity())
   {
     rhs = lower;
-    constraint_type = 2;
+    constraint_type = GE;
   }
   else if (lower == upper)
   {
     rhs = lower;
-    constraint_type = 3;
+    constraint_type = EQ;
   }
   else
-    return "lpsolve can't handle constraints with upper and lower bounds";
+  {
+    // Two-sided rows go in as lower <= row, and then get a range
+    rhs = lower;
+    constraint_type = GE;
+    ranged = true;
+  }
+}
+
+
+static const char *build_constraint(lprec *model, unsigned non_zeroes, int *columns, double *coefficients, double lower, double upper)
+{
+  int constraint_type;
+  double rhs;
+  bool ranged;
+  row_type(lower, upper, constraint_type, rhs, ranged);
 
-    if (add_constraintex((lprec *)M, non_zeroes, &coefficients[0], &columns[0], constraint_type, rhs) == 0)
-      return "couldn't add constraint";
+  if (add_constraintex(model, non_zeroes, coefficients, columns, constraint_type, rhs) == 0)
+    return "couldn't add constraint";
+  if (ranged && set_rh_range(model, get_Nrows(model), upper - lower) == 0)
+    return "couldn't set the range on a constraint";
   return 0;
 }
 
 
+static const char *add_rows(lprec *model, linear_problem &P)
+{
+  unsigned row_count = P.row_count();
+  int first_row = get_Nrows(model), column_count = get_Ncolumns(model);
+
+  unsigned max_non_zeroes = 0;
+  for (unsigned i = 0; i != row_count; ++i)
+  {
+    unsigned nz = P.row_starts[i+1] - P.row_starts[i];
+    if (nz > max_non_zeroes)
+      max_non_zeroes = nz;
+  }
+  std::vector<int> columns(max_non_zeroes);
+
+  // Make room for all the rows at once, and add them in row entry mode:
+  // adding rows to lp_solve's column-major matrix one at a time is very slow.
+  // lp_solve only allows row entry mode before the first solve, so after that
+  // set_add_rowmode fails and we fall back to adding rows the slow way.
+  resize_lp(model, first_row + row_count, column_count);
+  bool was_rowmode = is_add_rowmode(model) != 0;
+  set_add_rowmode(model, TRUE);
+
+  const char *err = 0;
+  for (unsigned i = 0; i != row_count && !err; ++i)
+  {
+    int start = P.row_starts[i], nz = P.row_starts[i+1] - start;
+    for (int j = 0; j != nz; ++j)
+      columns[j] = P.columns[start + j] + 1;
+    err = build_constraint(model, nz, vector_data(columns), vector_data(P.values) + start, P.row_lower[i], P.row_upper[i]);
+  }
+
+  if (!was_rowmode)
+    set_add_rowmode(model, FALSE);
+
+  // Take out the rows we've already added if something went wrong
+  if (err)
+    resize_lp(model, first_row, column_count);
+  return err;
+}
+
+
 static int rima_build_rows(lua_State *L)
 {
-  lprec *model = get_model(L);
+  rima_lpsolve_model *M = get_model(L);
+  lprec *model = M->lp;
   luaL_checktype(L, 2, LUA_TTABLE);
-  unsigned constraint_count = lua_objlen(L, 2);
-  unsigned column_count = get_Ncolumns(model);
 
-  unsigned max_non_zeroes = 0;
-  const char *err = check_constraints(L, constraint_count, column_count, max_non_zeroes);
+  linear_problem P;
+  const char *err = read_constraints(L, 2, get_Ncolumns(model), P);
   if (err) return error(L, err);
 
-  err = build_constraints(L, max_non_zeroes, constraint_count, 0, build_constraint, model);
+  err = add_rows(model, P);
   if (err) return error(L, err);
+  M->changes |= MATRIX_CHANGED;
 
   lua_pushboolean(L, 1);
   return 1;
 }
 
 
-static const char *build_variable(void *M, unsigned index, double cost, double lower, double upper, bool integer)
+static const char *build_variable(lprec *model, unsigned index, double cost, double lower, double upper, bool integer)
 {
   index += 1;
-  if (set_obj((lprec *)M, index, cost) == 0)
+  if (set_obj(model, index, cost) == 0)
     return "couldn't set variable cost";
-  set_bounds((lprec *)M, index, lower, upper);
+  set_bounds(model, index, lower, upper);
   if (integer)
-    set_int((lprec *)M, index, 1);
+    set_int(model, index, 1);
   return 0;
 }
 
 
 static int rima_set_objective(lua_State *L)
 {
-  lprec *model = get_model(L);
+  rima_lpsolve_model *M = get_model(L);
+  lprec *model = M->lp;
   luaL_checktype(L, 2, LUA_TTABLE);
   luaL_checktype(L, 3, LUA_TSTRING);
   unsigned variable_count = lua_objlen(L, 2);
@@ -152,22 +247,190 @@ static int rima_set_objective(lua_State *L)
   else
     return error(L, "The the optimisation direction must be 'minimise' or 'maximise'");
 
-  const char *err = check_variables(L, variable_count);
+  linear_problem P;
+  const char *err = read_variables(L, 2, P);
   if (err) return error(L, err);
 
-  err = build_variables(L, variable_count, build_variable, model);
-  if (err) return error(L, err);
+  for (unsigned i = 0; i != column_count; ++i)
+  {
+    err = build_variable(model, i, P.costs[i], P.column_lower[i], P.column_upper[i], P.integer[i] != 0);
+    if (err) return error(L, err);
+  }
 
   set_sense(model, optimization_direction);
+  M->changes |= BOUNDS_CHANGED | COSTS_CHANGED;
 
   lua_pushboolean(L, 1);
   return 1;  
 }
 
 
+static const char *load(rima_lpsolve_model *M, linear_problem &P)
+{
+  lprec *model = M->lp;
+  unsigned column_count = P.column_count();
+  if (column_count != (unsigned)get_Ncolumns(model))
+    return "The number of variables in the problem does not match the number of columns in the model";
+
+  // Throw away any old rows
+  if (get_Nrows(model) != 0)
+    resize_lp(model, 0, column_count);
+
+  const char *err = add_rows(model, P);
+  if (err) return err;
+
+  for (unsigned i = 0; i != column_count; ++i)
+  {
+    err = build_variable(model, i, P.costs[i], P.column_lower[i], P.column_upper[i], P.integer[i] != 0);
+    if (err) return err;
+  }
+
+  set_sense(model, P.maximise);
+  M->changes |= BOUNDS_CHANGED | COSTS_CHANGED | MATRIX_CHANGED;
+  return 0;
+}
+
+
+static int rima_load_problem(lua_State *L)
+{
+  rima_lpsolve_model *M = get_model(L);
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  linear_problem P;
+  const char *err = read_linear_problem(L, 2, P);
+  if (err) return error(L, err);
+
+  err = load(M, P);
+  if (err) return error(L, err);
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+// Load a model from a cache file written by write_cache.  Returns the model
+// and the names saved with it.
+static int rima_read_cache(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+
+  rima_lpsolve_model *M = 0;
+  try
+  {
+    mapped_problem C;
+    const char *err = C.open(filename);
+    if (err) return error(L, err);
+
+    M = (rima_lpsolve_model*)lua_newuserdata(L, sizeof(rima_lpsolve_model));
+    M->lp = 0;
+    M->changes = 0;
+    luaL_getmetatable(L, metatable_name);
+    lua_setmetatable(L, -2);
+    M->lp = make_lp(0, C.column_count);
+    if (!M->lp) return error(L, "Memory allocation failure");
+    set_verbose(M->lp, 0);
+
+    linear_problem P;
+    C.copy(P);
+    err = load(M, P);
+    if (err) return error(L, err);
+    push_cache_names(L, C);
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+
+  return 2;
+}
+
+
+static int rima_set_column_bounds(lua_State *L)
+{
+  rima_lpsolve_model *M = get_model(L);
+  int column = luaL_checkinteger(L, 2);
+  double lower = luaL_checknumber(L, 3), upper = luaL_checknumber(L, 4);
+  if (column < 1 || column > get_Ncolumns(M->lp))
+    return error(L, "bad argument #1 to 'set_column_bounds' (column index out of range)");
+
+  if (set_bounds(M->lp, column, lower, upper) == 0)
+    return error(L, "couldn't set variable bounds");
+  M->changes |= BOUNDS_CHANGED;
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int rima_set_row_bounds(lua_State *L)
+{
+  rima_lpsolve_model *M = get_model(L);
+  int row = luaL_checkinteger(L, 2);
+  double lower = luaL_checknumber(L, 3), upper = luaL_checknumber(L, 4);
+  if (row < 1 || row > get_Nrows(M->lp))
+    return error(L, "bad argument #1 to 'set_row_bounds' (row index out of range)");
+
+  int constraint_type;
+  double rhs;
+  bool ranged;
+  row_type(lower, upper, constraint_type, rhs, ranged);
+
+  // set_constr_type clears any old range on the row
+  if (set_constr_type(M->lp, row, constraint_type) == 0 ||
+      set_rh(M->lp, row, rhs) == 0 ||
+      (ranged && set_rh_range(M->lp, row, upper - lower) == 0))
+    return error(L, "couldn't set constraint bounds");
+  M->changes |= BOUNDS_CHANGED;
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int rima_set_cost(lua_State *L)
+{
+  rima_lpsolve_model *M = get_model(L);
+  int column = luaL_checkinteger(L, 2);
+  double cost = luaL_checknumber(L, 3);
+  if (column < 1 || column > get_Ncolumns(M->lp))
+    return error(L, "bad argument #1 to 'set_cost' (column index out of range)");
+
+  if (set_obj(M->lp, column, cost) == 0)
+    return error(L, "couldn't set variable cost");
+  M->changes |= COSTS_CHANGED;
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int rima_set_coefficient(lua_State *L)
+{
+  rima_lpsolve_model *M = get_model(L);
+  int row = luaL_checkinteger(L, 2), column = luaL_checkinteger(L, 3);
+  double value = luaL_checknumber(L, 4);
+  if (row < 1 || row > get_Nrows(M->lp))
+    return error(L, "bad argument #1 to 'set_coefficient' (row index out of range)");
+  if (column < 1 || column > get_Ncolumns(M->lp))
+    return error(L, "bad argument #2 to 'set_coefficient' (column index out of range)");
+
+  if (set_mat(M->lp, row, column, value) == 0)
+    return error(L, "couldn't set constraint coefficient");
+  M->changes |= MATRIX_CHANGED;
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
 static int rima_solve(lua_State *L)
 {
-  lprec *model = get_model(L);
+  rima_lpsolve_model *M = get_model(L);
+  lprec *model = M->lp;
+
+  // If only the costs have changed, the last basis is still primal feasible,
+  // otherwise it's probably still dual feasible.
+  set_simplextype(model, M->changes == COSTS_CHANGED ? SIMPLEX_PRIMAL_PRIMAL : SIMPLEX_DUAL_PRIMAL);
+  M->changes = 0;
 
   int result = solve(model);
 
@@ -181,7 +444,7 @@ static int rima_solve(lua_State *L)
 
 static int rima_get_solution(lua_State *L)
 {
-  lprec *model = get_model(L);
+  lprec *model = get_model(L)->lp;
 
   unsigned row_count = get_Nrows(model);
   unsigned column_count = get_Ncolumns(model);
@@ -194,39 +457,91 @@ static int rima_get_solution(lua_State *L)
   lua_setfield(L, -2, "objective");
   ++primal; ++dual;
 
-  lua_createtable(L, row_count, 0);
-  for (unsigned i = 0; i != row_count; ++i)
-  {
-    lua_newtable(L);
-    lua_pushnumber(L, *primal);
-    lua_setfield(L, -2, "p");
-    lua_pushnumber(L, *dual);
-    lua_setfield(L, -2, "d");
-    lua_rawseti(L, -2, i + 1);
-    ++primal; ++dual;    
-  }
-  lua_setfield(L, -2, "constraints");
+  // lp_solve keeps the rows' values first, and then the columns'
+  solution_arrays *S = new_solution(L);
+  S->row_primal.assign(primal, primal + row_count);
+  S->row_dual.assign(dual, dual + row_count);
+  S->column_primal.assign(primal + row_count, primal + row_count + column_count);
+  S->column_dual.assign(dual + row_count, dual + row_count + column_count);
+  lua_setfield(L, -2, "solution");
+
+  return 1;
+}
 
+
+// The names of the columns and rows, as { columns = {...}, rows = {...} }.
+// Models read from files keep the names in the file; others have generated
+// names.
+static int rima_get_names(lua_State *L)
+{
+  lprec *model = get_model(L)->lp;
+  int column_count = get_Ncolumns(model), row_count = get_Nrows(model);
+
+  lua_createtable(L, 0, 2);
   lua_createtable(L, column_count, 0);
-  for (unsigned i = 0; i != column_count; ++i)
+  for (int i = 1; i <= column_count; ++i)
   {
-    lua_newtable(L);
-    lua_pushnumber(L, *primal);
-    lua_setfield(L, -2, "p");
-    lua_pushnumber(L, *dual);
-    lua_setfield(L, -2, "d");
-    lua_rawseti(L, -2, i + 1);
-    ++primal; ++dual;    
+    lua_pushstring(L, get_col_name(model, i));
+    lua_rawseti(L, -2, i);
   }
-  lua_setfield(L, -2, "variables");
+  lua_setfield(L, -2, "columns");
+  lua_createtable(L, row_count, 0);
+  for (int i = 1; i <= row_count; ++i)
+  {
+    lua_pushstring(L, get_row_name(model, i));
+    lua_rawseti(L, -2, i);
+  }
+  lua_setfield(L, -2, "rows");
+
+  return 1;
+}
+
 
+// The optimisation direction, "minimise" or "maximise"
+static int rima_get_sense(lua_State *L)
+{
+  lua_pushstring(L, is_maxim(get_model(L)->lp) ? "maximise" : "minimise");
+  return 1;
+}
+
+
+// Write the model to an MPS or LP file (see write_options).  lp_solve
+// writes plain text only.  Names are given to the model's rows and columns
+// before writing, and stay.
+static int rima_write(lua_State *L)
+{
+  rima_lpsolve_model *M = get_model(L);
+  lprec *model = M->lp;
+  const char *filename = luaL_checkstring(L, 2);
+
+  write_options o;
+  const char *err = read_write_options(L, 3, get_Ncolumns(model), get_Nrows(model), o);
+  if (err) return error(L, err);
+  if (std::strcmp(o.compression, "none") != 0)
+    return error(L, "lp_solve can't compress the files it writes");
+
+  for (unsigned i = 0; i != o.column_names.size(); ++i)
+    set_col_name(model, i + 1, (char*)o.column_names[i]);
+  for (unsigned i = 0; i != o.row_names.size(); ++i)
+    set_row_name(model, i + 1, (char*)o.row_names[i]);
+
+  MYBOOL written = std::strcmp(o.format, "lp") == 0 ?
+    write_lp(model, (char*)filename) :
+    write_mps(model, (char*)filename);
+  if (!written)
+    return error(L, "Couldn't write the model");
+
+  lua_pushboolean(L, 1);
   return 1;
 }
 
 
 static int rima_delete(lua_State *L)
 {
-  delete_lp(get_model(L));
+  rima_lpsolve_model *M = get_model(L);
+  if (M->lp)
+    delete_lp(M->lp);
+  M->lp = 0;
   return 0;
 }
 
@@ -236,6 +551,11 @@ static int rima_delete(lua_State *L)
 static luaL_Reg rima_functions[] =
 {
   {"new",  rima_new},
+  {"read_mps",  rima_read_mps},
+  {"read_cache",  rima_read_cache},
+  {"write_cache",  write_cache},
+  {"cache_info",  cache_info},
+  {"cache_key",  cache_key},
   {NULL, NULL}
 };
 
@@ -246,8 +566,16 @@ static luaL_Reg rima_methods[] =
   {"resize", rima_resize},
   {"build_rows", rima_build_rows},
   {"set_objective", rima_set_objective},
+  {"load_problem", rima_load_problem},
+  {"set_column_bounds", rima_set_column_bounds},
+  {"set_row_bounds", rima_set_row_bounds},
+  {"set_cost", rima_set_cost},
+  {"set_coefficient", rima_set_coefficient},
   {"solve", rima_solve},
   {"get_solution", rima_get_solution},
+  {"get_names", rima_get_names},
+  {"get_sense", rima_get_sense},
+  {"write", rima_write},
   {NULL, NULL}
 };
 
@@ -0,0 +1,542 @@
+/*******************************************************************************
+
+rima_parallel_core.cpp
+
+Copyright (c) 2009-2012 Incremental IP Limited
+see LICENSE for license information
+
+*******************************************************************************/
+
+#include "rima_solver_tools.h"
+extern "C"
+{
+#include "lauxlib.h"
+LUALIB_API int luaopen_rima_parallel_core(lua_State *L);
+}
+
+#include <pthread.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <new>
+
+static const char metatable_name[] = "rima.parallel";
+
+
+/*============================================================================*/
+
+// A pool of worker Lua states, each with its own thread, that generate the
+// rows of a linear problem between them.  Each worker runs the same script,
+// which is passed the worker's number, the number of workers and an input
+// string, and hands its rows and variables back through three functions:
+//   emit_constraints(names): the names of all the rows of the whole problem,
+//     in row-number order, so that the workers can be checked to agree on it
+//   emit_variable(name, lower, upper, integer): a variable the worker's rows
+//     use, numbered from 1 in the order they're emitted
+//   emit_row(i, name, lower, upper, variables, coefficients): row number i of
+//     the whole problem, with its elements given by the worker's variable
+//     numbers
+// The rows are merged into one problem in row-number order, and the columns
+// are the variables sorted by name, so the problem doesn't depend on how the
+// rows were shared out.
+struct worker
+{
+  worker() : L(0) {}
+
+  void clear()
+  {
+    error.clear();
+    constraint_count = 0; constraint_hash = 0;
+    row_numbers.clear(); row_names.clear(); row_lower.clear(); row_upper.clear();
+    row_starts.assign(1, 0); variables.clear(); values.clear();
+    variable_names.clear(); variable_lower.clear(); variable_upper.clear(); variable_integer.clear();
+  }
+
+  lua_State *L;
+  pthread_t thread;
+
+  // What to run
+  const char *script;
+  size_t script_length;
+  const char *input;
+  int number, count;
+  std::string error;
+
+  // How many rows the worker found, and a hash of their names in order
+  unsigned constraint_count;
+  unsigned long constraint_hash;
+
+  // The rows it generated.  variables are the worker's own variable numbers
+  // (zero-based).
+  std::vector<int> row_numbers;
+  std::vector<std::string> row_names;
+  std::vector<double> row_lower, row_upper;
+  std::vector<unsigned> row_starts, variables;
+  std::vector<double> values;
+
+  std::vector<std::string> variable_names;
+  std::vector<double> variable_lower, variable_upper;
+  std::vector<char> variable_integer;
+};
+
+
+struct rima_pool
+{
+  std::vector<worker> workers;
+};
+
+
+static rima_pool *get_pool(lua_State *L)
+{
+  return (rima_pool*)luaL_checkudata(L, 1, metatable_name);
+}
+
+
+/*============================================================================*/
+
+static worker *get_worker(lua_State *L)
+{
+  return (worker*)lua_touserdata(L, lua_upvalueindex(1));
+}
+
+
+static int emit_variable(lua_State *L)
+{
+  worker *W = get_worker(L);
+  size_t length;
+  const char *name = luaL_checklstring(L, 1, &length);
+  double lower = luaL_checknumber(L, 2), upper = luaL_checknumber(L, 3);
+
+  W->variable_names.push_back(std::string(name, length));
+  W->variable_lower.push_back(lower);
+  W->variable_upper.push_back(upper);
+  W->variable_integer.push_back(lua_toboolean(L, 4) != 0);
+  return 0;
+}
+
+
+// FNV-1a, continued from hash
+static unsigned long hash_string(unsigned long hash, const char *s, size_t length)
+{
+  for (size_t i = 0; i != length; ++i)
+    hash = (hash ^ (unsigned char)s[i]) * 16777619UL;
+  return (hash ^ 0xff) * 16777619UL;    // so that "ab", "c" differs from "a", "bc"
+}
+
+
+static int emit_constraints(lua_State *L)
+{
+  worker *W = get_worker(L);
+  luaL_checktype(L, 1, LUA_TTABLE);
+
+  unsigned count = lua_objlen(L, 1);
+  unsigned long hash = 2166136261UL;
+  for (unsigned i = 0; i != count; ++i)
+  {
+    lua_rawgeti(L, 1, i + 1);
+    size_t length;
+    const char *name = lua_tolstring(L, -1, &length);
+    if (!name)
+      return luaL_error(L, "emit_constraints: the name of row %d is not a string", i + 1);
+    hash = hash_string(hash, name, length);
+    lua_pop(L, 1);
+  }
+  W->constraint_count = count;
+  W->constraint_hash = hash;
+  return 0;
+}
+
+
+static int emit_row(lua_State *L)
+{
+  worker *W = get_worker(L);
+  int number = luaL_checkint(L, 1);
+  size_t length;
+  const char *name = luaL_checklstring(L, 2, &length);
+  double lower = luaL_checknumber(L, 3), upper = luaL_checknumber(L, 4);
+  luaL_checktype(L, 5, LUA_TTABLE);
+  luaL_checktype(L, 6, LUA_TTABLE);
+
+  unsigned count = lua_objlen(L, 5);
+  if (lua_objlen(L, 6) != count)
+    return luaL_error(L, "emit_row: the variables and coefficients must have the same length");
+
+  unsigned variable_count = W->variable_names.size();
+  for (unsigned i = 0; i != count; ++i)
+  {
+    lua_rawgeti(L, 5, i + 1);
+    lua_rawgeti(L, 6, i + 1);
+    int v = lua_tointeger(L, -2);
+    if (v < 1 || (unsigned)v > variable_count || !lua_isnumber(L, -1))
+      return luaL_error(L, "emit_row: element %d of row %d is not an emitted variable and a number", i + 1, number);
+    W->variables.push_back(v - 1);
+    W->values.push_back(lua_tonumber(L, -1));
+    lua_pop(L, 2);
+  }
+
+  W->row_numbers.push_back(number);
+  W->row_names.push_back(std::string(name, length));
+  W->row_lower.push_back(lower);
+  W->row_upper.push_back(upper);
+  W->row_starts.push_back(W->variables.size());
+  return 0;
+}
+
+
+static void *run_worker(void *p)
+{
+  worker *W = (worker*)p;
+  lua_State *L = W->L;
+
+  try
+  {
+    lua_settop(L, 0);
+    if (luaL_loadbuffer(L, W->script, W->script_length, "=worker") != 0 ||
+        (lua_pushinteger(L, W->number),
+         lua_pushinteger(L, W->count),
+         lua_pushstring(L, W->input),
+         lua_pcall(L, 3, 0, 0) != 0))
+    {
+      const char *message = lua_tostring(L, -1);
+      W->error = message ? message : "unknown error";
+    }
+  }
+  catch (std::bad_alloc)        { W->error = "Memory allocation failure"; }
+  catch (std::exception &e)     { W->error = e.what(); }
+  catch (...)                   { W->error = "Unknown error"; }
+
+  lua_settop(L, 0);
+  return 0;
+}
+
+
+/*============================================================================*/
+
+// Create a pool of threads worker states.  They share the creating state's
+// package.path and package.cpath, so they find the same modules.
+static int rima_new(lua_State *L)
+{
+  int threads = luaL_checkint(L, 1);
+  if (threads < 1) return error(L, "bad argument #1 to 'new' (positive number of threads expected)");
+
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "path");
+  std::string path = lua_isstring(L, -1) ? lua_tostring(L, -1) : "";
+  lua_getfield(L, -2, "cpath");
+  std::string cpath = lua_isstring(L, -1) ? lua_tostring(L, -1) : "";
+  lua_pop(L, 3);
+
+  rima_pool *P = 0;
+  try
+  {
+    P = new(lua_newuserdata(L, sizeof(rima_pool))) rima_pool();
+    luaL_getmetatable(L, metatable_name);
+    lua_setmetatable(L, -2);
+
+    P->workers.resize(threads);
+    for (int i = 0; i != threads; ++i)
+    {
+      worker *W = &P->workers[i];
+      lua_State *WL = W->L = luaL_newstate();
+      if (!WL) return error(L, "Memory allocation failure");
+      luaL_openlibs(WL);
+
+      lua_getglobal(WL, "package");
+      lua_pushstring(WL, path.c_str());
+      lua_setfield(WL, -2, "path");
+      lua_pushstring(WL, cpath.c_str());
+      lua_setfield(WL, -2, "cpath");
+      lua_pop(WL, 1);
+
+      lua_pushlightuserdata(WL, W);
+      lua_pushcclosure(WL, emit_variable, 1);
+      lua_setglobal(WL, "emit_variable");
+      lua_pushlightuserdata(WL, W);
+      lua_pushcclosure(WL, emit_row, 1);
+      lua_setglobal(WL, "emit_row");
+      lua_pushlightuserdata(WL, W);
+      lua_pushcclosure(WL, emit_constraints, 1);
+      lua_setglobal(WL, "emit_constraints");
+    }
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+
+  return 1;
+}
+
+
+static int rima_size(lua_State *L)
+{
+  lua_pushinteger(L, get_pool(L)->workers.size());
+  return 1;
+}
+
+
+// Where a row ended up: the worker that generated it and its place there
+struct row_source
+{
+  int number;
+  unsigned worker, row;
+  bool operator<(const row_source &other) const { return number < other.number; }
+};
+
+
+static void push_numbers(lua_State *L, const std::vector<double> &v, const char *name)
+{
+  lua_createtable(L, v.size(), 0);
+  for (unsigned i = 0; i != v.size(); ++i)
+  {
+    lua_pushnumber(L, v[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, name);
+}
+
+
+static void push_strings(lua_State *L, const std::vector<const std::string*> &v, const char *name)
+{
+  lua_createtable(L, v.size(), 0);
+  for (unsigned i = 0; i != v.size(); ++i)
+  {
+    lua_pushlstring(L, v[i]->data(), v[i]->size());
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, name);
+}
+
+
+// Run script in every worker with input, and merge their rows.  Returns a
+// linear problem (as for the cores' load_problem, but without sense or costs)
+// with column_names and row_names, or nil and the first worker's error.
+static int rima_generate(lua_State *L)
+{
+  rima_pool *P = get_pool(L);
+  size_t script_length;
+  const char *script = luaL_checklstring(L, 2, &script_length);
+  const char *input = luaL_optstring(L, 3, "");
+  unsigned count = P->workers.size();
+
+  try
+  {
+    // Run the workers.  If a thread can't be started, its worker runs here
+    // once the others are going.
+    std::vector<char> started(count, 0);
+    for (unsigned i = 0; i != count; ++i)
+    {
+      worker *W = &P->workers[i];
+      W->clear();
+      W->script = script;
+      W->script_length = script_length;
+      W->input = input;
+      W->number = i + 1;
+      W->count = count;
+      started[i] = pthread_create(&W->thread, 0, run_worker, W) == 0;
+    }
+    for (unsigned i = 0; i != count; ++i)
+      if (!started[i])
+        run_worker(&P->workers[i]);
+    for (unsigned i = 0; i != count; ++i)
+      if (started[i])
+        pthread_join(P->workers[i].thread, 0);
+
+    for (unsigned i = 0; i != count; ++i)
+      if (!P->workers[i].error.empty())
+        return error(L, P->workers[i].error.c_str());
+
+    // Check that the workers found the same rows in the same order, and that
+    // between them they generated every row exactly once.  If not, the merged
+    // problem would be wrong, so the caller has to generate it serially.
+    unsigned expected = P->workers[0].constraint_count;
+    for (unsigned i = 1; i != count; ++i)
+      if (P->workers[i].constraint_count != expected ||
+          P->workers[i].constraint_hash != P->workers[0].constraint_hash)
+        return error(L, "The workers didn't find the same constraints in the same order");
+    std::vector<char> generated(expected, 0);
+    for (unsigned i = 0; i != count; ++i)
+    {
+      const worker &W = P->workers[i];
+      for (unsigned j = 0; j != W.row_numbers.size(); ++j)
+      {
+        int n = W.row_numbers[j];
+        if (n < 1 || (unsigned)n > expected || generated[n - 1])
+          return error(L, "The workers generated a row more than once, or a row that doesn't exist");
+        generated[n - 1] = 1;
+      }
+    }
+    if (std::find(generated.begin(), generated.end(), 0) != generated.end())
+      return error(L, "The workers didn't generate every row");
+
+    // Number the columns by sorting all the workers' variables by name
+    std::map<std::string, unsigned> columns;
+    for (unsigned i = 0; i != count; ++i)
+    {
+      const worker &W = P->workers[i];
+      for (unsigned j = 0; j != W.variable_names.size(); ++j)
+        columns.insert(std::make_pair(W.variable_names[j], 0));
+    }
+
+    linear_problem Q;
+    std::vector<const std::string*> column_names;
+    column_names.reserve(columns.size());
+    for (std::map<std::string, unsigned>::iterator c = columns.begin(); c != columns.end(); ++c)
+    {
+      c->second = column_names.size();
+      column_names.push_back(&c->first);
+    }
+    Q.column_lower.resize(columns.size());
+    Q.column_upper.resize(columns.size());
+    Q.integer.resize(columns.size());
+
+    std::vector<std::vector<unsigned> > column_maps(count);
+    unsigned row_count = 0;
+    for (unsigned i = 0; i != count; ++i)
+    {
+      const worker &W = P->workers[i];
+      std::vector<unsigned> &m = column_maps[i];
+      m.resize(W.variable_names.size());
+      for (unsigned j = 0; j != W.variable_names.size(); ++j)
+      {
+        unsigned c = m[j] = columns[W.variable_names[j]];
+        Q.column_lower[c] = W.variable_lower[j];
+        Q.column_upper[c] = W.variable_upper[j];
+        Q.integer[c] = W.variable_integer[j];
+      }
+      row_count += W.row_numbers.size();
+    }
+
+    // Put the rows back in order
+    std::vector<row_source> rows;
+    rows.reserve(row_count);
+    for (unsigned i = 0; i != count; ++i)
+    {
+      const worker &W = P->workers[i];
+      for (unsigned j = 0; j != W.row_numbers.size(); ++j)
+      {
+        row_source r = { W.row_numbers[j], i, j };
+        rows.push_back(r);
+      }
+    }
+    std::stable_sort(rows.begin(), rows.end());
+
+    std::vector<const std::string*> row_names(row_count);
+    Q.row_lower.resize(row_count);
+    Q.row_upper.resize(row_count);
+    Q.row_starts.assign(1, 0);
+    std::vector<std::pair<unsigned, double> > elements;
+    for (unsigned k = 0; k != row_count; ++k)
+    {
+      const row_source &r = rows[k];
+      const worker &W = P->workers[r.worker];
+      const std::vector<unsigned> &m = column_maps[r.worker];
+      row_names[k] = &W.row_names[r.row];
+      Q.row_lower[k] = W.row_lower[r.row];
+      Q.row_upper[k] = W.row_upper[r.row];
+
+      // Sort each row's elements by column, as build_linear_problem does
+      elements.clear();
+      for (unsigned e = W.row_starts[r.row]; e != W.row_starts[r.row + 1]; ++e)
+        elements.push_back(std::make_pair(m[W.variables[e]], W.values[e]));
+      std::sort(elements.begin(), elements.end());
+      for (unsigned e = 0; e != elements.size(); ++e)
+      {
+        Q.columns.push_back(elements[e].first);
+        Q.values.push_back(elements[e].second);
+      }
+      Q.row_starts.push_back(Q.columns.size());
+    }
+
+    // Hand the problem back in the same form as build_linear_problem's, with
+    // 1-based column indices.  The pool stays on the stack: row_names and
+    // column_names point into its workers' strings.
+    lua_settop(L, 1);
+    lua_createtable(L, 0, 10);
+
+    lua_createtable(L, Q.row_starts.size(), 0);
+    for (unsigned i = 0; i != Q.row_starts.size(); ++i)
+    {
+      lua_pushinteger(L, Q.row_starts[i]);
+      lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "row_starts");
+    lua_createtable(L, Q.columns.size(), 0);
+    for (unsigned i = 0; i != Q.columns.size(); ++i)
+    {
+      lua_pushinteger(L, Q.columns[i] + 1);
+      lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "columns");
+    push_numbers(L, Q.values, "values");
+    push_numbers(L, Q.row_lower, "row_lower");
+    push_numbers(L, Q.row_upper, "row_upper");
+    push_numbers(L, Q.column_lower, "column_lower");
+    push_numbers(L, Q.column_upper, "column_upper");
+    lua_createtable(L, Q.integer.size(), 0);
+    for (unsigned i = 0; i != Q.integer.size(); ++i)
+    {
+      lua_pushboolean(L, Q.integer[i]);
+      lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "integer");
+    push_strings(L, column_names, "column_names");
+    push_strings(L, row_names, "row_names");
+  }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+
+  return 1;
+}
+
+
+static int rima_delete(lua_State *L)
+{
+  rima_pool *P = get_pool(L);
+  for (unsigned i = 0; i != P->workers.size(); ++i)
+    if (P->workers[i].L)
+      lua_close(P->workers[i].L);
+  P->~rima_pool();
+  return 0;
+}
+
+
+/*============================================================================*/
+
+static luaL_Reg rima_functions[] =
+{
+  {"new",  rima_new},
+  {"wall_time",  push_wall_time},
+  {NULL, NULL}
+};
+
+
+static luaL_Reg rima_methods[] =
+{
+  {"__gc", rima_delete},
+  {"size", rima_size},
+  {"generate", rima_generate},
+  {NULL, NULL}
+};
+
+
+LUALIB_API int luaopen_rima_parallel_core(lua_State *L)
+{
+  // Create a metatable for our object
+  luaL_newmetatable(L, metatable_name);
+
+  // Set the metatable's index to be the metatable
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  // Add the object's methods to the metatable
+  luaL_register(L, NULL, rima_methods);
+
+  // Register the module functions
+  luaL_register(L, "rima_parallel_core", rima_functions);
+  return 1;
+}
+
+
+/*============================================================================*/
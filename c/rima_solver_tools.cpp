@@ -13,6 +13,21 @@ extern "C"
 #include "lauxlib.h"
 }
 #include <vector>
+#include <string>
+#include <new>
+#include <cstring>
+#include <cstdio>
+#include <climits>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
 
 
 /*============================================================================*/
@@ -28,191 +43,924 @@ int error(lua_State *L, const char *s)
 
 /*============================================================================*/
 
-const char *check_constraints(lua_State *L, unsigned constraint_count, unsigned column_count, unsigned &max_non_zeroes)
+static const char *read_numbers(lua_State *L, int index, const char *name, std::vector<double> &v, const char *message)
 {
-  for (unsigned i = 0; i != constraint_count; ++i)
+  lua_pushstring(L, name);
+  lua_rawget(L, index);
+  if (lua_type(L, -1) != LUA_TTABLE)
+    return message;
+
+  unsigned count = lua_objlen(L, -1);
+  v.resize(count);
+  for (unsigned i = 0; i != count; ++i)
   {
-    lua_rawgeti(L, 2, i+1);
-    if (lua_type(L, -1) != LUA_TTABLE)
-      return "The elements of the constraints table must be tables of constraints";
-
-    lua_pushstring(L, "lower");
-    lua_rawget(L, -2);
+    lua_rawgeti(L, -1, i+1);
     if (lua_type(L, -1) != LUA_TNUMBER)
-      return "The lower bound on a constraint (lower) must be a number";
+      return message;
+    v[i] = lua_tonumber(L, -1);
     lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return 0;
+}
 
-    lua_pushstring(L, "upper");
-    lua_rawget(L, -2);
+
+static const char *read_indices(lua_State *L, int index, const char *name, int offset, std::vector<int> &v, const char *message)
+{
+  lua_pushstring(L, name);
+  lua_rawget(L, index);
+  if (lua_type(L, -1) != LUA_TTABLE)
+    return message;
+
+  unsigned count = lua_objlen(L, -1);
+  v.resize(count);
+  for (unsigned i = 0; i != count; ++i)
+  {
+    lua_rawgeti(L, -1, i+1);
     if (lua_type(L, -1) != LUA_TNUMBER)
-      return "The upper bound on a constraint (upper) must be a number";
+      return message;
+    v[i] = lua_tointeger(L, -1) + offset;
     lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return 0;
+}
 
-    lua_pushstring(L, "elements");
-    lua_rawget(L, -2);
-    if (lua_type(L, -1) != LUA_TTABLE)
-      return "The constraint elements array must be a table";
 
-    unsigned nz = lua_objlen(L, -1);
-    for (unsigned j = 0; j != nz; ++j)
-    {
-      lua_rawgeti(L, -1, j+1);
-      if (lua_type(L, -1) != LUA_TTABLE)
-        return "The elements of a table of non-zeroes must be a table";
-      lua_pushstring(L, "index");
-      lua_rawget(L, -2);
-      lua_pushstring(L, "coeff");
-      lua_rawget(L, -3);
-      if (lua_type(L, -1) != LUA_TNUMBER || lua_type(L, -2) != LUA_TNUMBER)
-        return "The elements of a table of non-zeroes must be a table with index and coeff fields";
-      unsigned column = lua_tointeger(L, -2) - 1;
-      if (column > column_count)
-        return "An index in the column vector exceeded the number of columns";
-      lua_pop(L, 3);
-    }
-    if (nz > max_non_zeroes)
-      max_non_zeroes = nz;
-    lua_pop(L, 2);
+static const char *read_flags(lua_State *L, int index, const char *name, unsigned count, std::vector<char> &v, const char *message)
+{
+  v.assign(count, 0);
+
+  lua_pushstring(L, name);
+  lua_rawget(L, index);
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+    return 0;
+  }
+  if (lua_type(L, -1) != LUA_TTABLE || lua_objlen(L, -1) != count)
+    return message;
+
+  for (unsigned i = 0; i != count; ++i)
+  {
+    lua_rawgeti(L, -1, i+1);
+    if (lua_type(L, -1) == LUA_TNUMBER)
+      v[i] = lua_tonumber(L, -1) != 0;
+    else if (lua_isboolean(L, -1) || lua_isnil(L, -1))
+      v[i] = lua_toboolean(L, -1);
+    else
+      return message;
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return 0;
+}
+
+
+const char *read_linear_problem(lua_State *L, int index, linear_problem &P)
+{
+  if (index < 0)
+    index = lua_gettop(L) + index + 1;
+
+  lua_pushstring(L, "sense");
+  lua_rawget(L, index);
+  const char *sense = lua_tostring(L, -1);
+  if (sense && std::strncmp(sense, "minimise", 8) == 0)
+    P.maximise = false;
+  else if (sense && std::strncmp(sense, "maximise", 8) == 0)
+    P.maximise = true;
+  else
+    return "The optimisation direction (sense) must be 'minimise' or 'maximise'";
+  lua_pop(L, 1);
+
+  const char *err = read_numbers(L, index, "column_lower", P.column_lower,
+    "The lower bounds on the variables (column_lower) must be an array of numbers");
+  if (err) return err;
+  err = read_numbers(L, index, "column_upper", P.column_upper,
+    "The upper bounds on the variables (column_upper) must be an array of numbers");
+  if (err) return err;
+  err = read_numbers(L, index, "costs", P.costs,
+    "The variable costs (costs) must be an array of numbers");
+  if (err) return err;
+  err = read_flags(L, index, "integer", P.column_count(), P.integer,
+    "The integer flags (integer) must be nil or an array of booleans, one for each variable");
+  if (err) return err;
+
+  unsigned column_count = P.column_count();
+  if (P.column_upper.size() != column_count || P.costs.size() != column_count)
+    return "The variable bounds and costs must all have the same length";
+
+  err = read_numbers(L, index, "row_lower", P.row_lower,
+    "The lower bounds on the constraints (row_lower) must be an array of numbers");
+  if (err) return err;
+  err = read_numbers(L, index, "row_upper", P.row_upper,
+    "The upper bounds on the constraints (row_upper) must be an array of numbers");
+  if (err) return err;
+
+  unsigned row_count = P.row_count();
+  if (P.row_upper.size() != row_count)
+    return "The constraint bounds must have the same length";
+
+  err = read_indices(L, index, "row_starts", 0, P.row_starts,
+    "The row starts (row_starts) must be an array of numbers");
+  if (err) return err;
+  err = read_indices(L, index, "columns", -1, P.columns,
+    "The column indices (columns) must be an array of numbers");
+  if (err) return err;
+  err = read_numbers(L, index, "values", P.values,
+    "The coefficients (values) must be an array of numbers");
+  if (err) return err;
+
+  unsigned non_zeroes = P.non_zero_count();
+  if (P.columns.size() != non_zeroes)
+    return "The column index and coefficient arrays must have the same length";
+  if (P.row_starts.size() != row_count + 1 || P.row_starts[0] != 0 || (unsigned)P.row_starts[row_count] != non_zeroes)
+    return "The row starts must have one more entry than there are rows, start at zero and end at the number of non-zeroes";
+  for (unsigned i = 0; i != row_count; ++i)
+    if (P.row_starts[i+1] < P.row_starts[i])
+      return "The row starts must not decrease";
+  for (unsigned i = 0; i != non_zeroes; ++i)
+    if ((unsigned)P.columns[i] >= column_count)
+      return "An index in the column vector exceeded the number of columns";
+
+  return 0;
+}
+
+
+/*============================================================================*/
+
+static char error_message[256];
+
+static const char *numbered_error(const char *what, unsigned i, const char *err)
+{
+  std::sprintf(error_message, "%s %u: %.200s", what, i, err);
+  return error_message;
+}
+
+
+static const char *read_constraint(lua_State *L, int index, unsigned i, unsigned column_count, linear_problem &P)
+{
+  lua_rawgeti(L, index, i+1);
+  if (lua_type(L, -1) != LUA_TTABLE)
+    return "The elements of the constraints table must be tables of constraints";
+
+  lua_pushstring(L, "lower");
+  lua_rawget(L, -2);
+  if (lua_type(L, -1) != LUA_TNUMBER)
+    return "The lower bound on a constraint (lower) must be a number";
+  double lower = lua_tonumber(L, -1);
+  lua_pop(L, 1);
+
+  lua_pushstring(L, "upper");
+  lua_rawget(L, -2);
+  if (lua_type(L, -1) != LUA_TNUMBER)
+    return "The upper bound on a constraint (upper) must be a number";
+  double upper = lua_tonumber(L, -1);
+  lua_pop(L, 1);
+
+  lua_pushstring(L, "elements");
+  lua_rawget(L, -2);
+  if (lua_type(L, -1) != LUA_TTABLE)
+    return "The constraint elements array must be a table";
+
+  unsigned nz = lua_objlen(L, -1);
+  for (unsigned j = 0; j != nz; ++j)
+  {
+    lua_rawgeti(L, -1, j+1);
+    if (lua_type(L, -1) != LUA_TTABLE)
+      return "The elements of a table of non-zeroes must be a table";
+    lua_pushstring(L, "index");
+    lua_rawget(L, -2);
+    lua_pushstring(L, "coeff");
+    lua_rawget(L, -3);
+    if (lua_type(L, -1) != LUA_TNUMBER || lua_type(L, -2) != LUA_TNUMBER)
+      return "The elements of a table of non-zeroes must be a table with index and coeff fields";
+    unsigned column = lua_tointeger(L, -2) - 1;
+    if (column >= column_count)
+      return "An index in the column vector exceeded the number of columns";
+    P.columns.push_back(column);
+    P.values.push_back(lua_tonumber(L, -1));
+    lua_pop(L, 3);
   }
+  lua_pop(L, 2);
+
+  P.row_starts.push_back(P.values.size());
+  P.row_lower.push_back(lower);
+  P.row_upper.push_back(upper);
   return 0;
 }
 
 
-const char *build_constraints(lua_State *L, unsigned max_non_zeroes, unsigned constraint_count, int column_offset, constraint_builder_function *bf, void *bfd)
+const char *read_constraints(lua_State *L, int index, unsigned column_count, linear_problem &P)
 {
-  std::vector<int> columns(max_non_zeroes);
-  std::vector<double> coefficients(max_non_zeroes);
+  if (index < 0)
+    index = lua_gettop(L) + index + 1;
+  int top = lua_gettop(L);
 
+  if (P.row_starts.empty())
+    P.row_starts.push_back(0);
+  unsigned first_row = P.row_count();
+
+  unsigned constraint_count = lua_objlen(L, index);
   for (unsigned i = 0; i != constraint_count; ++i)
   {
-    lua_rawgeti(L, 2, i+1);
+    const char *err = read_constraint(L, index, i, column_count, P);
+    if (err)
+    {
+      // Roll back everything we've added
+      unsigned nz = P.row_starts[first_row];
+      P.row_starts.resize(first_row + 1);
+      P.row_lower.resize(first_row);
+      P.row_upper.resize(first_row);
+      P.columns.resize(nz);
+      P.values.resize(nz);
+      lua_settop(L, top);
+      return numbered_error("constraint", i+1, err);
+    }
+  }
+  return 0;
+}
+
+
+/*============================================================================*/
 
+static const char *read_variable(lua_State *L, int index, unsigned i, linear_problem &P)
+{
+  lua_rawgeti(L, index, i+1);
+  if (lua_type(L, -1) != LUA_TTABLE)
+    return "The elements of the variables table must be tables of variables";
+
+  lua_pushstring(L, "type");
+  lua_rawget(L, -2);
+  if (lua_type(L, -1) != LUA_TTABLE)
+    return "The variable description must contain a table named type";
+  {
     lua_pushstring(L, "lower");
     lua_rawget(L, -2);
-    double lower = lua_tonumber(L, -1);
+    if (lua_type(L, -1) != LUA_TNUMBER)
+      return "The lower bound on a variable (type.lower) must be a number";
+    P.column_lower[i] = lua_tonumber(L, -1);
     lua_pop(L, 1);
 
     lua_pushstring(L, "upper");
     lua_rawget(L, -2);
-    double upper = lua_tonumber(L, -1);
+    if (lua_type(L, -1) != LUA_TNUMBER)
+      return "The upper bound on a variable (type.upper) must be a number";
+    P.column_upper[i] = lua_tonumber(L, -1);
     lua_pop(L, 1);
 
-    lua_pushstring(L, "elements");
+    lua_pushstring(L, "integer");
     lua_rawget(L, -2);
+    if (!lua_isboolean(L, -1) && !lua_isnil(L, -1))
+      return "The integer flag for a variable (type.integer) must be true, false or nil";
+    P.integer[i] = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
 
-    unsigned nz = lua_objlen(L, -1);
-    for (unsigned j = 0; j != nz; ++j)
+  lua_pushstring(L, "cost");
+  lua_rawget(L, -2);
+  if (lua_type(L, -1) != LUA_TNUMBER)
+    return "The cost of a variable (cost) must be a number";
+  P.costs[i] = lua_tonumber(L, -1);
+  lua_pop(L, 1);
+
+  lua_pop(L, 1);
+  return 0;
+}
+
+
+const char *read_variables(lua_State *L, int index, linear_problem &P)
+{
+  if (index < 0)
+    index = lua_gettop(L) + index + 1;
+  int top = lua_gettop(L);
+
+  unsigned variable_count = lua_objlen(L, index);
+  P.column_lower.resize(variable_count);
+  P.column_upper.resize(variable_count);
+  P.costs.resize(variable_count);
+  P.integer.resize(variable_count);
+
+  for (unsigned i = 0; i != variable_count; ++i)
+  {
+    const char *err = read_variable(L, index, i, P);
+    if (err)
     {
-      lua_rawgeti(L, -1, j+1);
-      lua_pushstring(L, "index");
-      lua_rawget(L, -2);
-      lua_pushstring(L, "coeff");
-      lua_rawget(L, -3);
-      unsigned column = lua_tointeger(L, -2) + column_offset;
-      double coefficient = lua_tonumber(L, -1);
-      columns[j] = column;
-      coefficients[j] = coefficient;
-      lua_pop(L, 3);
+      lua_settop(L, top);
+      return numbered_error("variable", i+1, err);
     }
+  }
+  return 0;
+}
+
+
+/*============================================================================*/
+
+static const char *option_error(const char *name, const char *expected)
+{
+  std::sprintf(error_message, "bad option '%.100s' (%s expected)", name, expected);
+  return error_message;
+}
 
-    const char *err = bf(bfd, nz, &columns[0], &coefficients[0], lower, upper);
-    if (err) return err;
 
-    lua_pop(L, 2);
+// Push options[name], or nil if there's no options table
+static int get_option(lua_State *L, int index, const char *name)
+{
+  if (lua_type(L, index) != LUA_TTABLE)
+  {
+    lua_pushnil(L);
+    return LUA_TNIL;
   }
+  lua_getfield(L, index, name);
+  return lua_type(L, -1);
+}
+
+
+const char *read_option(lua_State *L, int index, const char *name, const char *&value)
+{
+  int type = get_option(L, index, name);
+  if (type == LUA_TSTRING)
+    value = lua_tostring(L, -1);
+  lua_pop(L, 1);
+  return (type == LUA_TNIL || type == LUA_TSTRING) ? 0 : option_error(name, "string");
+}
+
+
+const char *read_option(lua_State *L, int index, const char *name, double &value)
+{
+  int type = get_option(L, index, name);
+  if (type == LUA_TNUMBER)
+    value = lua_tonumber(L, -1);
+  lua_pop(L, 1);
+  return (type == LUA_TNIL || type == LUA_TNUMBER) ? 0 : option_error(name, "number");
+}
+
+
+const char *read_option(lua_State *L, int index, const char *name, int &value)
+{
+  double d = value;
+  const char *err = read_option(L, index, name, d);
+  if (err) return err;
+  // Check the range first: casting a double that doesn't fit (or a nan) to an
+  // int is undefined
+  if (!(d >= INT_MIN && d <= INT_MAX) || d != (int)d)
+    return option_error(name, "integer");
+  value = (int)d;
   return 0;
 }
 
 
-/*============================================================================*/
+const char *read_option(lua_State *L, int index, const char *name, bool &value)
+{
+  int type = get_option(L, index, name);
+  if (type == LUA_TBOOLEAN)
+    value = lua_toboolean(L, -1) != 0;
+  lua_pop(L, 1);
+  return (type == LUA_TNIL || type == LUA_TBOOLEAN) ? 0 : option_error(name, "boolean");
+}
 
-const char *check_variables(lua_State *L, unsigned variable_count)
+
+const char *read_option(lua_State *L, int index, const char *name, std::vector<const char*> &value)
 {
-  for (unsigned i = 0; i != variable_count; ++i)
+  int type = get_option(L, index, name);
+  if (type == LUA_TNIL)
   {
-    lua_rawgeti(L, 2, i+1);
-    if (lua_type(L, -1) != LUA_TTABLE)
-      return "The elements of the variables table must be tables of variables";
+    lua_pop(L, 1);
+    return 0;
+  }
+  if (type != LUA_TTABLE)
+  {
+    lua_pop(L, 1);
+    return option_error(name, "list of strings");
+  }
 
-    lua_pushstring(L, "type");
-    lua_rawget(L, -2);
-    if (lua_type(L, -1) != LUA_TTABLE)
-      return "The variable description must contain a table named type";
+  std::vector<const char*> v(lua_objlen(L, -1));
+  for (unsigned i = 0; i != v.size(); ++i)
+  {
+    lua_rawgeti(L, -1, i+1);
+    if (lua_type(L, -1) != LUA_TSTRING)
     {
-      lua_pushstring(L, "lower");
-      lua_rawget(L, -2);
-      if (lua_type(L, -1) != LUA_TNUMBER)
-        return "The lower bound on a variable (type.lower) must be a number";
-      lua_pop(L, 1);
-
-      lua_pushstring(L, "upper");
-      lua_rawget(L, -2);
-      if (lua_type(L, -1) != LUA_TNUMBER)
-        return "The upper bound on a variable (type.upper) must be a number";
-      lua_pop(L, 1);
-
-      lua_pushstring(L, "integer");
-      lua_rawget(L, -2);
-      if (!lua_isboolean(L, -1) && !lua_isnil(L, -1))
-        return "The integer flag for a variable (type.integer) must be true, false or nil";
-      lua_pop(L, 1);
+      lua_pop(L, 2);
+      return option_error(name, "list of strings");
     }
+    // The strings stay alive as long as the options table does
+    v[i] = lua_tostring(L, -1);
     lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  value.swap(v);
+  return 0;
+}
 
-    lua_pushstring(L, "cost");
-    lua_rawget(L, -2);
-    if (lua_type(L, -1) != LUA_TNUMBER)
-      return "The cost of a variable (cost) must be a number";
-    lua_pop(L, 1);
 
-    lua_pop(L, 1);
+const char *read_write_options(lua_State *L, int index, unsigned column_count, unsigned row_count,
+  write_options &o)
+{
+  const char *err;
+  if ((err = read_option(L, index, "format", o.format)) ||
+      (err = read_option(L, index, "compression", o.compression)) ||
+      (err = read_option(L, index, "column_names", o.column_names)) ||
+      (err = read_option(L, index, "row_names", o.row_names)))
+    return err;
+
+  if (std::strcmp(o.format, "mps") != 0 && std::strcmp(o.format, "lp") != 0)
+    return "bad option 'format' ('mps' or 'lp' expected)";
+  if (std::strcmp(o.compression, "none") != 0 && std::strcmp(o.compression, "gzip") != 0 &&
+      std::strcmp(o.compression, "bzip2") != 0)
+    return "bad option 'compression' ('none', 'gzip' or 'bzip2' expected)";
+  if (!o.column_names.empty() && o.column_names.size() != column_count)
+    return "bad option 'column_names' (there should be a name for every column)";
+  if (!o.row_names.empty() && o.row_names.size() != row_count)
+    return "bad option 'row_names' (there should be a name for every row)";
+  return 0;
+}
+
+
+/*============================================================================*/
+
+static const char cache_magic[8] = "rimapc1";
+static const unsigned cache_byte_order = 0x01020304;
+
+struct cache_header
+{
+  char magic[8];
+  unsigned byte_order;
+  unsigned row_count, column_count, non_zero_count;
+  unsigned maximise, has_integer;
+  unsigned column_names_size, row_names_size;
+};
+
+
+// Where each array starts in the file
+struct cache_layout
+{
+  size_t row_starts, columns, values, row_lower, row_upper;
+  size_t column_lower, column_upper, costs, integer, column_names, row_names, end;
+};
+
+
+static size_t align(size_t n)
+{
+  return (n + 7) & ~(size_t)7;
+}
+
+
+static void layout(const cache_header &h, cache_layout &l)
+{
+  size_t r = h.row_count, c = h.column_count, nz = h.non_zero_count;
+  l.row_starts = align(sizeof(cache_header));
+  l.columns = align(l.row_starts + (r + 1) * sizeof(int));
+  l.values = align(l.columns + nz * sizeof(int));
+  l.row_lower = l.values + nz * sizeof(double);
+  l.row_upper = l.row_lower + r * sizeof(double);
+  l.column_lower = l.row_upper + r * sizeof(double);
+  l.column_upper = l.column_lower + c * sizeof(double);
+  l.costs = l.column_upper + c * sizeof(double);
+  l.integer = l.costs + c * sizeof(double);
+  l.column_names = align(l.integer + c);
+  l.row_names = align(l.column_names + h.column_names_size);
+  l.end = align(l.row_names + h.row_names_size);
+}
+
+
+static const char *map_file(const char *filename, char *&data, size_t &size)
+{
+#ifdef _WIN32
+  FILE *f = std::fopen(filename, "rb");
+  if (!f) return "Couldn't open the cache file";
+  std::fseek(f, 0, SEEK_END);
+  long length = std::ftell(f);
+  std::fseek(f, 0, SEEK_SET);
+  if (length <= 0) { std::fclose(f); return "The cache file is empty"; }
+  data = new char[length];
+  size = length;
+  bool ok = std::fread(data, 1, size, f) == size;
+  std::fclose(f);
+  if (!ok) { delete [] data; data = 0; return "Couldn't read the cache file"; }
+#else
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0) return "Couldn't open the cache file";
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) { ::close(fd); return "The cache file is empty"; }
+  void *p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) return "Couldn't map the cache file";
+  data = (char*)p;
+  size = st.st_size;
+#endif
+  return 0;
+}
+
+
+void mapped_problem::close()
+{
+  if (!data) return;
+#ifdef _WIN32
+  delete [] data;
+#else
+  munmap(data, size);
+#endif
+  data = 0;
+  size = 0;
+}
+
+
+// Names are either missing (size 0) or there's one for each row or column,
+// each ending in a nul
+static bool check_names(const char *names, unsigned size, unsigned count)
+{
+  if (size == 0) return true;
+  if (names[size - 1] != 0) return false;
+  unsigned found = 0;
+  for (unsigned i = 0; i != size; ++i)
+    if (names[i] == 0) ++found;
+  return found == count;
+}
+
+
+const char *mapped_problem::open(const char *filename)
+{
+  close();
+  const char *err = map_file(filename, data, size);
+  if (err) return err;
+
+  const char *bad = "The cache file is damaged or was written by a different version of Rima";
+  if (size < sizeof(cache_header)) { close(); return bad; }
+  const cache_header &h = *(const cache_header*)data;
+  if (std::memcmp(h.magic, cache_magic, sizeof(cache_magic)) != 0) { close(); return bad; }
+  if (h.byte_order != cache_byte_order)
+  {
+    close();
+    return "The cache file was written on a machine with a different byte order";
   }
+
+  cache_layout l;
+  layout(h, l);
+  if (l.end != size) { close(); return bad; }
+
+  row_count = h.row_count;
+  column_count = h.column_count;
+  non_zero_count = h.non_zero_count;
+  maximise = h.maximise != 0;
+  has_integer = h.has_integer != 0;
+  row_starts = (const int*)(data + l.row_starts);
+  columns = (const int*)(data + l.columns);
+  values = (const double*)(data + l.values);
+  row_lower = (const double*)(data + l.row_lower);
+  row_upper = (const double*)(data + l.row_upper);
+  column_lower = (const double*)(data + l.column_lower);
+  column_upper = (const double*)(data + l.column_upper);
+  costs = (const double*)(data + l.costs);
+  integer = data + l.integer;
+  column_names = data + l.column_names;
+  row_names = data + l.row_names;
+  column_names_size = h.column_names_size;
+  row_names_size = h.row_names_size;
+
+  // Check the matrix so that a damaged file can't send the solver outside
+  // its arrays
+  bool ok = row_starts[0] == 0 && (unsigned)row_starts[row_count] == non_zero_count &&
+    check_names(column_names, h.column_names_size, column_count) &&
+    check_names(row_names, h.row_names_size, row_count);
+  for (unsigned i = 0; ok && i != row_count; ++i)
+    ok = row_starts[i+1] >= row_starts[i];
+  for (unsigned i = 0; ok && i != non_zero_count; ++i)
+    ok = (unsigned)columns[i] < column_count;
+  if (!ok) { close(); return bad; }
+
   return 0;
 }
 
 
-const char *build_variables(lua_State *L, unsigned variable_count, variable_builder_function *bf, void *bfd)
+void mapped_problem::copy(linear_problem &P) const
 {
-  for (unsigned i = 0; i != variable_count; ++i)
+  P.row_starts.assign(row_starts, row_starts + row_count + 1);
+  P.columns.assign(columns, columns + non_zero_count);
+  P.values.assign(values, values + non_zero_count);
+  P.row_lower.assign(row_lower, row_lower + row_count);
+  P.row_upper.assign(row_upper, row_upper + row_count);
+  P.column_lower.assign(column_lower, column_lower + column_count);
+  P.column_upper.assign(column_upper, column_upper + column_count);
+  P.costs.assign(costs, costs + column_count);
+  P.integer.assign(integer, integer + column_count);
+  P.maximise = maximise;
+}
+
+
+static unsigned names_size(const std::vector<const char*> &names)
+{
+  unsigned size = 0;
+  for (unsigned i = 0; i != names.size(); ++i)
+    size += std::strlen(names[i]) + 1;
+  return size;
+}
+
+
+static bool write_at(FILE *f, size_t offset, const void *p, size_t size)
+{
+  static const char zeroes[8] = { 0 };
+  long at = std::ftell(f);
+  if (at < 0 || (size_t)at > offset) return false;
+  if ((size_t)at < offset && std::fwrite(zeroes, 1, offset - at, f) != offset - at) return false;
+  return size == 0 || std::fwrite(p, 1, size, f) == size;
+}
+
+
+static bool write_names(FILE *f, size_t offset, const std::vector<const char*> &names)
+{
+  if (!write_at(f, offset, 0, 0)) return false;
+  for (unsigned i = 0; i != names.size(); ++i)
+    if (std::fwrite(names[i], 1, std::strlen(names[i]) + 1, f) != std::strlen(names[i]) + 1)
+      return false;
+  return true;
+}
+
+
+const char *write_problem_cache(const char *filename, const linear_problem &P,
+  const std::vector<const char*> &column_names, const std::vector<const char*> &row_names)
+{
+  if (P.row_starts.size() != P.row_count() + 1)
+    return "The problem's row starts don't match its rows";
+
+  cache_header h;
+  std::memset(&h, 0, sizeof(h));
+  std::memcpy(h.magic, cache_magic, sizeof(cache_magic));
+  h.byte_order = cache_byte_order;
+  h.row_count = P.row_count();
+  h.column_count = P.column_count();
+  h.non_zero_count = P.non_zero_count();
+  h.maximise = P.maximise;
+  for (unsigned i = 0; i != P.integer.size(); ++i)
+    if (P.integer[i]) h.has_integer = 1;
+  h.column_names_size = names_size(column_names);
+  h.row_names_size = names_size(row_names);
+
+  cache_layout l;
+  layout(h, l);
+
+  std::string temporary = std::string(filename) + ".tmp";
+  FILE *f = std::fopen(temporary.c_str(), "wb");
+  if (!f) return "Couldn't open the cache file for writing";
+
+  bool ok =
+    write_at(f, 0, &h, sizeof(h)) &&
+    write_at(f, l.row_starts, vector_data(P.row_starts), P.row_starts.size() * sizeof(int)) &&
+    write_at(f, l.columns, vector_data(P.columns), P.columns.size() * sizeof(int)) &&
+    write_at(f, l.values, vector_data(P.values), P.values.size() * sizeof(double)) &&
+    write_at(f, l.row_lower, vector_data(P.row_lower), P.row_lower.size() * sizeof(double)) &&
+    write_at(f, l.row_upper, vector_data(P.row_upper), P.row_upper.size() * sizeof(double)) &&
+    write_at(f, l.column_lower, vector_data(P.column_lower), P.column_lower.size() * sizeof(double)) &&
+    write_at(f, l.column_upper, vector_data(P.column_upper), P.column_upper.size() * sizeof(double)) &&
+    write_at(f, l.costs, vector_data(P.costs), P.costs.size() * sizeof(double)) &&
+    write_at(f, l.integer, vector_data(P.integer), P.integer.size()) &&
+    write_names(f, l.column_names, column_names) &&
+    write_names(f, l.row_names, row_names) &&
+    write_at(f, l.end, 0, 0);
+  ok = std::fclose(f) == 0 && ok;
+
+  if (ok && std::rename(temporary.c_str(), filename) != 0)
+  {
+    // Windows won't rename over an existing file
+    std::remove(filename);
+    ok = std::rename(temporary.c_str(), filename) == 0;
+  }
+  if (!ok)
   {
-    lua_rawgeti(L, 2, i+1);
+    std::remove(temporary.c_str());
+    return "Couldn't write the cache file";
+  }
+  return 0;
+}
 
-    double lower, upper;
-    bool integer;
 
-    lua_pushstring(L, "type");
-    lua_rawget(L, -2);
-    {
-      lua_pushstring(L, "lower");
-      lua_rawget(L, -2);
-      lower = lua_tonumber(L, -1);
-      lua_pop(L, 1);
-
-      lua_pushstring(L, "upper");
-      lua_rawget(L, -2);
-      upper = lua_tonumber(L, -1);
-      lua_pop(L, 1);
-
-      lua_pushstring(L, "integer");
-      lua_rawget(L, -2);
-      integer = lua_toboolean(L, -1);
-      lua_pop(L, 1);
-    }
-    lua_pop(L, 1);
+static void push_names(lua_State *L, const char *names, unsigned size, unsigned count)
+{
+  if (size == 0) count = 0;
+  lua_createtable(L, count, 0);
+  for (unsigned i = 0; i != count; ++i)
+  {
+    lua_pushstring(L, names);
+    lua_rawseti(L, -2, i + 1);
+    names += std::strlen(names) + 1;
+  }
+}
 
-    lua_pushstring(L, "cost");
-    lua_rawget(L, -2);
-    double cost = lua_tonumber(L, -1);
-    lua_pop(L, 1);
 
-    const char *err = bf(bfd, i, cost, lower, upper, integer);
-    if (err) return err;
+void push_cache_names(lua_State *L, const mapped_problem &M)
+{
+  lua_createtable(L, 0, 2);
+  push_names(L, M.column_names, M.column_names_size, M.column_count);
+  lua_setfield(L, -2, "columns");
+  push_names(L, M.row_names, M.row_names_size, M.row_count);
+  lua_setfield(L, -2, "rows");
+}
 
-    lua_pop(L, 1);
+
+int cache_key(lua_State *L)
+{
+  size_t length;
+  const unsigned char *s = (const unsigned char*)luaL_checklstring(L, 1, &length);
+
+  // 64-bit FNV-1a
+  unsigned long long h = 14695981039346656037ULL;
+  for (size_t i = 0; i != length; ++i)
+  {
+    h ^= s[i];
+    h *= 1099511628211ULL;
+  }
+
+  char key[17];
+  std::sprintf(key, "%08lx%08lx", (unsigned long)(h >> 32), (unsigned long)(h & 0xffffffffUL));
+  lua_pushstring(L, key);
+  return 1;
+}
+
+
+int cache_info(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  mapped_problem M;
+  const char *err = M.open(filename);
+  if (err) return error(L, err);
+
+  lua_createtable(L, 0, 5);
+  lua_pushinteger(L, M.row_count);
+  lua_setfield(L, -2, "rows");
+  lua_pushinteger(L, M.column_count);
+  lua_setfield(L, -2, "columns");
+  lua_pushinteger(L, M.non_zero_count);
+  lua_setfield(L, -2, "nonzeros");
+  lua_pushboolean(L, M.has_integer);
+  lua_setfield(L, -2, "integer");
+  lua_pushboolean(L, M.maximise);
+  lua_setfield(L, -2, "maximise");
+  return 1;
+}
+
+
+int write_cache(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  try
+  {
+    linear_problem P;
+    const char *err = read_linear_problem(L, 2, P);
+    if (err) return error(L, err);
+
+    std::vector<const char*> column_names, row_names;
+    if ((err = read_option(L, 3, "columns", column_names)) ||
+        (err = read_option(L, 3, "rows", row_names)))
+      return error(L, err);
+    if (!column_names.empty() && column_names.size() != P.column_count())
+      return error(L, "There should be a name for every column");
+    if (!row_names.empty() && row_names.size() != P.row_count())
+      return error(L, "There should be a name for every row");
+
+    err = write_problem_cache(filename, P, column_names, row_names);
+    if (err) return error(L, err);
   }
+  catch (std::bad_alloc)        { return error(L, "Memory allocation failure"); }
+  catch (std::exception &e)     { return error(L, e.what()); }
+  catch (...)                   { return error(L, "Unknown error"); }
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*============================================================================*/
+
+static const char solution_metatable_name[] = "rima.solution";
+
+
+static solution_arrays *get_solution(lua_State *L)
+{
+  return (solution_arrays*)luaL_checkudata(L, 1, solution_metatable_name);
+}
+
+
+static int push_values(lua_State *L, const std::vector<double> &primal, const std::vector<double> &dual)
+{
+  int i = luaL_checkint(L, 2);
+  if (i < 1 || i > (int)primal.size())
+    return luaL_argerror(L, 2, "index out of range");
+  lua_pushnumber(L, primal[i-1]);
+  lua_pushnumber(L, dual[i-1]);
+  return 2;
+}
+
+
+static int solution_column(lua_State *L)
+{
+  solution_arrays *S = get_solution(L);
+  return push_values(L, S->column_primal, S->column_dual);
+}
+
+
+static int solution_row(lua_State *L)
+{
+  solution_arrays *S = get_solution(L);
+  return push_values(L, S->row_primal, S->row_dual);
+}
+
+
+static int solution_column_count(lua_State *L)
+{
+  lua_pushinteger(L, get_solution(L)->column_primal.size());
+  return 1;
+}
+
+
+static int solution_row_count(lua_State *L)
+{
+  lua_pushinteger(L, get_solution(L)->row_primal.size());
+  return 1;
+}
+
+
+static int solution_values(lua_State *L)
+{
+  solution_arrays *S = get_solution(L);
+  const char *which = luaL_checkstring(L, 2);
+  const std::vector<double> *v =
+    std::strcmp(which, "column_primal") == 0 ? &S->column_primal :
+    std::strcmp(which, "column_dual") == 0 ? &S->column_dual :
+    std::strcmp(which, "row_primal") == 0 ? &S->row_primal :
+    std::strcmp(which, "row_dual") == 0 ? &S->row_dual : 0;
+  if (!v)
+    return luaL_argerror(L, 2, "expected 'column_primal', 'column_dual', 'row_primal' or 'row_dual'");
+
+  lua_createtable(L, v->size(), 0);
+  for (unsigned i = 0; i != v->size(); ++i)
+  {
+    lua_pushnumber(L, (*v)[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
+
+
+static int solution_delete(lua_State *L)
+{
+  get_solution(L)->~solution_arrays();
   return 0;
 }
 
 
+static luaL_Reg solution_methods[] =
+{
+  {"__gc", solution_delete},
+  {"column", solution_column},
+  {"row", solution_row},
+  {"column_count", solution_column_count},
+  {"row_count", solution_row_count},
+  {"values", solution_values},
+  {NULL, NULL}
+};
+
+
+solution_arrays *new_solution(lua_State *L)
+{
+  solution_arrays *S = (solution_arrays*)lua_newuserdata(L, sizeof(solution_arrays));
+  new (S) solution_arrays;
+
+  // Every core that returns solutions shares the one metatable
+  if (luaL_newmetatable(L, solution_metatable_name))
+  {
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_register(L, NULL, solution_methods);
+  }
+  lua_setmetatable(L, -2);
+  return S;
+}
+
+
 /*============================================================================*/
 
+double wall_time()
+{
+#ifdef _WIN32
+  LARGE_INTEGER frequency, count;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&count);
+  return (double)count.QuadPart / frequency.QuadPart;
+#else
+  timeval t;
+  gettimeofday(&t, 0);
+  return t.tv_sec + t.tv_usec * 1e-6;
+#endif
+}
+
+
+int push_wall_time(lua_State *L)
+{
+  lua_pushnumber(L, wall_time());
+  return 1;
+}
+
+
+/*============================================================================*/
@@ -15,18 +15,179 @@ extern "C"
 #include "lualib.h"
 }
 
+#include <vector>
+#include <algorithm>
+
 /*============================================================================*/
 
 int error(lua_State *L, const char *s);
 
-const char *check_constraints(lua_State *L, unsigned constraint_count, unsigned column_count, unsigned &max_non_zeroes);
+// What's changed in a model since it was last solved, so that the next solve
+// can choose how to restart from the old basis
+enum
+{
+  BOUNDS_CHANGED = 1,
+  COSTS_CHANGED = 2,
+  MATRIX_CHANGED = 4
+};
+
+/*============================================================================*/
+
+// A whole linear problem with the matrix in compressed row form.  Column
+// indices are zero-based, and row i's elements are at
+// row_starts[i] <= k < row_starts[i+1].
+struct linear_problem
+{
+  linear_problem() : maximise(false) {}
+
+  unsigned row_count() const { return row_lower.size(); }
+  unsigned column_count() const { return column_lower.size(); }
+  unsigned non_zero_count() const { return values.size(); }
+
+  void swap(linear_problem &other)
+  {
+    row_starts.swap(other.row_starts);
+    columns.swap(other.columns);
+    values.swap(other.values);
+    row_lower.swap(other.row_lower);
+    row_upper.swap(other.row_upper);
+    column_lower.swap(other.column_lower);
+    column_upper.swap(other.column_upper);
+    costs.swap(other.costs);
+    integer.swap(other.integer);
+    std::swap(maximise, other.maximise);
+  }
+
+  std::vector<int> row_starts;
+  std::vector<int> columns;
+  std::vector<double> values;
+  std::vector<double> row_lower, row_upper;
+  std::vector<double> column_lower, column_upper, costs;
+  std::vector<char> integer;
+  bool maximise;
+};
+
+template <class T> T *vector_data(std::vector<T> &v) { return v.empty() ? 0 : &v[0]; }
+template <class T> const T *vector_data(const std::vector<T> &v) { return v.empty() ? 0 : &v[0]; }
+
+const char *read_linear_problem(lua_State *L, int index, linear_problem &P);
+
+// Read a table of constraints ({lower=, upper=, elements={{index=, coeff=}...}})
+// and append them to P's rows.  On error, P's rows are left as they were.
+const char *read_constraints(lua_State *L, int index, unsigned column_count, linear_problem &P);
+
+// Read a table of variables ({cost=, type={lower=, upper=, integer=}}) into P's
+// columns.
+const char *read_variables(lua_State *L, int index, linear_problem &P);
+
+/*============================================================================*/
+
+// Read options[name] from an (optional) table of solve options.  If the option
+// isn't set, value is left as it was.
+const char *read_option(lua_State *L, int index, const char *name, const char *&value);
+const char *read_option(lua_State *L, int index, const char *name, double &value);
+const char *read_option(lua_State *L, int index, const char *name, int &value);
+const char *read_option(lua_State *L, int index, const char *name, bool &value);
+const char *read_option(lua_State *L, int index, const char *name, std::vector<const char*> &value);
+
+/*============================================================================*/
+
+// How to write a model to a file: the format ("mps" or "lp"), compression
+// ("none", "gzip" or "bzip2") and, optionally, names for the columns and
+// rows.  Not every solver supports every combination.
+struct write_options
+{
+  write_options() : format("mps"), compression("none") {}
+
+  const char *format;
+  const char *compression;
+  std::vector<const char*> column_names, row_names;
+};
+
+// Read write options from an (optional) table at index, and check that the
+// names, if there are any, match the model's size.
+const char *read_write_options(lua_State *L, int index, unsigned column_count, unsigned row_count,
+  write_options &o);
+
+/*============================================================================*/
+
+// A linear problem and its column and row names saved in a binary file that
+// is mapped into memory and loaded without parsing.  The file is a header
+// followed by row_starts, columns, values, row_lower, row_upper,
+// column_lower, column_upper, costs, integer and the column and row names
+// (each ending in a nul), each starting on an 8-byte boundary.  The numbers
+// are in the writing machine's byte order, and a file from a machine with a
+// different byte order is refused.
+struct mapped_problem
+{
+  mapped_problem() : data(0), size(0) {}
+  ~mapped_problem() { close(); }
+
+  // Map a cache file and check that it's consistent
+  const char *open(const char *filename);
+  void close();
+
+  // Copy the arrays into P, in the same form as read_linear_problem
+  void copy(linear_problem &P) const;
+
+  unsigned row_count, column_count, non_zero_count;
+  bool maximise, has_integer;
+  const int *row_starts, *columns;
+  const double *values, *row_lower, *row_upper, *column_lower, *column_upper, *costs;
+  const char *integer, *column_names, *row_names;
+  unsigned column_names_size, row_names_size;
+
+private:
+  mapped_problem(const mapped_problem &);
+  mapped_problem &operator=(const mapped_problem &);
 
-typedef const char *(constraint_builder_function)(void *data, unsigned non_zeroes, int *columns, double *coefficients, double lower, double upper);
-const char *build_constraints(lua_State *L, unsigned max_non_zeroes, unsigned constraint_count, int column_offset, constraint_builder_function *bf, void *bfd);
+  char *data;
+  size_t size;
+};
+
+// Write P and its names (which may be empty) to a cache file.  The file is
+// written under a temporary name and then renamed, so a reader never sees a
+// partly written cache.
+const char *write_problem_cache(const char *filename, const linear_problem &P,
+  const std::vector<const char*> &column_names, const std::vector<const char*> &row_names);
+
+// Push a mapped problem's names as { columns = {...}, rows = {...} }
+void push_cache_names(lua_State *L, const mapped_problem &M);
+
+// Module functions shared by the linear cores:
+//   cache_key(s): a 16 hex digit hash of the string s, for naming cache files
+//   cache_info(filename): { rows=, columns=, nonzeros=, integer=, maximise= }
+//     for a cache file, without loading it
+//   write_cache(filename, problem, names): write a problem (a table as for
+//     load_problem) and its names ({ columns = {...}, rows = {...} })
+int cache_key(lua_State *L);
+int cache_info(lua_State *L);
+int write_cache(lua_State *L);
+
+/*============================================================================*/
+
+// A solution kept in arrays rather than in a Lua table for each column and
+// row.  Lua sees it as a "rima.solution" userdata with methods:
+//   column(i), row(i): the primal and dual values of column or row i (1-based)
+//   column_count(), row_count()
+//   values(which): a table copy of a whole array: "column_primal",
+//     "column_dual" (the reduced costs), "row_primal" (the activities) or
+//     "row_dual"
+struct solution_arrays
+{
+  std::vector<double> column_primal, column_dual, row_primal, row_dual;
+};
+
+// Push a new, empty, solution userdata and return its arrays to fill in
+solution_arrays *new_solution(lua_State *L);
+
+/*============================================================================*/
 
-const char *check_variables(lua_State *L, unsigned variable_count);
-typedef const char *(variable_builder_function)(void *data, unsigned index, double cost, double lower, double upper, bool integer);
-const char *build_variables(lua_State *L, unsigned variable_count, variable_builder_function *bf, void *bfd);
+// Seconds from some fixed point in the past, for timing things that run on
+// several threads (os.clock adds up the time of every thread).  push_wall_time
+// is the same as a module function, wall_time().
+double wall_time();
+int push_wall_time(lua_State *L);
 
 /*============================================================================*/
 #endif
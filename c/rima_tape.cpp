@@ -0,0 +1,699 @@
+/*******************************************************************************
+
+rima_tape.cpp
+
+Copyright (c) 2009-2013 Incremental IP Limited
+see LICENSE for license information
+
+*******************************************************************************/
+
+#include "rima_tape.h"
+extern "C"
+{
+#include "lauxlib.h"
+}
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <set>
+#include <algorithm>
+
+
+/*============================================================================*/
+
+enum
+{
+  TAPE_CONSTANT, TAPE_VARIABLE, TAPE_SIGMA, TAPE_LAMBDA,
+  TAPE_ADD, TAPE_MULTIPLY, TAPE_SCALE, TAPE_POWER, TAPE_POW,
+  TAPE_EXP, TAPE_LOG, TAPE_LOG10,
+  TAPE_SIN, TAPE_ASIN, TAPE_COS, TAPE_ACOS, TAPE_TAN, TAPE_ATAN,
+  TAPE_SINH, TAPE_COSH, TAPE_TANH,
+  TAPE_SQRT
+};
+
+
+// The names rima.compiler uses for each op, in the order above
+static const char *op_names[] =
+{
+  "constant", "variable", "sigma", "lambda",
+  "add", "multiply", "scale", "power", "pow",
+  "exp", "log", "log10",
+  "sin", "asin", "cos", "acos", "tan", "atan",
+  "sinh", "cosh", "tanh",
+  "sqrt",
+  0
+};
+
+
+/*============================================================================*/
+
+static int find_op(const char *name)
+{
+  for (int i = 0; op_names[i]; ++i)
+    if (std::strcmp(name, op_names[i]) == 0)
+      return i;
+  return -1;
+}
+
+
+// Leaves field on the stack
+static bool get_array(lua_State *L, int index, const char *field, unsigned length)
+{
+  lua_getfield(L, index, field);
+  return lua_type(L, -1) == LUA_TTABLE && lua_objlen(L, -1) == length;
+}
+
+
+static double get_number(lua_State *L, int i)
+{
+  lua_rawgeti(L, -1, i);
+  double d = lua_tonumber(L, -1);
+  lua_pop(L, 1);
+  return d;
+}
+
+
+const char *read_tape(lua_State *L, int index, int variable_count, int constraint_count, expression_tape &T)
+{
+  int top = lua_gettop(L);
+  if (index < 0) index = top + index + 1;
+  if (lua_type(L, index) != LUA_TTABLE)
+    return "The tape must be a table";
+
+  lua_getfield(L, index, "op");
+  if (lua_type(L, -1) != LUA_TTABLE)
+  {
+    lua_settop(L, top);
+    return "The tape must have a table of ops";
+  }
+  unsigned length = lua_objlen(L, -1);
+  T.code.resize(length);
+  for (unsigned i = 0; i != length; ++i)
+  {
+    lua_rawgeti(L, -1, i+1);
+    const char *name = lua_tostring(L, -1);
+    T.code[i].op = name ? find_op(name) : -1;
+    lua_pop(L, 1);
+    if (T.code[i].op < 0)
+    {
+      lua_settop(L, top);
+      return "Unknown op on the tape";
+    }
+  }
+  lua_pop(L, 1);
+
+  if (!get_array(L, index, "a", length) ||
+      !get_array(L, index, "b", length) ||
+      !get_array(L, index, "value", length))
+  {
+    lua_settop(L, top);
+    return "The tape's a, b and value arrays must be as long as its ops";
+  }
+  for (unsigned i = 0; i != length; ++i)
+  {
+    tape_instruction &I = T.code[i];
+    I.value = get_number(L, i+1);
+    lua_pushvalue(L, -2);
+    I.b = (int)get_number(L, i+1) - 1;
+    lua_pop(L, 1);
+    lua_pushvalue(L, -3);
+    I.a = (int)get_number(L, i+1) - 1;
+    lua_pop(L, 1);
+
+    // Check that inputs are in range, and that every instruction only uses
+    // values that have already been computed
+    bool ok;
+    switch (I.op)
+    {
+    case TAPE_CONSTANT:
+    case TAPE_SIGMA:    ok = true; break;
+    case TAPE_VARIABLE: ok = I.a >= 0 && I.a < variable_count; break;
+    case TAPE_LAMBDA:   ok = I.a >= 0 && I.a < constraint_count; break;
+    case TAPE_ADD:
+    case TAPE_MULTIPLY:
+    case TAPE_POW:      ok = I.a >= 0 && (unsigned)I.a < i && I.b >= 0 && (unsigned)I.b < i; break;
+    default:            ok = I.a >= 0 && (unsigned)I.a < i; break;
+    }
+    if (!ok)
+    {
+      lua_settop(L, top);
+      return "Tape argument out of range";
+    }
+  }
+  lua_settop(L, top);
+
+  lua_getfield(L, index, "outputs");
+  if (lua_type(L, -1) != LUA_TTABLE)
+  {
+    lua_settop(L, top);
+    return "The tape must have a table of outputs";
+  }
+  T.outputs.resize(lua_objlen(L, -1));
+  for (unsigned i = 0; i != T.outputs.size(); ++i)
+  {
+    T.outputs[i] = (int)get_number(L, i+1) - 1;
+    if (T.outputs[i] < 0 || (unsigned)T.outputs[i] >= length)
+    {
+      lua_settop(L, top);
+      return "Tape output out of range";
+    }
+  }
+  lua_settop(L, top);
+  return 0;
+}
+
+
+/*============================================================================*/
+
+void evaluate_tape(const expression_tape &T, const double *x, double sigma, const double *lambda,
+  double *work, double *result)
+{
+  const tape_instruction *code = T.code.empty() ? 0 : &T.code[0];
+  unsigned length = T.code.size();
+
+  for (unsigned i = 0; i != length; ++i)
+  {
+    const tape_instruction &I = code[i];
+    double a = (I.op > TAPE_LAMBDA) ? work[I.a] : 0.0;
+    double r;
+    switch (I.op)
+    {
+    case TAPE_CONSTANT: r = I.value; break;
+    case TAPE_VARIABLE: r = x[I.a]; break;
+    case TAPE_SIGMA:    r = sigma; break;
+    case TAPE_LAMBDA:   r = lambda[I.a]; break;
+    case TAPE_ADD:      r = a + work[I.b]; break;
+    case TAPE_MULTIPLY: r = a * work[I.b]; break;
+    case TAPE_SCALE:    r = I.value * a; break;
+    case TAPE_POWER:
+      if (I.value == 2.0) r = a * a;
+      else if (I.value == -1.0) r = 1.0 / a;
+      else r = std::pow(a, I.value);
+      break;
+    case TAPE_POW:      r = std::pow(a, work[I.b]); break;
+    case TAPE_EXP:      r = std::exp(a); break;
+    case TAPE_LOG:      r = std::log(a); break;
+    case TAPE_LOG10:    r = std::log10(a); break;
+    case TAPE_SIN:      r = std::sin(a); break;
+    case TAPE_ASIN:     r = std::asin(a); break;
+    case TAPE_COS:      r = std::cos(a); break;
+    case TAPE_ACOS:     r = std::acos(a); break;
+    case TAPE_TAN:      r = std::tan(a); break;
+    case TAPE_ATAN:     r = std::atan(a); break;
+    case TAPE_SINH:     r = std::sinh(a); break;
+    case TAPE_COSH:     r = std::cosh(a); break;
+    case TAPE_TANH:     r = std::tanh(a); break;
+    case TAPE_SQRT:     r = std::sqrt(a); break;
+    default:            r = 0.0; break;
+    }
+    work[i] = r;
+  }
+
+  for (unsigned i = 0; i != T.outputs.size(); ++i)
+    result[i] = work[T.outputs[i]];
+}
+
+
+/*============================================================================*/
+
+
+// The earlier instructions an instruction uses
+static int arguments(const tape_instruction &I, int *args)
+{
+  switch (I.op)
+  {
+  case TAPE_CONSTANT:
+  case TAPE_VARIABLE:
+  case TAPE_SIGMA:
+  case TAPE_LAMBDA:   return 0;
+  case TAPE_ADD:
+  case TAPE_MULTIPLY:
+  case TAPE_POW:      args[0] = I.a; args[1] = I.b; return 2;
+  default:            args[0] = I.a; return 1;
+  }
+}
+
+
+// The instructions reachable from any of starts (marked with stamp), in order
+static void reachable(const expression_tape &T, const std::vector<int> &starts, std::vector<int> &mark,
+  int stamp, std::vector<int> &result)
+{
+  result.clear();
+  std::vector<int> stack;
+  for (unsigned k = 0; k != starts.size(); ++k)
+    if (mark[starts[k]] != stamp)
+    {
+      mark[starts[k]] = stamp;
+      stack.push_back(starts[k]);
+    }
+  while (!stack.empty())
+  {
+    int i = stack.back();
+    stack.pop_back();
+    result.push_back(i);
+    int args[2];
+    int n = arguments(T.code[i], args);
+    for (int k = 0; k != n; ++k)
+      if (mark[args[k]] != stamp)
+      {
+        mark[args[k]] = stamp;
+        stack.push_back(args[k]);
+      }
+  }
+  std::sort(result.begin(), result.end());
+}
+
+
+static void reachable(const expression_tape &T, int start, std::vector<int> &mark, int stamp,
+  std::vector<int> &result)
+{
+  reachable(T, std::vector<int>(1, start), mark, stamp, result);
+}
+
+
+// The variables an instruction depends on, sorted
+static void variables_of(const expression_tape &T, int start, std::vector<int> &mark, int &stamp,
+  std::vector<int> &result)
+{
+  std::vector<int> nodes;
+  reachable(T, start, mark, ++stamp, nodes);
+  result.clear();
+  for (unsigned k = 0; k != nodes.size(); ++k)
+    if (T.code[nodes[k]].op == TAPE_VARIABLE)
+      result.push_back(T.code[nodes[k]].a);
+  std::sort(result.begin(), result.end());
+  result.erase(std::unique(result.begin(), result.end()), result.end());
+}
+
+
+typedef std::set<std::pair<int, int> > pair_set;
+
+static void add_pairs(const std::vector<int> &u, const std::vector<int> &v, pair_set &pairs)
+{
+  for (unsigned i = 0; i != u.size(); ++i)
+    for (unsigned j = 0; j != v.size(); ++j)
+      pairs.insert(std::make_pair(std::max(u[i], v[j]), std::min(u[i], v[j])));
+}
+
+
+// The degree of each instruction as a polynomial in x, capped at 3 (which
+// also stands for anything that isn't a polynomial)
+static void polynomial_degrees(const expression_tape &T, std::vector<int> &degrees)
+{
+  degrees.resize(T.size());
+  for (unsigned i = 0; i != T.size(); ++i)
+  {
+    const tape_instruction &I = T.code[i];
+    int a = I.op > TAPE_LAMBDA ? degrees[I.a] : 0;
+    int d;
+    switch (I.op)
+    {
+    case TAPE_CONSTANT:
+    case TAPE_SIGMA:
+    case TAPE_LAMBDA:   d = 0; break;
+    case TAPE_VARIABLE: d = 1; break;
+    case TAPE_ADD:      d = std::max(a, degrees[I.b]); break;
+    case TAPE_SCALE:    d = a; break;
+    case TAPE_MULTIPLY: d = a + degrees[I.b]; break;
+    case TAPE_POWER:
+      if (I.value >= 0.0 && I.value <= 3.0 && I.value == std::floor(I.value))
+        d = a * (int)I.value;
+      else
+        d = a == 0 ? 0 : 3;
+      break;
+    case TAPE_POW:      d = a == 0 && degrees[I.b] == 0 ? 0 : 3; break;
+    default:            d = a == 0 ? 0 : 3; break;
+    }
+    degrees[i] = std::min(d, 3);
+  }
+}
+
+
+void prepare_derivatives(const expression_tape &T, int variable_count, tape_derivatives &D,
+  bool hessian)
+{
+  unsigned output_count = T.output_count();
+  std::vector<int> mark(T.size(), 0);
+  int stamp = 0;
+
+  std::vector<int> degrees;
+  polynomial_degrees(T, degrees);
+  D.degrees.resize(output_count);
+  for (unsigned k = 0; k != output_count; ++k)
+    D.degrees[k] = degrees[T.outputs[k]];
+
+  D.segments.resize(output_count);
+  D.columns.resize(output_count);
+  D.jacobian_rows.clear();
+  D.jacobian_cols.clear();
+
+  std::vector<pair_set> output_pairs(output_count);
+  pair_set all_pairs;
+  std::vector<int> u, v;
+
+  // For each output, the nonlinear instructions that depend on each variable
+  typedef std::map<int, std::vector<int> > root_map;
+  std::vector<root_map> output_roots(output_count);
+
+  for (unsigned k = 0; k != output_count; ++k)
+  {
+    const std::vector<int> &segment = D.segments[k];
+    reachable(T, T.outputs[k], mark, ++stamp, D.segments[k]);
+    variables_of(T, T.outputs[k], mark, stamp, D.columns[k]);
+
+    if (k > 0)
+      for (unsigned j = 0; j != D.columns[k].size(); ++j)
+      {
+        D.jacobian_rows.push_back(k - 1);
+        D.jacobian_cols.push_back(D.columns[k][j]);
+      }
+
+    // Only products and nonlinear functions couple variables in the hessian.
+    // Note which variables each of them depends on, so that a direction's
+    // sweeps can skip the instructions that don't.
+    for (unsigned s = 0; hessian && s != segment.size(); ++s)
+    {
+      const tape_instruction &I = T.code[segment[s]];
+      switch (I.op)
+      {
+      case TAPE_CONSTANT:
+      case TAPE_VARIABLE:
+      case TAPE_SIGMA:
+      case TAPE_LAMBDA:
+      case TAPE_ADD:
+      case TAPE_SCALE:
+        continue;
+      case TAPE_MULTIPLY:
+        variables_of(T, I.a, mark, stamp, u);
+        variables_of(T, I.b, mark, stamp, v);
+        add_pairs(u, v, output_pairs[k]);
+        u.insert(u.end(), v.begin(), v.end());
+        break;
+      case TAPE_POWER:
+        if (I.value == 0.0 || I.value == 1.0) continue;
+        variables_of(T, I.a, mark, stamp, u);
+        add_pairs(u, u, output_pairs[k]);
+        break;
+      case TAPE_POW:
+        variables_of(T, I.a, mark, stamp, u);
+        variables_of(T, I.b, mark, stamp, v);
+        u.insert(u.end(), v.begin(), v.end());
+        add_pairs(u, u, output_pairs[k]);
+        break;
+      default:
+        variables_of(T, I.a, mark, stamp, u);
+        add_pairs(u, u, output_pairs[k]);
+        break;
+      }
+      std::sort(u.begin(), u.end());
+      u.erase(std::unique(u.begin(), u.end()), u.end());
+      for (unsigned j = 0; j != u.size(); ++j)
+        output_roots[k][u[j]].push_back(segment[s]);
+    }
+    all_pairs.insert(output_pairs[k].begin(), output_pairs[k].end());
+  }
+
+  // Number the hessian entries in (row, column) order
+  std::map<std::pair<int, int>, int> positions;
+  D.hessian_rows.clear();
+  D.hessian_cols.clear();
+  for (pair_set::const_iterator p = all_pairs.begin(); p != all_pairs.end(); ++p)
+  {
+    positions[*p] = D.hessian_rows.size();
+    D.hessian_rows.push_back(p->first);
+    D.hessian_cols.push_back(p->second);
+  }
+
+  // and group each output's entries by column, which is a direction we have
+  // to sweep in
+  D.hessian_columns.clear();
+  for (unsigned k = 0; k != output_count; ++k)
+  {
+    std::map<int, tape_derivatives::hessian_column> by_column;
+    for (pair_set::const_iterator p = output_pairs[k].begin(); p != output_pairs[k].end(); ++p)
+    {
+      tape_derivatives::hessian_column &c = by_column[p->second];
+      c.output = k;
+      c.direction = p->second;
+      c.rows.push_back(p->first);
+      c.positions.push_back(positions[*p]);
+    }
+    for (std::map<int, tape_derivatives::hessian_column>::iterator c = by_column.begin(); c != by_column.end(); ++c)
+    {
+      reachable(T, output_roots[k][c->first], mark, ++stamp, c->second.sweep);
+      D.hessian_columns.push_back(c->second);
+    }
+  }
+
+  D.adjoint.assign(T.size(), 0.0);
+  D.tangent.assign(T.size(), 0.0);
+  D.adjoint_tangent.assign(T.size(), 0.0);
+  D.dense.assign(variable_count, 0.0);
+}
+
+
+/*============================================================================*/
+
+// First and second derivatives of the one-argument ops at a, where r is the
+// result
+static void unary_derivatives(const tape_instruction &I, double a, double r, double &d1, double &d2)
+{
+  switch (I.op)
+  {
+  case TAPE_SCALE:  d1 = I.value; d2 = 0.0; break;
+  case TAPE_POWER:
+    if (I.value == 2.0) { d1 = 2.0 * a; d2 = 2.0; }
+    else
+    {
+      d1 = I.value * std::pow(a, I.value - 1.0);
+      d2 = I.value * (I.value - 1.0) * std::pow(a, I.value - 2.0);
+    }
+    break;
+  case TAPE_EXP:    d1 = r; d2 = r; break;
+  case TAPE_LOG:    d1 = 1.0 / a; d2 = -d1 * d1; break;
+  case TAPE_LOG10:  d1 = 1.0 / (a * std::log(10.0)); d2 = -d1 / a; break;
+  case TAPE_SIN:    d1 = std::cos(a); d2 = -r; break;
+  case TAPE_COS:    d1 = -std::sin(a); d2 = -r; break;
+  case TAPE_TAN:    d1 = 1.0 + r * r; d2 = 2.0 * r * d1; break;
+  case TAPE_ASIN:   d1 = 1.0 / std::sqrt(1.0 - a * a); d2 = a * d1 * d1 * d1; break;
+  case TAPE_ACOS:   d1 = -1.0 / std::sqrt(1.0 - a * a); d2 = a * d1 * d1 * d1; break;
+  case TAPE_ATAN:   d1 = 1.0 / (1.0 + a * a); d2 = -2.0 * a * d1 * d1; break;
+  case TAPE_SINH:   d1 = std::cosh(a); d2 = r; break;
+  case TAPE_COSH:   d1 = std::sinh(a); d2 = r; break;
+  case TAPE_TANH:   d1 = 1.0 - r * r; d2 = -2.0 * r * d1; break;
+  case TAPE_SQRT:   d1 = 0.5 / r; d2 = -d1 / (2.0 * a); break;
+  default:          d1 = 0.0; d2 = 0.0; break;
+  }
+}
+
+
+// Partial derivatives of a^b
+static void pow_derivatives(double a, double b, double r,
+  double &fa, double &fb, double &faa, double &fab, double &fbb)
+{
+  double log_a = a > 0.0 ? std::log(a) : 0.0;
+  fa = b * std::pow(a, b - 1.0);
+  fb = r * log_a;
+  faa = b * (b - 1.0) * std::pow(a, b - 2.0);
+  fab = std::pow(a, b - 1.0) * (1.0 + b * log_a);
+  fbb = fb * log_a;
+}
+
+
+// Propagate adjoints back through an output's instructions
+static void reverse_sweep(const expression_tape &T, const std::vector<int> &segment,
+  const double *work, double *adjoint)
+{
+  for (unsigned s = segment.size(); s-- != 0; )
+  {
+    int i = segment[s];
+    const tape_instruction &I = T.code[i];
+    double r_bar = adjoint[i];
+    if (r_bar == 0.0) continue;
+    switch (I.op)
+    {
+    case TAPE_CONSTANT:
+    case TAPE_VARIABLE:
+    case TAPE_SIGMA:
+    case TAPE_LAMBDA:
+      break;
+    case TAPE_ADD:
+      adjoint[I.a] += r_bar;
+      adjoint[I.b] += r_bar;
+      break;
+    case TAPE_MULTIPLY:
+      adjoint[I.a] += r_bar * work[I.b];
+      adjoint[I.b] += r_bar * work[I.a];
+      break;
+    case TAPE_POW:
+    {
+      double fa, fb, faa, fab, fbb;
+      pow_derivatives(work[I.a], work[I.b], work[i], fa, fb, faa, fab, fbb);
+      adjoint[I.a] += r_bar * fa;
+      adjoint[I.b] += r_bar * fb;
+      break;
+    }
+    default:
+    {
+      double d1, d2;
+      unary_derivatives(I, work[I.a], work[i], d1, d2);
+      adjoint[I.a] += r_bar * d1;
+      break;
+    }
+    }
+  }
+}
+
+
+static void seed_adjoints(tape_derivatives &D, const std::vector<int> &segment, int output, double weight)
+{
+  for (unsigned s = 0; s != segment.size(); ++s)
+    D.adjoint[segment[s]] = 0.0;
+  D.adjoint[output] = weight;
+}
+
+
+void tape_gradient(const expression_tape &T, tape_derivatives &D, unsigned output,
+  const double *work, double *gradient)
+{
+  const std::vector<int> &segment = D.segments[output];
+  const std::vector<int> &columns = D.columns[output];
+  if (segment.empty()) return;
+
+  seed_adjoints(D, segment, T.outputs[output], 1.0);
+  reverse_sweep(T, segment, work, &D.adjoint[0]);
+
+  for (unsigned j = 0; j != columns.size(); ++j)
+    D.dense[columns[j]] = 0.0;
+  for (unsigned s = 0; s != segment.size(); ++s)
+  {
+    const tape_instruction &I = T.code[segment[s]];
+    if (I.op == TAPE_VARIABLE)
+      D.dense[I.a] += D.adjoint[segment[s]];
+  }
+  for (unsigned j = 0; j != columns.size(); ++j)
+    gradient[j] = D.dense[columns[j]];
+}
+
+
+void tape_hessian(const expression_tape &T, tape_derivatives &D, const double *work,
+  double sigma, const double *lambda, double *values)
+{
+  std::fill(values, values + D.hessian_rows.size(), 0.0);
+
+  double *adjoint = D.adjoint.empty() ? 0 : &D.adjoint[0];
+  double *tangent = D.tangent.empty() ? 0 : &D.tangent[0];
+  double *adjoint_tangent = D.adjoint_tangent.empty() ? 0 : &D.adjoint_tangent[0];
+
+  int current_output = -1;
+  double weight = 0.0;
+  for (unsigned c = 0; c != D.hessian_columns.size(); ++c)
+  {
+    const tape_derivatives::hessian_column &column = D.hessian_columns[c];
+    const std::vector<int> &segment = D.segments[column.output];
+    const std::vector<int> &sweep = column.sweep;
+
+    // The first order adjoints don't depend on the direction, so we only
+    // need them once for each output
+    if (column.output != current_output)
+    {
+      current_output = column.output;
+      weight = current_output == 0 ? sigma : lambda[current_output - 1];
+      if (weight != 0.0)
+      {
+        seed_adjoints(D, segment, T.outputs[current_output], weight);
+        reverse_sweep(T, segment, work, adjoint);
+      }
+    }
+    if (weight == 0.0) continue;
+
+    // Forward: the derivative of each instruction in the direction.  The
+    // sweep holds everything its instructions use, and nothing outside it
+    // adds to their second order adjoints, so it's all we need to visit.
+    for (unsigned s = 0; s != sweep.size(); ++s)
+    {
+      int i = sweep[s];
+      const tape_instruction &I = T.code[i];
+      double t;
+      switch (I.op)
+      {
+      case TAPE_CONSTANT:
+      case TAPE_SIGMA:
+      case TAPE_LAMBDA:   t = 0.0; break;
+      case TAPE_VARIABLE: t = I.a == column.direction ? 1.0 : 0.0; break;
+      case TAPE_ADD:      t = tangent[I.a] + tangent[I.b]; break;
+      case TAPE_MULTIPLY: t = tangent[I.a] * work[I.b] + work[I.a] * tangent[I.b]; break;
+      case TAPE_POW:
+      {
+        double fa, fb, faa, fab, fbb;
+        pow_derivatives(work[I.a], work[I.b], work[i], fa, fb, faa, fab, fbb);
+        t = fa * tangent[I.a] + fb * tangent[I.b];
+        break;
+      }
+      default:
+      {
+        double d1, d2;
+        unary_derivatives(I, work[I.a], work[i], d1, d2);
+        t = d1 * tangent[I.a];
+        break;
+      }
+      }
+      tangent[i] = t;
+      adjoint_tangent[i] = 0.0;
+    }
+
+    // Reverse: the derivative of the adjoints in the direction
+    for (unsigned s = sweep.size(); s-- != 0; )
+    {
+      int i = sweep[s];
+      const tape_instruction &I = T.code[i];
+      double r_bar = adjoint[i], r_dot = adjoint_tangent[i];
+      if (r_bar == 0.0 && r_dot == 0.0) continue;
+      switch (I.op)
+      {
+      case TAPE_CONSTANT:
+      case TAPE_VARIABLE:
+      case TAPE_SIGMA:
+      case TAPE_LAMBDA:
+        break;
+      case TAPE_ADD:
+        adjoint_tangent[I.a] += r_dot;
+        adjoint_tangent[I.b] += r_dot;
+        break;
+      case TAPE_MULTIPLY:
+        adjoint_tangent[I.a] += r_dot * work[I.b] + r_bar * tangent[I.b];
+        adjoint_tangent[I.b] += r_dot * work[I.a] + r_bar * tangent[I.a];
+        break;
+      case TAPE_POW:
+      {
+        double fa, fb, faa, fab, fbb;
+        pow_derivatives(work[I.a], work[I.b], work[i], fa, fb, faa, fab, fbb);
+        adjoint_tangent[I.a] += r_dot * fa + r_bar * (faa * tangent[I.a] + fab * tangent[I.b]);
+        adjoint_tangent[I.b] += r_dot * fb + r_bar * (fab * tangent[I.a] + fbb * tangent[I.b]);
+        break;
+      }
+      default:
+      {
+        double d1, d2;
+        unary_derivatives(I, work[I.a], work[i], d1, d2);
+        adjoint_tangent[I.a] += r_dot * d1 + r_bar * d2 * tangent[I.a];
+        break;
+      }
+      }
+    }
+
+    for (unsigned r = 0; r != column.rows.size(); ++r)
+      D.dense[column.rows[r]] = 0.0;
+    for (unsigned s = 0; s != sweep.size(); ++s)
+    {
+      const tape_instruction &I = T.code[sweep[s]];
+      if (I.op == TAPE_VARIABLE)
+        D.dense[I.a] += adjoint_tangent[sweep[s]];
+    }
+    for (unsigned r = 0; r != column.rows.size(); ++r)
+      values[column.positions[r]] += D.dense[column.rows[r]];
+  }
+}
+
+
+/*============================================================================*/
@@ -0,0 +1,111 @@
+/*******************************************************************************
+
+rima_tape.h
+
+Copyright (c) 2009-2013 Incremental IP Limited
+see LICENSE for license information
+
+*******************************************************************************/
+
+#ifndef rima_tape_h
+#define rima_tape_h
+
+extern "C"
+{
+#include "lualib.h"
+}
+
+#include <vector>
+
+/*============================================================================*/
+
+// A list of expressions lowered (by rima.compiler's tape) to a straight-line
+// program.  Each instruction computes one value from constants, the inputs
+// (x, sigma and lambda) and the values of earlier instructions, so the whole
+// tape can be evaluated in one pass over a work array.
+struct tape_instruction
+{
+  int op;
+  int a, b;                             // earlier instructions, or an input index
+  double value;                         // a constant, scale or power
+};
+
+
+struct expression_tape
+{
+  unsigned size() const { return code.size(); }
+  unsigned output_count() const { return outputs.size(); }
+
+  std::vector<tape_instruction> code;
+  std::vector<int> outputs;
+};
+
+
+// Read a tape ({op=, a=, b=, value=, outputs=}) from the Lua table at index.
+const char *read_tape(lua_State *L, int index, int variable_count, int constraint_count, expression_tape &T);
+
+// Evaluate a tape, writing its outputs to result.  work must have room for
+// T.size() values.
+void evaluate_tape(const expression_tape &T, const double *x, double sigma, const double *lambda,
+  double *work, double *result);
+
+/*============================================================================*/
+
+// Reverse-mode derivatives of a tape whose outputs are f, g_1 ... g_m.
+// prepare_derivatives works out, once, which instructions and variables each
+// output depends on, and the structure of the lower triangle of the hessian
+// of the lagrangian.  Jacobian and hessian values come out in the order of
+// the structure arrays (which are 0-based).
+struct tape_derivatives
+{
+  // For one output and one direction (a column of the hessian), the rows it
+  // contributes to, where those entries go in the hessian values, and the
+  // instructions the sweeps in that direction have to visit: the nonlinear
+  // instructions that depend on the direction's variable, and everything they
+  // use, in order
+  struct hessian_column
+  {
+    int output, direction;
+    std::vector<int> rows, positions, sweep;
+  };
+
+  std::vector<std::vector<int> >
+    segments,                           // the instructions each output uses, in order
+    columns;                            // the variables each output depends on, in order
+  std::vector<int> degrees;             // of each output as a polynomial, or 3 if it's not
+                                        // at most quadratic
+  std::vector<int>
+    jacobian_rows,                      // for g, so rows start at 0 for g_1
+    jacobian_cols,
+    hessian_rows,
+    hessian_cols;
+  std::vector<hessian_column> hessian_columns;
+
+  // Scratch space for the sweeps
+  std::vector<double>
+    adjoint,
+    tangent,
+    adjoint_tangent,
+    dense;
+};
+
+
+// If hessian is false, the hessian structure is left empty (for when IPOPT
+// approximates the hessian itself)
+void prepare_derivatives(const expression_tape &T, int variable_count, tape_derivatives &D,
+  bool hessian = true);
+
+// The derivatives of an output with respect to the variables in
+// D.columns[output].  work must hold the values from evaluate_tape at x.
+void tape_gradient(const expression_tape &T, tape_derivatives &D, unsigned output,
+  const double *work, double *gradient);
+
+// The lower triangle of sigma * hess f + sum lambda_i * hess g_i, by a forward
+// tangent sweep and a reverse sweep for each direction an output needs.  The
+// sweeps only visit the direction's instructions, so a separable function
+// costs O(n) rather than O(n^2).
+void tape_hessian(const expression_tape &T, tape_derivatives &D, const double *work,
+  double sigma, const double *lambda, double *values);
+
+/*============================================================================*/
+#endif
@@ -0,0 +1,83 @@
+-- Copyright (c) 2009-2011 Incremental IP Limited
+-- see LICENSE for license information
+
+--[[
+Time loading a large generated MIP into the cbc core, through both
+set_objective/build_rows and load_problem.
+
+  lua bench/cbc_load.lua [rows] [columns] [non-zeroes per row]
+
+The problem is
+  minimise sum x[j] subject to sum a[i][j]*x[j] >= 0, x integer >= 0
+so the all-slack basis is optimal and the solve time is mostly load time.
+--]]
+
+local core = require("rima_cbc_core")
+
+local row_count = tonumber(arg[1]) or 500000
+local column_count = tonumber(arg[2]) or 100000
+local row_length = tonumber(arg[3]) or 5
+
+
+--------------------------------------------------------------------------------
+
+local function time(name, f)
+  local t0 = os.clock()
+  f()
+  io.stderr:write(("  %-32s %8.2f secs\n"):format(name, os.clock() - t0))
+end
+
+math.randomseed(1)
+
+local variables = {}
+for j = 1, column_count do
+  variables[j] = { cost = 1, type = { lower = 0, upper = math.huge, integer = true } }
+end
+
+local constraints = {}
+local P =
+{
+  sense = "minimise",
+  row_starts = { 0 }, columns = {}, values = {}, row_lower = {}, row_upper = {},
+  column_lower = {}, column_upper = {}, costs = {}, integer = {},
+}
+for j = 1, column_count do
+  P.column_lower[j], P.column_upper[j], P.costs[j], P.integer[j] = 0, math.huge, 1, true
+end
+
+local nz = 0
+for i = 1, row_count do
+  local elements, used = {}, {}
+  for k = 1, row_length do
+    local j = math.random(column_count)
+    if not used[j] then
+      used[j] = true
+      elements[#elements+1] = { index = j, coeff = math.random() - 0.25 }
+      nz = nz + 1
+      P.columns[nz], P.values[nz] = j, elements[#elements].coeff
+    end
+  end
+  constraints[i] = { lower = 0, upper = math.huge, elements = elements }
+  P.row_starts[i+1], P.row_lower[i], P.row_upper[i] = nz, 0, math.huge
+end
+
+io.stderr:write(("%d rows, %d columns, %d non-zeroes\n"):format(row_count, column_count, nz))
+
+
+--------------------------------------------------------------------------------
+
+io.stderr:write("set_objective and build_rows:\n")
+local m = core.new()
+time("set_objective", function() assert(m:set_objective(variables, "minimise")) end)
+time("build_rows", function() assert(m:build_rows(constraints)) end)
+time("solve (including loadProblem)", function() assert(m:solve()) end)
+m = nil
+collectgarbage()
+
+io.stderr:write("load_problem:\n")
+m = core.new()
+time("load_problem", function() assert(m:load_problem(P)) end)
+time("solve (including loadProblem)", function() assert(m:solve()) end)
+
+
+-- EOF -------------------------------------------------------------------------
@@ -0,0 +1,113 @@
+-- Copyright (c) 2009-2012 Incremental IP Limited
+-- see LICENSE for license information
+
+--[[
+Time the IPOPT callbacks (f, grad f, g, the jacobian and the hessian) on a
+generated nonlinear problem, without solving it.
+
+  lua bench/ipopt_eval.lua [variables] [constraints] [variables per constraint]
+    [repeats] [derivatives] [separable variables]
+
+derivatives is "symbolic" (the default) or "automatic".
+The problem is
+  minimise sum (x[j] - 1)^2
+  subject to sum a[i][k]*x[k]^2 + x[k1]*x[k2] <= 1 for each i
+where the k are chosen at random, so the density of the jacobian and hessian
+follows from the number of variables per constraint.
+After that, the same objective is timed on its own with separable variables
+(100000 by default, 0 to skip it) and a hundredth of the repeats, which shows
+whether the cost of the hessian grows faster than its number of nonzeros.
+--]]
+
+local ipopt = require("rima.solvers.ipopt")
+local interface = require("rima.interface")
+local core = require("rima_ipopt_core")
+
+local variable_count = tonumber(arg[1]) or 1000
+local constraint_count = tonumber(arg[2]) or 500
+local row_length = tonumber(arg[3]) or 5
+local repeats = tonumber(arg[4]) or 1000
+local derivatives = arg[5] or "symbolic"
+local separable_count = tonumber(arg[6]) or 100000
+
+
+--------------------------------------------------------------------------------
+
+math.randomseed(1)
+
+local X = interface.R"X"
+
+
+-- Add up terms[i..j] as a balanced tree, so that building a long sum doesn't
+-- take time quadratic in its length
+local function sum(terms, i, j)
+  if i > j then return 0 end
+  if i == j then return terms[i] end
+  local m = math.floor((i + j) / 2)
+  return sum(terms, i, m) + sum(terms, m + 1, j)
+end
+
+
+local function bench(variable_count, constraint_count, row_length, repeats)
+  local variables, names, terms = {}, {}, {}
+  for j = 1, variable_count do
+    variables[j] = { name = "X["..j.."]", ref = X[j], type = { lower = -10, upper = 10 } }
+    names["X["..j.."]"] = j
+    terms[j] = (X[j] - 1)^2
+  end
+  local objective = sum(terms, 1, variable_count)
+
+  local constraints, bounds = {}, {}
+  for i = 1, constraint_count do
+    local used, chosen = {}, {}
+    for k = 1, row_length do
+      local j = math.random(variable_count)
+      if not used[j] then
+        used[j] = true
+        chosen[#chosen+1] = j
+      end
+    end
+    local e = 0
+    for _, j in ipairs(chosen) do
+      e = e + (math.random() - 0.25) * X[j]^2
+    end
+    if #chosen > 1 then
+      e = e + X[chosen[1]] * X[chosen[2]]
+    end
+    constraints[i] = e
+    bounds[i] = { lower = -math.huge, upper = 1 }
+  end
+
+  local t0 = os.clock()
+  local M = assert(core.new(ipopt.build_problem
+  {
+    sense = "minimise",
+    objective = objective,
+    constraint_expressions = constraints,
+    constraint_info = bounds,
+    ordered_variables = variables,
+    variable_names = names,
+    solver_options = { derivatives = derivatives, hessian_approximation = "exact" },
+  }))
+  io.stderr:write(("%d variables, %d constraints, %s derivatives: built in %.2f secs\n"):
+    format(variable_count, constraint_count, derivatives, os.clock() - t0))
+
+  local results = assert(M:benchmark(repeats))
+
+  io.stderr:write(("  %-10s %10s %12s %14s\n"):format("callback", "nonzeros", "ns/call", "ns/nonzero"))
+  for _, name in ipairs{ "f", "grad_f", "g", "jacobian", "hessian" } do
+    local r = results[name]
+    if r then
+      io.stderr:write(("  %-10s %10d %12.0f %14.1f\n"):format(name, r.nonzeros, r.ns_per_call, r.ns_per_nonzero))
+    end
+  end
+end
+
+
+bench(variable_count, constraint_count, row_length, repeats)
+if separable_count > 0 then
+  bench(separable_count, 0, 0, math.max(1, math.floor(repeats / 100)))
+end
+
+
+-- EOF -------------------------------------------------------------------------
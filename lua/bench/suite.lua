@@ -0,0 +1,212 @@
+-- Copyright (c) 2009-2012 Incremental IP Limited
+-- see LICENSE for license information
+
+--[[
+Build and solve generated models of increasing size, timing each phase
+separately so that regressions in model generation can be told apart from
+solver time.
+
+  lua bench/suite.lua [scale] [output file] [models] [cache directory]
+
+Each model has about 20000*scale non-zeroes (scale 100 gives about two
+million).  models is a comma-separated list of assignment, transportation,
+lot_sizing and nlp, and defaults to all of them.  With a cache directory (which
+must exist), linear models are saved there and a second run with the same
+scale loads them from the cache rather than generating them again.
+
+The timings go to the output file (bench-results.csv by default) as CSV, one
+row for each phase of each model:
+  model,variables,constraints,nonzeros,phase,seconds
+The phases are those recorded by rima.mp.solve (find_constraints,
+characterise, linearise, prepare_variables, build_linear_problem or
+build_problem, load_problem, solve, get_solution and format_results, and
+read_cache and write_cache when a cache directory is given) and "define", the
+time taken to set up the model and its data.
+The models are solved on one thread, and the times are cpu seconds.
+If no solver is available for a model, only the model generation phases are
+recorded.
+--]]
+
+require("rima")
+
+local scale = tonumber(arg[1]) or 1
+local output = arg[2] or "bench-results.csv"
+local chosen = arg[3] ~= "" and arg[3] or nil
+local cache = arg[4]
+
+
+--------------------------------------------------------------------------------
+
+math.randomseed(1)
+
+local function random_matrix(rows, columns, low, high)
+  local m = {}
+  for i = 1, rows do
+    local r = {}
+    for j = 1, columns do
+      r[j] = low + math.random() * (high - low)
+    end
+    m[i] = r
+  end
+  return m
+end
+
+
+local function random_list(n, low, high)
+  return random_matrix(1, n, low, high)[1]
+end
+
+
+--------------------------------------------------------------------------------
+
+-- Each generator returns a model, its data, and the size of the problem it
+-- should produce
+local generators = {}
+local order = { "assignment", "transportation", "lot_sizing", "nlp" }
+
+
+-- Assign N workers to N jobs: 2N^2 non-zeroes
+function generators.assignment(scale)
+  local N = math.floor(math.sqrt(10000 * scale))
+  local i, I, j, J, x, cost = rima.R"i, I, j, J, x, cost"
+
+  local M = rima.mp.new()
+  M.sense = "minimise"
+  M.objective = rima.sum{i=I}{j=J}(cost[i][j] * x[i][j])
+  M.one_job[{i=I}] = rima.mp.C(rima.sum{j=J}(x[i][j]), "==", 1)
+  M.one_worker[{j=J}] = rima.mp.C(rima.sum{i=I}(x[i][j]), "==", 1)
+  M.x[{i=I}][{j=J}] = rima.positive()
+
+  local data = { I = rima.range(1, N), J = rima.range(1, N), cost = random_matrix(N, N, 1, 100) }
+  return M, data, N * N, 2 * N, 2 * N * N
+end
+
+
+-- Ship from S suppliers to D = 4S customers: 2SD non-zeroes
+function generators.transportation(scale)
+  local S = math.max(1, math.floor(math.sqrt(10000 * scale) / 2))
+  local D = 4 * S
+  local s, S_, d, D_, ship, cost, supply, demand =
+    rima.R"s, S, d, D, ship, cost, supply, demand"
+
+  local M = rima.mp.new()
+  M.sense = "minimise"
+  M.objective = rima.sum{s=S_}{d=D_}(cost[s][d] * ship[s][d])
+  M.supply_limit[{s=S_}] = rima.mp.C(rima.sum{d=D_}(ship[s][d]), "<=", supply[s])
+  M.meet_demand[{d=D_}] = rima.mp.C(rima.sum{s=S_}(ship[s][d]), ">=", demand[d])
+  M.ship[{s=S_}][{d=D_}] = rima.positive()
+
+  local demands = random_list(D, 10, 100)
+  local total = 0
+  for _, v in ipairs(demands) do total = total + v end
+  local supplies = {}
+  for k = 1, S do supplies[k] = 1.5 * total / S end
+
+  local data =
+  {
+    S = rima.range(1, S), D = rima.range(1, D),
+    cost = random_matrix(S, D, 1, 100), supply = supplies, demand = demands,
+  }
+  return M, data, S * D, S + D, 2 * S * D
+end
+
+
+-- Multi-period lot sizing of P products over T periods with setup costs:
+-- about 7PT non-zeroes
+function generators.lot_sizing(scale)
+  local T = 24
+  local P = math.max(1, math.floor(20000 * scale / (7 * T)))
+  local p, P_, t, T_, make, stock, setup, demand, capacity, setup_cost, holding_cost =
+    rima.R"p, P, t, T, make, stock, setup, demand, capacity, setup_cost, holding_cost"
+
+  local M = rima.mp.new()
+  M.sense = "minimise"
+  M.objective = rima.sum{p=P_}{t=T_}(setup_cost[p] * setup[p][t] + holding_cost[p] * stock[p][t])
+  M.no_initial_stock[{p=P_}] = rima.mp.C(stock[p][0], "==", 0)
+  M.balance[{p=P_}][{t=T_}] = rima.mp.C(stock[p][t-1] + make[p][t] - stock[p][t], "==", demand[p][t])
+  M.capacity_limit[{t=T_}] = rima.mp.C(rima.sum{p=P_}(make[p][t]), "<=", capacity)
+  M.only_if_setup[{p=P_}][{t=T_}] = rima.mp.C(make[p][t], "<=", capacity * setup[p][t])
+  M.make[{p=P_}][{t=T_}] = rima.positive()
+  M.stock[{p=P_}][{t=T_}] = rima.positive()
+  M.stock[{p=P_}][0] = rima.positive()
+  M.setup[{p=P_}][{t=T_}] = rima.binary()
+
+  local data =
+  {
+    P = rima.range(1, P), T = rima.range(1, T),
+    demand = random_matrix(P, T, 0, 20),
+    capacity = 15 * P,
+    setup_cost = random_list(P, 50, 200),
+    holding_cost = random_list(P, 1, 5),
+  }
+  return M, data, 3 * P * T + P, P * T * 2 + P + T, P + 3 * P * T + P * T + 2 * P * T
+end
+
+
+-- A chain of nonlinear constraints on n variables: 3(n-2) non-zeroes
+function generators.nlp(scale)
+  local n = math.max(3, math.floor(20000 * scale / 3))
+  local i, I, C, x, a = rima.R"i, I, C, x, a"
+
+  local M = rima.mp.new()
+  M.sense = "minimise"
+  M.objective = rima.sum{i=I}((x[i] - a[i])^2)
+  M.chain[{i=C}] = rima.mp.C(x[i]^2 * x[i+1] + x[i+2], ">=", 1)
+  M.x[{i=I}] = rima.free(-10, 10)
+
+  local data = { I = rima.range(1, n), C = rima.range(1, n - 2), a = random_list(n, 0, 2) }
+  return M, data, n, n - 2, 3 * (n - 2)
+end
+
+
+--------------------------------------------------------------------------------
+
+local phases =
+{
+  "define", "find_constraints", "characterise", "linearise", "prepare_variables",
+  "build_linear_problem", "build_problem", "read_cache", "write_cache", "load_problem",
+  "solve", "get_solution", "format_results",
+}
+
+local models = {}
+if chosen then
+  for name in chosen:gmatch("[^,]+") do
+    if not generators[name] then
+      error(("unknown model '%s' (expected one of %s)"):format(name, table.concat(order, ", ")))
+    end
+    models[#models+1] = name
+  end
+else
+  models = order
+end
+
+local f = assert(io.open(output, "w"))
+f:write("model,variables,constraints,nonzeros,phase,seconds\n")
+
+for _, name in ipairs(models) do
+  local timings = {}
+  local t0 = os.clock()
+  local M, data, variables, constraints, nonzeros = generators[name](scale)
+  timings.define = os.clock() - t0
+
+  io.stderr:write(("%s: %d variables, %d constraints, %d non-zeroes\n"):
+    format(name, variables, constraints, nonzeros))
+  local primal, message = rima.mp.solve(M, data, rima.mp.options{ timings = timings, cache = cache })
+  if not primal then
+    io.stderr:write(("  not solved: %s\n"):format(tostring(message)))
+  end
+
+  for _, phase in ipairs(phases) do
+    if timings[phase] then
+      f:write(("%s,%d,%d,%d,%s,%.6f\n"):format(name, variables, constraints, nonzeros, phase, timings[phase]))
+      io.stderr:write(("  %-24s %10.3f secs\n"):format(phase, timings[phase]))
+    end
+  end
+  f:flush()
+end
+
+f:close()
+io.stderr:write(("Timings written to %s\n"):format(output))
+
+
+-- EOF -------------------------------------------------------------------------
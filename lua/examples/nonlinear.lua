@@ -29,5 +29,18 @@ else
   io.stderr:write(message, "\n")
 end
 
+-- The same again, with derivatives from the tape rather than symbolic ones.
+-- The two should agree.
+local automatic, message = rima.mp.solve(m, rima.mp.options{ derivatives = "automatic" })
+if automatic then
+  io.stderr:write(("Nonlinear solution with automatic derivatives:\n  objective: %g\n  variables %g %g %g %g\n"):format(
+    automatic.objective, automatic.X[1], automatic.X[2], automatic.X[3], automatic.X[4]))
+  if primal and math.abs(primal.objective - automatic.objective) > 1e-6 then
+    io.stderr:write("  The symbolic and automatic derivatives give different solutions\n")
+  end
+else
+  io.stderr:write(message, "\n")
+end
+
 
 -- EOF -------------------------------------------------------------------------
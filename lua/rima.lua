@@ -83,6 +83,11 @@ rima.mp =
   new = mp.new,
   solve = mp.solve,
   solve_with = mp.solve_with,
+  solve_file = mp.solve_file,
+  build = mp.build,
+  build_with = mp.build_with,
+  read_with = mp.read_with,
+  options = mp.options,
 }
 
 
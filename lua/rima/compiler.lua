@@ -1,6 +1,7 @@
 -- Copyright (c) 2009-2013 Incremental IP Limited
 -- see LICENSE for license information
 
+local object = require("rima.lib.object")
 local lib = require("rima.lib")
 local core = require("rima.core")
 local scope = require("rima.scope")
@@ -36,7 +37,10 @@ local function stringify(e, S)
 end
 
 
-local function compile(expressions, variables, arg_names)
+-- If result_name is given, the function takes an extra argument, and writes
+-- the values of a list of expressions into it (it might be a buffer shared
+-- with a solver core) rather than returning a new table.
+local function compile(expressions, variables, arg_names, result_name)
   arg_names = arg_names or "args"
   local S = build_scope(variables)
 
@@ -46,12 +50,22 @@ local function compile(expressions, variables, arg_names)
     for i, e in ipairs(expressions) do
       strings[i] = stringify(e, S)
     end
-    function_string = "\n  {\n    "..table.concat(strings, ",\n    ").."\n  }"
+    if result_name then
+      for i, s in ipairs(strings) do
+        strings[i] = ("%s[%d] = %s"):format(result_name, i, s)
+      end
+      function_string = "return function("..arg_names..", "..result_name..")\n  "..
+        table.concat(strings, "\n  ").."\nend"
+    else
+      function_string = "\n  {\n    "..table.concat(strings, ",\n    ").."\n  }"
+    end
   else
     function_string = " "..stringify(expressions, S)
   end
   
-  function_string = "return function("..arg_names..")\n  return"..function_string.."\nend"
+  if not result_name then
+    function_string = "return function("..arg_names..")\n  return"..function_string.."\nend"
+  end
 
   local status, b = pcall(loadstring, function_string)
   if not status then
@@ -63,6 +77,134 @@ end
 
 ------------------------------------------------------------------------------
 
-return { compile = compile }
+-- Lower expressions to a "tape": a straight-line program that a solver core
+-- can run without calling back into Lua.  Each instruction computes one value
+-- from constants, inputs (the variables, sigma and lambda) and the values
+-- computed by earlier instructions (a and b are instruction numbers).
+-- Identical instructions are only computed once, so subexpressions shared
+-- between the expressions are shared on the tape.
+
+local math_functions =
+{
+  exp = true, log = true, log10 = true,
+  sin = true, asin = true, cos = true, acos = true, tan = true, atan = true,
+  sinh = true, cosh = true, tanh = true,
+  sqrt = true,
+}
+
+
+local function tape(expressions, variables)
+  local S = build_scope(variables)
+  local T = { op = {}, a = {}, b = {}, value = {}, outputs = {} }
+  local instructions, lowered = {}, {}
+
+  local function emit(op, a, b, value)
+    a, b, value = a or 0, b or 0, value or 0
+    local key = ("%s %d %d %.17g"):format(op, a, b, value)
+    local i = instructions[key]
+    if not i then
+      i = #T.op + 1
+      T.op[i], T.a[i], T.b[i], T.value[i] = op, a, b, value
+      instructions[key] = i
+    end
+    return i
+  end
+
+  local lower
+
+  local function lower_input(e)
+    local a = e.address
+    local name = not e.base and a:value(1)
+    if name == "args" and #a == 2 then
+      return emit("variable", a:value(2))
+    elseif name == "lambda" and #a == 2 then
+      return emit("lambda", a:value(2))
+    elseif name == "sigma" and #a == 1 then
+      return emit("sigma")
+    end
+    error(("can't put '%s' on a tape: it isn't a variable"):format(lib.repr(e)), 0)
+  end
+
+  local function lower_(e)
+    if type(e) == "number" then
+      return emit("constant", 0, 0, e)
+    end
+
+    local ti = object.typeinfo(e)
+    if ti.index then
+      return lower_input(e)
+
+    -- Constant terms and factors are collected and applied last, so that,
+    -- for example, 2*x*y and 3*x*y share x*y.
+    elseif ti.add then
+      local r, constant = nil, 0
+      for _, t in ipairs(e) do
+        local c, x = t[1], t[2]
+        if type(x) == "number" then
+          constant = constant + c * x
+        else
+          x = lower(x)
+          if c ~= 1 then x = emit("scale", x, 0, c) end
+          r = r and emit("add", r, x) or x
+        end
+      end
+      if not r then return emit("constant", 0, 0, constant) end
+      if constant ~= 0 then r = emit("add", r, emit("constant", 0, 0, constant)) end
+      return r
+
+    elseif ti.mul then
+      local r, coeff = nil, 1
+      for _, t in ipairs(e) do
+        local p, x = t[1], t[2]
+        if type(x) == "number" then
+          coeff = coeff * x ^ p
+        else
+          x = lower(x)
+          if p ~= 1 then x = emit("power", x, 0, p) end
+          r = r and emit("multiply", r, x) or x
+        end
+      end
+      if not r then return emit("constant", 0, 0, coeff) end
+      if coeff ~= 1 then r = emit("scale", r, 0, coeff) end
+      return r
+
+    elseif ti.pow then
+      if type(e[2]) == "number" then
+        return emit("power", lower(e[1]), 0, e[2])
+      end
+      return emit("pow", lower(e[1]), lower(e[2]))
+
+    elseif math_functions[object.typename(e)] then
+      return emit(object.typename(e), lower(e[1]))
+    end
+
+    error(("can't put '%s' on a tape"):format(lib.repr(e)), 0)
+  end
+
+  function lower(e)
+    if type(e) ~= "table" then return lower_(e) end
+    local i = lowered[e]
+    if not i then
+      i = lower_(e)
+      lowered[e] = i
+    end
+    return i
+  end
+
+  if not getmetatable(expressions) then
+    for i, e in ipairs(expressions) do
+      T.outputs[i] = lower(core.eval(e, S))
+    end
+  else
+    T.outputs[1] = lower(core.eval(expressions, S))
+  end
+
+  return T
+end
+
+
+------------------------------------------------------------------------------
+
+return { compile = compile, tape = tape }
 
 ------------------------------------------------------------------------------
@@ -157,9 +157,14 @@ function interface.diff(e, v)
 end
 
 
+function interface.list_variables(e, s)
+  return core.list_variables(U(e), U(s))
+end
+
+
 ------------------------------------------------------------------------------
 
-function interface.compile(expressions, variables, arg_names)
+local function unwrap_for_compile(expressions, variables)
   local v2 = {}
   for i, v in ipairs(variables) do
     v2[i] = {}
@@ -178,7 +183,19 @@ function interface.compile(expressions, variables, arg_names)
     end
   end
 
-  return compiler.compile(e2, v2, arg_names)
+  return e2, v2
+end
+
+
+function interface.compile(expressions, variables, arg_names, result_name)
+  local e2, v2 = unwrap_for_compile(expressions, variables)
+  return compiler.compile(e2, v2, arg_names, result_name)
+end
+
+
+function interface.tape(expressions, variables)
+  local e2, v2 = unwrap_for_compile(expressions, variables)
+  return compiler.tape(e2, v2)
 end
 
 
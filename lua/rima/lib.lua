@@ -38,6 +38,31 @@ function lib.concat(t, s, f)
 end
 
 
+------------------------------------------------------------------------------
+
+-- Call f(...) and add the (cpu) time it took to timings[name].  With no
+-- timings table, just call f.
+local function add_time(clock, timings, name, t0, ...)
+  timings[name] = (timings[name] or 0) + clock() - t0
+  return ...
+end
+
+
+function lib.time(timings, name, f, ...)
+  if not timings then return f(...) end
+  return add_time(os.clock, timings, name, os.clock(), f(...))
+end
+
+
+-- As lib.time, but measured with clock rather than os.clock.  os.clock is
+-- the process's cpu time, which adds up the time of every thread, so phases
+-- that run on several threads are timed with a wall clock.
+function lib.time_with(clock, timings, name, f, ...)
+  if not timings then return f(...) end
+  return add_time(clock, timings, name, clock(), f(...))
+end
+
+
 ------------------------------------------------------------------------------
 
 -- Convert an object if it has a metamethod with the right name
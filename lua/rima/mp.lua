@@ -2,8 +2,8 @@
 -- see LICENSE for license information
 
 local io, math, os, table = require("io"), require("math"), require("os"), require("table")
-local assert, error, ipairs, getmetatable, pairs, pcall, require, setmetatable, type =
-      assert, error, ipairs, getmetatable, pairs, pcall, require, setmetatable, type
+local assert, error, ipairs, getmetatable, loadfile, pairs, pcall, rawget, require, select, setmetatable, tonumber, tostring, type, unpack =
+      assert, error, ipairs, getmetatable, loadfile, pairs, pcall, rawget, require, select, setmetatable, tonumber, tostring, type, unpack
 
 local object = require("rima.lib.object")
 local lib = require("rima.lib")
@@ -17,6 +17,8 @@ local linearise = require("rima.mp.linearise")
 local solvers = require("rima.solvers")
 local ops = require("rima.operations")
 
+local parallel_status, parallel_core = pcall(require, "rima_parallel_core")
+
 module(...)
 
 
@@ -132,8 +134,9 @@ local function report_search_time(cc, t0, last)
 end
 
 
-local function prepare_constraints(M)
-  local constraints = find_constraints(M, report_search_time)
+local function prepare_constraints(M, timings)
+  local constraints = lib.time(timings, "find_constraints", find_constraints, M, report_search_time)
+  local linearise_time = timings and timings.linearise or 0
 
   local constraint_expressions, constraint_info = {}, {}
   local linear = true
@@ -145,7 +148,8 @@ local function prepare_constraints(M)
         format(lib.repr(c.constraint)), 0)
     end
 
-    local lower, upper, exp, linear_exp = c.constraint:characterise(M)
+    local lower, upper, exp, linear_exp =
+      lib.time(timings, "characterise", c.constraint.characterise, c.constraint, M, timings)
     if not linear_exp then linear = false end
 
     c.lower = lower
@@ -161,6 +165,11 @@ local function prepare_constraints(M)
   end
   end
   io.stderr:write(("\rGenerated %d constraints in %.1f secs...\n"):format(#constraints, os.clock() - t0))
+
+  -- characterise linearises each constraint, but we count that separately
+  if timings and timings.characterise then
+    timings.characterise = timings.characterise - ((timings.linearise or 0) - linearise_time)
+  end
   return linear, constraint_expressions, constraint_info
 end
 
@@ -217,6 +226,32 @@ local function prepare_variables(M, objective, constraints)
 end
 
 
+local function name_variables(ordered_variables)
+  local names = {}
+  for i, v in ipairs(ordered_variables) do
+    names[v.name] = i
+  end
+  return names
+end
+
+
+-- Turn a table of starting values, indexed by variable (x[1]) or variable name
+-- ("x[1]"), into a table indexed by column.  It needn't give every variable a
+-- value.
+local function start_columns(start, variable_names)
+  local columns = {}
+  for k, v in pairs(start) do
+    local name = type(k) == "string" and k or lib.repr(k)
+    local i = variable_names[name]
+    if not i then
+      error(("error while setting the start: there's no variable called '%s' in the model"):format(name), 0)
+    end
+    columns[i] = v
+  end
+  return columns
+end
+
+
 local function choose_solver(objective_is_linear, constraints_are_linear, has_integer_variables)
   local objective_type = objective_is_linear and "linear" or "nonlinear"
   local constraint_type = constraints_are_linear and "linear" or "nonlinear"
@@ -239,10 +274,67 @@ local function choose_solver(objective_is_linear, constraints_are_linear, has_in
 end
 
 
+-- The linear solvers return a solution object that holds their arrays of
+-- values.  Rather than copying every value into primal and dual, we fill
+-- in the top-level names straight away, so that pairs(primal) and pairs(dual)
+-- see them all, but a name with indexes (x[i]) gets an empty table that's
+-- only filled the first time something in it is looked up.
+local function lazy_results(solution, variables, constraints, primal, dual)
+  local groups, scalar = {}, {}
+  local function add(list, method)
+    for i, v in ipairs(list) do
+      local a = v.ref.address
+      local name = a:value(1)
+      local g = groups[name]
+      if not g then g = {}; groups[name] = g end
+      g[#g+1] = { method, i, v.ref }
+      if #a == 1 then scalar[name] = true end
+    end
+  end
+  add(variables, solution.column)
+  add(constraints, solution.row)
+
+  local function fill(name)
+    setmetatable(primal[name], nil)
+    setmetatable(dual[name], nil)
+    for _, e in ipairs(groups[name]) do
+      local p, d = e[1](solution, e[2])
+      index.set(e[3], primal, p)
+      index.set(e[3], dual, d)
+    end
+  end
+
+  for name, g in pairs(groups) do
+    if scalar[name] then
+      for _, e in ipairs(g) do
+        primal[name], dual[name] = e[1](solution, e[2])
+      end
+    else
+      local mt = { __index = function(t, k) fill(name) return rawget(t, k) end }
+      primal[name] = setmetatable({}, mt)
+      dual[name] = setmetatable({}, mt)
+    end
+  end
+end
+
+
 local function format_results(r, variables, constraints)
-  local primal, dual = {}, {}
+  local primal, dual, info = {}, {}, {}
   local has_dual = true
   primal.objective = r.objective
+
+  -- Anything else the solver told us (the algorithm it used, status...)
+  for k, v in pairs(r) do
+    if k ~= "variables" and k ~= "constraints" and k ~= "solution" then
+      info[k] = v
+    end
+  end
+
+  if r.solution then
+    lazy_results(r.solution, variables, constraints, primal, dual)
+    return primal, dual, info
+  end
+
   for i, v in ipairs(r.variables) do
     local ref = variables[i].ref
     if type(v) == "table" then
@@ -263,7 +355,7 @@ local function format_results(r, variables, constraints)
       has_dual = false
     end
   end
-  return primal, has_dual and dual or nil
+  return primal, has_dual and dual or nil, info
 end
 
 
@@ -338,17 +430,191 @@ end
 proxy_mt.__tostring = lib.__tostring
 
 
+-- Solver options --------------------------------------------------------------
+
+-- Options for the solver (algorithm, limits...) are passed to solve along with
+-- the model's data, wrapped in rima.mp.options so we can tell them apart.
+local solver_options = object:new_class({}, "solver_options")
+
+
+function options(o)
+  return object.new(solver_options, o or {})
+end
+
+
+local function split_options(...)
+  local o, data = nil, {}
+  for i = 1, select("#", ...) do
+    local a = select(i, ...)
+    if object.typeinfo(a).solver_options then
+      o = a
+    else
+      data[#data+1] = a
+    end
+  end
+  return o, data
+end
+
+
+-- Model cache -----------------------------------------------------------------
+
+-- With mp.options{ cache = directory }, solve saves each linear problem it
+-- builds to a binary file in directory, named by a hash of the model and the
+-- data it was solved with.  When the same model is solved with the same data
+-- again, the file is mapped straight into the solver, skipping
+-- find_constraints, characterise, prepare_variables and build_linear_problem.
+-- The hash covers the model as it prints (with numbers in full) and the data
+-- passed to solve, so a change to either makes a new file.  The directory
+-- must exist.
+
+local cache_version = "rima model cache 1"
+local full_numbers = { numbers = "%.17g" }
+
+
+-- Write v (data passed to solve) to a string that only depends on its
+-- contents: table entries are sorted, and numbers are written in full
+local function serialise(v, seen)
+  local t = type(v)
+  if t == "number" then
+    return ("%.17g"):format(v)
+  elseif t == "string" then
+    return ("%q"):format(v)
+  elseif t == "table" and not getmetatable(v) then
+    if seen[v] then return "<cycle>" end
+    seen[v] = true
+    local entries = {}
+    for k, e in pairs(v) do
+      entries[#entries+1] = serialise(k, seen).."="..serialise(e, seen)
+    end
+    seen[v] = nil
+    table.sort(entries)
+    return "{"..table.concat(entries, ",").."}"
+  elseif t == "boolean" or t == "nil" then
+    return tostring(v)
+  else
+    -- Rima objects (ranges, types, expressions...) are written as they
+    -- print.  Anything else (a function, say) is written with its address,
+    -- so the cache is never used for it.
+    local f = lib.getmetamethod(v, "__repr")
+    return object.typename(v)..":"..(f and lib.repr(v, full_numbers) or tostring(v))
+  end
+end
+
+
+-- The cache file for a model and its data, and the functions for reading and
+-- writing it (which any of the solvers that use caches can provide)
+local function cache_file(directory, M, data)
+  local tools
+  for _, s in pairs(solvers) do
+    if s.available and s.cache then tools = s.cache break end
+  end
+  if not tools then return end
+
+  local s = { cache_version, lib.repr(M, full_numbers) }
+  for _, d in ipairs(data) do
+    s[#s+1] = serialise(d, {})
+  end
+  return ("%s/%s.rimacache"):format(directory, tools.key(table.concat(s, "\n"))), tools
+end
+
+
+-- Turn a name like "x[1, 2].a" back into a reference, so that results from a
+-- cached model are laid out as they would be from the model itself
+local function name_ref(name)
+  local address = {}
+  local head, rest = name:match("^([%a_][%w_]*)(.*)$")
+  if not head then return index:new(nil, name) end
+  address[1] = head
+  while rest ~= "" do
+    local field, after = rest:match("^%.([%a_][%w_]*)(.*)$")
+    if field then
+      address[#address+1] = field
+    else
+      local subscripts
+      subscripts, after = rest:match("^%[([^%]]*)%](.*)$")
+      if not subscripts then return index:new(nil, name) end
+      for s in (subscripts..","):gmatch("%s*([^,]-)%s*,") do
+        address[#address+1] = tonumber(s) or s
+      end
+    end
+    rest = after
+  end
+  return index:new(nil, unpack(address))
+end
+
+
+local function named_list(names)
+  local l = {}
+  for i, n in ipairs(names) do
+    l[i] = { name = n, ref = name_ref(n) }
+  end
+  return l
+end
+
+
+-- Solve a model from its cache file.  Returns false if there's no file or no
+-- solver that can load it, so that the model's built as usual.
+local function solve_cached(filename, tools, solver_options)
+  local info = tools.info(filename)
+  if not info then return false end
+  local solver, solver_name = choose_solver(true, true, info.integer)
+  if not solver or not solver.cache then return false end
+
+  local timings = solver_options.timings
+  local m, names = lib.time(timings, "read_cache", solver.cache.read, filename)
+  if not m then return false end
+
+  io.stderr:write(("Solving cached model with %s...\n"):format(solver_name))
+
+  local r, message = lib.time(timings, "solve", m.solve, m, solver_options)
+  if not r then return true, nil, message end
+  r, message = lib.time(timings, "get_solution", m.get_solution, m)
+  if not r then return true, nil, message end
+
+  local primal, dual, info = lib.time(timings, "format_results", format_results, r,
+    named_list(names.columns), named_list(names.rows))
+  info.cache = filename
+  return true, primal, dual, info
+end
+
+
+-- Save the linear problem a solver built, with the variables' and
+-- constraints' names.  A cache that can't be written isn't an error: the
+-- model is just built again next time.
+local function write_cache(filename, tools, options)
+  local columns, rows = {}, {}
+  for i, v in ipairs(options.ordered_variables) do
+    columns[i] = lib.repr(v.ref, full_numbers)
+  end
+  for i, c in ipairs(options.constraint_info) do
+    rows[i] = lib.repr(c.ref, full_numbers)
+  end
+  local ok, message = tools.write(filename, options.linear_problem, { columns = columns, rows = rows })
+  if not ok then
+    io.stderr:write(("Couldn't write the model cache %s: %s\n"):format(filename, message))
+  end
+  return ok
+end
+
+
 -- Solving ---------------------------------------------------------------------
 
-function solve(M, ...)
-  M = new(M, ...)
+local function prepare(M, ...)
+  local solver_options, data = split_options(...)
+  M = new(M, unpack(data))
+
+  -- If the options have a timings table, we add the time spent in each phase
+  -- of building and solving the model to it
+  local timings = solver_options and solver_options.timings
 
   local objective = core.eval(index:new(nil, "objective"), M)
-  local objective_is_linear, objective_constant, linear_objective = pcall(linearise.linearise, objective, M)
+  local objective_is_linear, objective_constant, linear_objective =
+    lib.time(timings, "linearise", pcall, linearise.linearise, objective, M)
 
-  local constraints_are_linear, constraint_expressions, constraint_info = prepare_constraints(M)
+  local constraints_are_linear, constraint_expressions, constraint_info = prepare_constraints(M, timings)
 
-  local has_integer_variables, variable_map, ordered_variables = prepare_variables(M, objective, constraint_expressions)
+  local has_integer_variables, variable_map, ordered_variables =
+    lib.time(timings, "prepare_variables", prepare_variables, M, objective, constraint_expressions)
 
   local solver, solver_name = choose_solver(objective_is_linear, constraints_are_linear, has_integer_variables)
 
@@ -356,38 +622,326 @@ function solve(M, ...)
     return nil, "No available solver can handle this type of problem"
   end
 
-  io.stderr:write(("Solving with %s...\n"):format(solver_name))
+  local variable_names = name_variables(ordered_variables)
 
-  local r, message = solver.solve{
+  return solver, solver_name,
+  {
     sense = sense(M),
     objective = objective,
     linear_objective = linear_objective,
     constraint_expressions = constraint_expressions,
     constraint_info = constraint_info,
     variable_map = variable_map,
-    ordered_variables = ordered_variables
+    ordered_variables = ordered_variables,
+    variable_names = variable_names,
+    solver_options = solver_options,
+    timings = timings,
+    start = solver_options and solver_options.start and start_columns(solver_options.start, variable_names)
   }
+end
+
+
+function solve(M, ...)
+  local solver_options, data = split_options(...)
+  local cache, cache_tools
+  if solver_options and solver_options.cache then
+    cache, cache_tools = cache_file(solver_options.cache, M, data)
+    if cache then
+      local found, primal, dual, info = solve_cached(cache, cache_tools, solver_options)
+      if found then return primal, dual, info end
+    end
+  end
+
+  local solver, solver_name, options = prepare(M, ...)
+  if not solver then return nil, solver_name end
+
+  io.stderr:write(("Solving with %s...\n"):format(solver_name))
+
+  local r, message = solver.solve(options)
+
+  if cache and options.linear_problem then
+    lib.time(options.timings, "write_cache", write_cache, cache, solver.cache or cache_tools, options)
+  end
 
   if not r then
     return nil, message
   end
 
-  return format_results(r, ordered_variables, constraint_info)
+  local primal, dual, info =
+    lib.time(options.timings, "format_results", format_results, r, options.ordered_variables, options.constraint_info)
+  info.cache = cache
+  return primal, dual, info
 end
 
 
-function solve_with(solver, M, ...)
+local function with_solver(solver, f, M, ...)
   if not solvers[solver].available then
     error("The solver '"..solver.."' is not available: '"..solvers[solver].problem.."'")
   end
   local p0 = solvers[solver].preference
   solvers[solver].preference = -1
-  local r1, r2, r3 = solve(M, ...)
+  local r1, r2, r3 = f(M, ...)
   solvers[solver].preference = p0
   return r1, r2, r3
 end
 
 
+function solve_with(solver, M, ...)
+  return with_solver(solver, solve, M, ...)
+end
+
+
+-- Parallel generation ---------------------------------------------------------
+
+-- Worker pools, by number of threads, kept so that the workers only load
+-- Rima once
+local pools = {}
+local worker_script = 'return require("rima.mp.parallel").worker(...)'
+
+
+-- Generate a linear model's constraints with a pool of worker threads (see
+-- rima.mp.parallel), and solve it.  Returns false if the model can't be
+-- generated in parallel, so that it's solved as usual.
+local function solve_parallel(filename, M, threads, solver_options)
+  local timings = solver_options.timings
+
+  local objective = core.eval(index:new(nil, "objective"), M)
+  local objective_is_linear, _, linear_objective =
+    lib.time(timings, "linearise", pcall, linearise.linearise, objective, M)
+  if not objective_is_linear then return false end
+
+  local pool = pools[threads]
+  if not pool then
+    pool = assert(parallel_core.new(threads))
+    pools[threads] = pool
+  end
+
+  local P, message =
+    lib.time_with(parallel_core.wall_time, timings, "generate", pool.generate, pool, worker_script, filename)
+  if not P then
+    io.stderr:write(("Couldn't generate the constraints in parallel (%s), generating them serially\n"):
+      format(message))
+    return false
+  end
+
+  local columns, has_integer_variables = {}, false
+  for i, name in ipairs(P.column_names) do
+    columns[name] = i
+    if P.integer[i] then has_integer_variables = true end
+  end
+  for name in pairs(linear_objective) do
+    if not columns[name] then
+      error(("The variable '%s' is not involved in any constraint, but is in the objective\n"):format(name))
+    end
+  end
+  local costs = {}
+  for i, name in ipairs(P.column_names) do
+    local o = linear_objective[name]
+    costs[i] = (o and o.coeff) or 0
+  end
+  P.costs = costs
+  P.sense = sense(M)
+
+  local solver, solver_name = choose_solver(true, true, has_integer_variables)
+  if not solver then
+    return nil, "No available solver can handle this type of problem"
+  end
+
+  io.stderr:write(("Solving with %s...\n"):format(solver_name))
+
+  local variables, constraints = named_list(P.column_names), named_list(P.row_names)
+  local r, message = solver.solve
+  {
+    linear_problem = P,
+    ordered_variables = variables,
+    solver_options = solver_options,
+    timings = timings,
+  }
+  if not r then return nil, message end
+
+  return lib.time(timings, "format_results", format_results, r, variables, constraints)
+end
+
+
+-- Solve the model defined by a Lua file, which returns the model and
+-- (optionally) data for it, as would be passed to new.  With
+-- mp.options{ threads = n }, n worker Lua states, each on its own thread,
+-- load the file and generate the constraints between them.  If the model
+-- isn't linear, or rima_parallel_core isn't available, the model is solved
+-- as with solve.
+function solve_file(filename, o)
+  local M = new(assert(loadfile(filename))())
+  local threads = o and o.threads
+  if threads and threads > 1 and parallel_status then
+    local primal, dual, info = solve_parallel(filename, M, threads, o)
+    if primal ~= false then return primal, dual, info end
+  end
+  return solve(M, o)
+end
+
+
+-- Persistent models -----------------------------------------------------------
+
+-- A model that's been handed to a solver and kept there, so that it can be
+-- changed and re-solved without rebuilding it.  Variables and constraints are
+-- referred to by reference (x[1]) or by name ("x[1]").
+
+local instance = object:new_class({}, "instance")
+
+
+local function find(self, what, name)
+  name = type(name) == "string" and name or lib.repr(name)
+  local i = self.names[what][name]
+  if not i then
+    error(("There's no %s called '%s' in the model"):format(what, name), 3)
+  end
+  return i
+end
+
+
+function instance:solve(o)
+  local r, message = self.core:solve(o)
+  if not r then return nil, message end
+  r, message = self.core:get_solution()
+  if not r then return nil, message end
+  local primal, dual, info = format_results(r, self.variables, self.constraints)
+  info.sense = self.sense
+  return primal, dual, info
+end
+
+
+function instance:set_bounds(variable, lower, upper)
+  return assert(self.core:set_column_bounds(find(self, "variable", variable), lower, upper))
+end
+
+
+function instance:set_cost(variable, cost)
+  return assert(self.core:set_cost(find(self, "variable", variable), cost))
+end
+
+
+function instance:set_constraint_bounds(constraint, lower, upper)
+  return assert(self.core:set_row_bounds(find(self, "constraint", constraint), lower, upper))
+end
+
+
+function instance:set_coefficient(constraint, variable, value)
+  return assert(self.core:set_coefficient(find(self, "constraint", constraint),
+    find(self, "variable", variable), value))
+end
+
+
+function instance:set_start(start)
+  if not self.core.set_start then
+    error("This solver can't use a starting solution", 2)
+  end
+  return assert(self.core:set_start(start_columns(start, self.names.variable)))
+end
+
+
+-- Write the model to a file in MPS or LP format with the solver's own writer.
+-- options (format = "mps" or "lp", compression = "none", "gzip" or "bzip2")
+-- go to the solver.  With names = true, the variables' and constraints' names
+-- are written too (without spaces, which the formats don't allow).
+function instance:write(filename, options)
+  if not self.core.write then
+    error("This solver can't write models", 2)
+  end
+
+  local o = {}
+  for k, v in pairs(options or {}) do o[k] = v end
+  if o.names then
+    o.names = nil
+    local columns, rows = {}, {}
+    for i, v in ipairs(self.variables) do
+      columns[i] = (v.name:gsub("%s", ""))
+    end
+    for i, c in ipairs(self.constraints) do
+      rows[i] = (lib.repr(c.ref):gsub("%s", ""))
+    end
+    o.column_names, o.row_names = columns, rows
+  end
+
+  return assert(self.core:write(filename, o))
+end
+
+
+function build(M, ...)
+  local solver, solver_name, options = prepare(M, ...)
+  if not solver then return nil, solver_name end
+  if not solver.build then
+    return nil, ("The %s solver can't keep a model between solves"):format(solver_name)
+  end
+
+  io.stderr:write(("Building with %s...\n"):format(solver_name))
+
+  local m, message = solver.build(options)
+  if not m then return nil, message end
+
+  local constraint_names = {}
+  for i, c in ipairs(options.constraint_info) do
+    constraint_names[lib.repr(c.ref)] = i
+  end
+
+  return object.new(instance,
+    {
+      core = m,
+      variables = options.ordered_variables,
+      constraints = options.constraint_info,
+      names = { variable = options.variable_names, constraint = constraint_names },
+    })
+end
+
+
+function build_with(solver, M, ...)
+  return with_solver(solver, build, M, ...)
+end
+
+
+-- Load a model from an MPS file straight into a solver, without building it
+-- in Rima, so that archived models can be solved again.  The result is a
+-- persistent model like build's, but its variables and constraints are only
+-- known by their names in the file, so results are indexed by name
+-- (primal["x[1]"]).
+-- The optimisation direction is whatever the file says, and the results'
+-- info.sense reports it.  lp_solve writes and reads the direction, but COIN's
+-- writers can't, so a maximisation written by CLP or CBC comes back as a
+-- minimisation of the negated objective (and with negated duals).
+function read_with(solver_name, filename)
+  local solver = solvers[solver_name]
+  if not solver or not solver.available then
+    error(("The solver '%s' is not available"):format(solver_name), 2)
+  end
+  if not solver.read then
+    return nil, ("The %s solver can't read models"):format(solver_name)
+  end
+
+  local m, message = solver.read(filename)
+  if not m then return nil, message end
+  local names = assert(m:get_names())
+
+  local function list(names)
+    local l, map = {}, {}
+    for i, n in ipairs(names) do
+      l[i] = { name = n, ref = index:new(nil, n) }
+      map[n] = i
+    end
+    return l, map
+  end
+  local variables, variable_names = list(names.columns)
+  local constraints, constraint_names = list(names.rows)
+
+  return object.new(instance,
+    {
+      core = m,
+      variables = variables,
+      constraints = constraints,
+      names = { variable = variable_names, constraint = constraint_names },
+      sense = m:get_sense(),
+    })
+end
+
+
 -- creating constraints --------------------------------------------------------
 
 function C(lhs, rel, rhs) -- create a constraint
@@ -36,7 +36,7 @@ function constraint:__eval(S, args)
 end
 
 
-function constraint:characterise(S)
+function constraint:characterise(S, timings)
   local e = core.eval(ops.add(0, self.lhs, ops.unm(self.rhs)), S)
   local rhs = 0
   if object.typeinfo(e).add then
@@ -47,7 +47,7 @@ function constraint:characterise(S)
   local lower = ((comp == "==" or comp == ">=") and rhs) or -math.huge
   local upper = ((comp == "==" or comp == "<=") and rhs) or math.huge
 
-  local status, constant, linear_lhs = pcall(linearise.linearise, e, S)
+  local status, constant, linear_lhs = lib.time(timings, "linearise", pcall, linearise.linearise, e, S)
   assert(not status or constant==0)
   
   return lower, upper, e, linear_lhs
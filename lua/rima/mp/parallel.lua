@@ -0,0 +1,69 @@
+-- Copyright (c) 2009-2012 Incremental IP Limited
+-- see LICENSE for license information
+
+local assert, error, ipairs, loadfile, pairs = assert, error, ipairs, loadfile, pairs
+
+-- Set by rima_parallel_core in each worker state
+local emit_constraints, emit_row, emit_variable = emit_constraints, emit_row, emit_variable
+
+local lib = require("rima.lib")
+local object = require("rima.lib.object")
+local core = require("rima.core")
+local mp = require("rima.mp")
+
+module(...)
+
+
+--------------------------------------------------------------------------------
+
+-- Generate worker number's share (of count) of the rows of the model in
+-- filename, and hand them to rima_parallel_core.  Every worker finds all the
+-- constraints, and characterises and linearises every count'th one.
+-- find_constraints walks scopes with pairs, so the workers might not find the
+-- constraints in the same order: each worker reports the names of all the
+-- constraints it found so that rima_parallel_core can check that they agree.
+function worker(number, count, filename)
+  local M = mp.new(assert(loadfile(filename))())
+  local constraints = mp.find_constraints(M)
+
+  local names = {}
+  for i, c in ipairs(constraints) do
+    names[i] = lib.repr(c.ref)
+  end
+  emit_constraints(names)
+
+  local ids, variable_count = {}, 0
+  for i = number, #constraints, count do
+    local c = constraints[i]
+    if c.undefined and c.undefined[1] then
+      error(("error while preparing the constraint '%s': Some of the constraint's indices are undefined"):
+        format(lib.repr(c.constraint)), 0)
+    end
+
+    local lower, upper, _, linear_exp = c.constraint:characterise(M)
+    if not linear_exp then
+      error(("the constraint '%s' is not linear"):format(lib.repr(c.ref)), 0)
+    end
+
+    local variables, coefficients, n = {}, {}, 0
+    for name, e in pairs(linear_exp) do
+      local id = ids[name]
+      if not id then
+        local _, t = core.eval(e.ref, M)
+        if not object.typeinfo(t).number_t then
+          error(("expecting a number type for '%s', got '%s'"):format(name, lib.repr(t)), 0)
+        end
+        variable_count = variable_count + 1
+        id = variable_count
+        ids[name] = id
+        emit_variable(name, t.lower, t.upper, t.integer)
+      end
+      n = n + 1
+      variables[n], coefficients[n] = id, e.coeff
+    end
+    emit_row(i, names[i], lower, upper, variables, coefficients)
+  end
+end
+
+
+-- EOF -------------------------------------------------------------------------
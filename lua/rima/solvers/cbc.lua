@@ -3,6 +3,7 @@
 
 local assert, ipairs, pcall = assert, ipairs, pcall
 
+local lib = require("rima.lib")
 local linear = require("rima.solvers.linear")
 
 local status, core = pcall(require, "rima_cbc_core")
@@ -23,16 +24,36 @@ preference = 1
 
 --------------------------------------------------------------------------------
 
-local function solve_(options)
-  linear.build_linear_problem(options)
+local function build_(options)
+  local timings = options.timings
+  local P = lib.time(timings, "build_linear_problem", linear.build_linear_problem, options)
   local m = core.new()
-  assert(m:set_objective(options.ordered_variables, options.sense))
-  assert(m:build_rows(options.constraint_info))
-  assert(m:solve())
-  return assert(m:get_solution())
+  assert(lib.time(timings, "load_problem", m.load_problem, m, P))
+  if options.start then
+    assert(m:set_start(options.start))
+  end
+  return m
+end
+
+
+local function solve_(options)
+  local m = build_(options)
+  local o = options.solver_options
+  if o and o.threads and o.threads > 1 then
+    assert(lib.time_with(core.wall_time, options.timings, "solve", m.solve, m, o))
+  else
+    assert(lib.time(options.timings, "solve", m.solve, m, o))
+  end
+  -- get_solution returns the incumbent from a solve that stopped on a limit,
+  -- and nil and a message if there's no solution
+  return lib.time(options.timings, "get_solution", m.get_solution, m)
 end
 
+build = (status and build_) or nil
 solve = (status and solve_) or nil
+read = (status and core.read_mps) or nil
+cache = (status and
+  { key = core.cache_key, info = core.cache_info, read = core.read_cache, write = core.write_cache }) or nil
 
 
 -- EOF -------------------------------------------------------------------------
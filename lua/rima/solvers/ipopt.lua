@@ -2,8 +2,10 @@
 -- see LICENSE for license information
 
 local math = require("math")
-local assert, getmetatable, ipairs, pcall = assert, getmetatable, ipairs, pcall
+local table = require("table")
+local assert, error, ipairs, pairs, pcall, type = assert, error, ipairs, pairs, pcall, type
 
+local lib = require("rima.lib")
 local interface = require("rima.interface")
 local ops = require("rima.operations")
 
@@ -25,71 +27,154 @@ preference = 3
 
 --------------------------------------------------------------------------------
 
-local function compile_jacobian(expressions, variables)
-  local sparsity = {}
-  local e2 = {}
+-- The columns of the variables an expression depends on, in order
+local function dependencies(e, columns)
+  local d = {}
+  for name in pairs(interface.list_variables(e)) do
+    d[#d+1] = columns[name]
+  end
+  table.sort(d)
+  return d
+end
 
-  local function add_expression(e, i)
-    for j, v in ipairs(variables) do
-      local dedv = interface.diff(e, v.ref)
-      if dedv ~= 0 then
-        sparsity[#sparsity+1] = {i, j}
-        e2[#e2+1] = dedv
-      end
+
+-- The first derivatives of e with respect to the variables it depends on,
+-- as a list of {column, derivative} pairs
+local function derivatives(e, variables, columns)
+  local d = {}
+  for _, j in ipairs(dependencies(e, columns)) do
+    local dedv = interface.diff(e, variables[j].ref)
+    if dedv ~= 0 then
+      d[#d+1] = { j, dedv }
     end
   end
+  return d
+end
+
 
-  if getmetatable(expressions) then
-    add_expression(expressions, 1)
-  else
-    for i, e in ipairs(expressions) do
-      add_expression(e, i)
+local function gradient(d, variables)
+  local g = {}
+  for j = 1, #variables do
+    g[j] = 0
+  end
+  for _, p in ipairs(d) do
+    g[p[1]] = p[2]
+  end
+  return g
+end
+
+
+local function jacobian(constraint_derivatives)
+  local rows, cols = {}, {}
+  local e2 = {}
+
+  for i, d in ipairs(constraint_derivatives) do
+    for _, p in ipairs(d) do
+      local n = #e2+1
+      rows[n], cols[n] = i, p[1]
+      e2[n] = p[2]
     end
   end
 
-  local f, function_string = interface.compile(e2, variables)
-  return f, function_string, sparsity
+  return e2, rows, cols
 end
 
 
-local function compile_hessian(objective, constraints, variables)
+-- Only the lower triangle of the hessian goes to IPOPT, and we only
+-- differentiate each first derivative by the variables it depends on, so we
+-- don't try all n^2 pairs for every constraint.
+-- Second derivatives that are numbers (from quadratic terms) don't need
+-- evaluating at each x: they're returned as terms, each a multiple of sigma
+-- (multiplier 1) or of lambda[k] (multiplier k+1), to add to an entry.  Only
+-- the entries in "varying" have expressions.
+local function hessian(objective_derivatives, constraint_derivatives, variables, columns)
   local sigma, lambda = interface.R"sigma, lambda"
 
-  local sparsity = {}
-  local e2 = {}
-
-  for i, v1 in ipairs(variables) do
-    for j, v2 in ipairs(variables) do
-      local exp, nonzero = 0, false
-      local do2dv1dv2 = interface.diff(interface.diff(objective, v1.ref), v2.ref)
-      if do2dv1dv2 ~= 0 then
-        exp = sigma * do2dv1dv2
-        nonzero = true
-      end
-
-      for k, c in ipairs(constraints) do
-        local dc2dv1dv2 = interface.diff(interface.diff(c, v1.ref), v2.ref)
-        if dc2dv1dv2 ~= 0 then
-          exp = exp + lambda[k] * dc2dv1dv2
-          nonzero = true
+  local entries, constants, keys = {}, {}, {}
+  local function add(d, multiplier, weight)
+    for _, p in ipairs(d) do
+      local i, dedvi = p[1], p[2]
+      for _, j in ipairs(dependencies(dedvi, columns)) do
+        if j > i then break end
+        local d2 = interface.diff(dedvi, variables[j].ref)
+        if d2 ~= 0 then
+          local key = (i-1) * #variables + j
+          if not entries[key] and not constants[key] then
+            keys[#keys+1] = key
+          end
+          if type(d2) == "number" then
+            local c = constants[key] or {}
+            c[#c+1] = { multiplier, d2 }
+            constants[key] = c
+          else
+            local e = entries[key]
+            entries[key] = e and e + weight * d2 or weight * d2
+          end
         end
       end
-      if nonzero then
-        sparsity[#sparsity+1] = {i, j}
-        e2[#e2+1] = exp
-      end
     end
   end
 
-  local f, function_string = interface.compile(e2, variables, "args, sigma, lambda")
-  return f, function_string, sparsity
+  add(objective_derivatives, 1, sigma)
+  for k, d in ipairs(constraint_derivatives) do
+    add(d, k+1, lambda[k])
+  end
+
+  table.sort(keys)
+  local rows, cols = {}, {}
+  local e2, varying = {}, {}
+  local terms = { entries = {}, multipliers = {}, values = {} }
+  for n, key in ipairs(keys) do
+    rows[n] = math.floor((key-1) / #variables) + 1
+    cols[n] = (key-1) % #variables + 1
+    if entries[key] then
+      e2[#e2+1] = entries[key]
+      varying[#varying+1] = n
+    end
+    for _, c in ipairs(constants[key] or {}) do
+      local t = #terms.entries+1
+      terms.entries[t], terms.multipliers[t], terms.values[t] = n, c[1], c[2]
+    end
+  end
+
+  return e2, rows, cols, varying, terms
+end
+
+
+-- A cheap upper bound on the number of entries in the lower triangle of the
+-- hessian: each expression can couple, at most, all the variables its first
+-- derivatives depend on
+local function hessian_entry_estimate(objective_derivatives, constraint_derivatives, variable_count)
+  local estimate = 0
+  local function add(d)
+    local n = 0
+    for _, p in ipairs(d) do
+      if type(p[2]) ~= "number" then n = n + 1 end
+    end
+    estimate = estimate + n * (n + 1) / 2
+  end
+  add(objective_derivatives)
+  for _, d in ipairs(constraint_derivatives) do
+    add(d)
+  end
+  return math.min(estimate, variable_count * (variable_count + 1) / 2)
 end
 
 
 --------------------------------------------------------------------------------
 
-local function solve_(options)
-  for _, v in ipairs(options.ordered_variables) do
+-- Everything the core needs to know about the problem: bounds, the sparsity
+-- of the jacobian and hessian, and tapes or functions to evaluate them.
+-- With the "derivatives" solver option set to "automatic", we only pass a
+-- tape of f and g, and the core differentiates that itself.
+-- With "hessian_approximation" set to "limited-memory", IPOPT approximates
+-- the hessian and we never build it.  "automatic" (the default) does that
+-- for models with at least 100 variables when more than "hessian_density"
+-- of the hessian's lower triangle would be nonzero.
+function build_problem(options)
+  local variables = options.ordered_variables
+
+  for _, v in ipairs(variables) do
     if v.type.lower == -math.huge then
       if v.type.upper == math.huge then
         v.initial = 0
@@ -107,19 +192,129 @@ local function solve_(options)
 
   local F =
   {
-    variables = options.ordered_variables,
+    variables = variables,
     constraint_bounds = options.constraint_info,
-    objective_function = interface.compile(options.objective, options.ordered_variables),
-    constraint_function = interface.compile(options.constraint_expressions, options.ordered_variables)
   }
-  F.objective_jacobian, _, F.oj_sparsity = compile_jacobian(options.objective, options.ordered_variables)
-  F.constraint_jacobian, _, F.cj_sparsity = compile_jacobian(options.constraint_expressions, options.ordered_variables)
-  F.hessian, _, F.hessian_sparsity = compile_hessian(options.objective, options.constraint_expressions, options.ordered_variables)
 
-  local M = assert(ipopt_core.new(F))
-  return M:solve()
+  local solver_options = options.solver_options or {}
+  local mode = solver_options.derivatives or "symbolic"
+  if mode ~= "symbolic" and mode ~= "automatic" then
+    error(("bad option 'derivatives' ('symbolic' or 'automatic' expected, got '%s')"):format(mode))
+  end
+
+  local approximation = solver_options.hessian_approximation or "automatic"
+  if approximation ~= "exact" and approximation ~= "limited-memory" and approximation ~= "automatic" then
+    error(("bad option 'hessian_approximation' ('exact', 'limited-memory' or 'automatic' expected, got '%s')"):
+      format(approximation))
+  end
+  F.hessian_approximation = approximation
+  F.hessian_density = solver_options.hessian_density or 0.1
+
+  -- If the problem won't go on a tape, fall back to symbolic derivatives
+  if mode == "automatic" then
+    local expressions = { options.objective }
+    for i, c in ipairs(options.constraint_expressions) do
+      expressions[i+1] = c
+    end
+    local lowered, tape = pcall(interface.tape, expressions, variables)
+    if lowered then
+      F.tape = tape
+      return F
+    end
+  end
+
+  local columns = options.variable_names
+  local objective_derivatives = derivatives(options.objective, variables, columns)
+  local constraint_derivatives = {}
+  for i, c in ipairs(options.constraint_expressions) do
+    constraint_derivatives[i] = derivatives(c, variables, columns)
+  end
+
+  local objective_gradient = gradient(objective_derivatives, variables)
+  local constraint_jacobian, cj_rows, cj_cols = jacobian(constraint_derivatives)
+
+  if approximation == "automatic" then
+    local estimate = hessian_entry_estimate(objective_derivatives, constraint_derivatives, #variables)
+    approximation = #variables >= 100 and
+      estimate > F.hessian_density * #variables * (#variables + 1) / 2 and
+      "limited-memory" or "exact"
+    F.hessian_approximation = approximation
+  end
+
+  local hessian_expressions, hessian_rows, hessian_cols, hessian_varying, hessian_terms
+  if approximation == "exact" then
+    hessian_expressions, hessian_rows, hessian_cols, hessian_varying, hessian_terms =
+      hessian(objective_derivatives, constraint_derivatives, variables, columns)
+  end
+
+  -- Jacobian entries that are numbers (from linear terms) are sent once, and
+  -- only the rest are evaluated at each x
+  local cj_values, cj_varying, varying_jacobian = {}, {}, {}
+  for n, e in ipairs(constraint_jacobian) do
+    if type(e) == "number" then
+      cj_values[n] = e
+    else
+      cj_values[n] = 0
+      cj_varying[#cj_varying+1] = n
+      varying_jacobian[#varying_jacobian+1] = e
+    end
+  end
+
+  F.cj_rows, F.cj_cols = cj_rows, cj_cols
+  F.cj_values, F.cj_varying = cj_values, cj_varying
+  if hessian_expressions then
+    F.hessian_rows, F.hessian_cols = hessian_rows, hessian_cols
+    F.hessian_varying = hessian_varying
+    F.hessian_term_entries = hessian_terms.entries
+    F.hessian_term_multipliers = hessian_terms.multipliers
+    F.hessian_term_values = hessian_terms.values
+  end
+
+  -- f, grad f, g and the varying part of the constraint jacobian are
+  -- evaluated together, so that IPOPT only costs us one evaluation for each
+  -- new x
+  local fused = { options.objective }
+  for _, list in ipairs{ objective_gradient, options.constraint_expressions, varying_jacobian } do
+    for _, e in ipairs(list) do
+      fused[#fused+1] = e
+    end
+  end
+
+  -- Lower everything to tapes that the core can evaluate without calling back
+  -- into Lua.  If something won't go on a tape, use compiled Lua functions.
+  local lowered = pcall(function()
+    F.fused_tape = interface.tape(fused, variables)
+    F.hessian_tape = hessian_expressions and interface.tape(hessian_expressions, variables)
+  end)
+
+  -- The compiled functions read x and lambda from, and write their results
+  -- to, buffers that share memory with the core
+  if not lowered then
+    F.fused_tape, F.hessian_tape = nil, nil
+    F.fused_function = interface.compile(fused, variables, "args", "result")
+    F.hessian = hessian_expressions and
+      interface.compile(hessian_expressions, variables, "args, sigma, lambda", "result")
+  end
+
+  return F
+end
+
+
+-- A model kept by the core keeps the primal-dual solution from each solve,
+-- and starts the next solve from there (unless the "warm_start" option is
+-- false), so re-solving after changing bounds is cheap.
+local function build_(options)
+  local F = lib.time(options.timings, "build_problem", build_problem, options)
+  return assert(lib.time(options.timings, "load_problem", ipopt_core.new, F))
+end
+
+
+local function solve_(options)
+  local M = build_(options)
+  return lib.time(options.timings, "solve", M.solve, M, options.solver_options)
 end
 
+build = available and build_ or nil
 solve = available and solve_ or nil
 
 
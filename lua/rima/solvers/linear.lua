@@ -1,8 +1,8 @@
 -- Copyright (c) 2009-2011 Incremental IP Limited
 -- see LICENSE for license information
 
-local table = require("table")
-local pairs = pairs
+local io, table = require("io"), require("table")
+local ipairs, pairs = ipairs, pairs
 
 module(...)
 
@@ -10,49 +10,84 @@ module(...)
 --------------------------------------------------------------------------------
 
 function build_linear_problem(M)
+  -- A problem that's already been built (by rima.mp.solve_file's worker
+  -- threads) is used as it is
+  if M.linear_problem then return M.linear_problem end
+
+  local variable_map, variables = M.variable_map, M.ordered_variables
+
   -- add costs to variables
-  for name, v in pairs(M.variable_map) do
+  for name, v in pairs(variable_map) do
     local o = M.linear_objective[name]
     v.cost = (o and o.coeff) or 0
   end
 
-  -- Build a set of sparse constraints
-  local sparse_constraints = {}
-  local i = 1
-  for _, c in pairs(M.constraint_info) do
-    local elements = {}
-    local j = 1
+  local column_lower, column_upper, costs, integer = {}, {}, {}, {}
+  for i, v in ipairs(variables) do
+    column_lower[i] = v.type.lower
+    column_upper[i] = v.type.upper
+    costs[i] = v.cost
+    integer[i] = v.type.integer or false
+  end
+
+  -- Build the constraint matrix in compressed row form.  row_starts[i] is
+  -- the number of non-zeroes before row i, and column indices are the
+  -- (1-based) variable indices.
+  local row_starts, columns, values, row_lower, row_upper = { 0 }, {}, {}, {}, {}
+  local nz = 0
+  for i, c in ipairs(M.constraint_info) do
+    local indexes, coeffs, j = {}, {}, 1
     for name, element in pairs(c.linear_exp) do
-      element.index = M.variable_map[name].index
-      elements[j] = element    
+      local index = variable_map[name].index
+      indexes[j] = index
+      coeffs[index] = element.coeff
       j = j + 1
     end
-    table.sort(elements, function(a, b) return a.index < b.index end)
-    c.elements = elements
-    sparse_constraints[i] = c
-    i = i + 1
+    table.sort(indexes)
+    for _, index in ipairs(indexes) do
+      nz = nz + 1
+      columns[nz] = index
+      values[nz] = coeffs[index]
+    end
+    row_starts[i+1] = nz
+    row_lower[i] = c.lower
+    row_upper[i] = c.upper
   end
 
-  M.sparse_constraints = sparse_constraints
+  M.linear_problem =
+  {
+    sense = M.sense,
+    row_starts = row_starts,
+    columns = columns,
+    values = values,
+    row_lower = row_lower,
+    row_upper = row_upper,
+    column_lower = column_lower,
+    column_upper = column_upper,
+    costs = costs,
+    integer = integer,
+  }
+  return M.linear_problem
 end
 
 
 function write_sparse(M, f)
   f = f or io.stdout
+  local P = M.linear_problem
 
   f:write("Minimise:\n")
   for i, v in ipairs(M.ordered_variables) do
-    f:write(("  %0.4g*%s (index=%d, lower=%0.4g, upper=%0.4g)\n"):format(v.cost, v.name, i, v.type.lower, v.type.upper))
+    f:write(("  %0.4g*%s (index=%d, lower=%0.4g, upper=%0.4g)\n"):format(P.costs[i], v.name, i, P.column_lower[i], P.column_upper[i]))
   end
 
   f:write("Subject to:\n")
   
-  for _, c in ipairs(M.constraint_info) do
-    f:write(("  %0.4g <= "):format(c.lower))
-    for _, cc in ipairs(c.elements) do
-      f:write(("%+0.4g*%s "):format(cc.coeff, M.ordered_variables[cc.index].name))
+  for i = 1, #P.row_lower do
+    f:write(("  %0.4g <= "):format(P.row_lower[i]))
+    for k = P.row_starts[i]+1, P.row_starts[i+1] do
+      f:write(("%+0.4g*%s "):format(P.values[k], M.ordered_variables[P.columns[k]].name))
     end
-    f:write(("<= %0.4g\n"):format(c.upper))
+    f:write(("<= %0.4g\n"):format(P.row_upper[i]))
   end
 end
 
@@ -3,6 +3,7 @@
 
 local assert, ipairs, pcall = assert, ipairs, pcall
 
+local lib = require("rima.lib")
 local linear = require("rima.solvers.linear")
 
 local status, core = pcall(require, "rima_lpsolve_core")
@@ -23,17 +24,26 @@ preference = 2
 
 --------------------------------------------------------------------------------
 
-local function solve_(options)
-  linear.build_linear_problem(options)
+local function build_(options)
+  local timings = options.timings
+  local P = lib.time(timings, "build_linear_problem", linear.build_linear_problem, options)
   local m = core.new(0, #options.ordered_variables)
-  assert(m:resize(#options.constraint_info, #options.ordered_variables))
-  assert(m:build_rows(options.constraint_info))
-  assert(m:set_objective(options.ordered_variables, options.sense))
-  assert(m:solve())
-  return assert(m:get_solution())
+  assert(lib.time(timings, "load_problem", m.load_problem, m, P))
+  return m
+end
+
+
+local function solve_(options)
+  local m = build_(options)
+  assert(lib.time(options.timings, "solve", m.solve, m, options.solver_options))
+  return assert(lib.time(options.timings, "get_solution", m.get_solution, m))
 end
 
+build = (status and build_) or nil
 solve = (status and solve_) or nil
+read = (status and core.read_mps) or nil
+cache = (status and
+  { key = core.cache_key, info = core.cache_info, read = core.read_cache, write = core.write_cache }) or nil
 
 
 -- EOF -------------------------------------------------------------------------
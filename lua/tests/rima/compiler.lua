@@ -0,0 +1,78 @@
+-- Copyright (c) 2009-2013 Incremental IP Limited
+-- see LICENSE for license information
+
+local interface = require("rima.interface")
+
+
+------------------------------------------------------------------------------
+
+return function(T)
+  local R = interface.R
+
+  -- Run a tape the way the solver cores do
+  local function run(tape, x, sigma, lambda)
+    local v = {}
+    for i, op in ipairs(tape.op) do
+      local a, b, c = v[tape.a[i]], v[tape.b[i]], tape.value[i]
+      if op == "constant" then v[i] = c
+      elseif op == "variable" then v[i] = x[tape.a[i]]
+      elseif op == "sigma" then v[i] = sigma
+      elseif op == "lambda" then v[i] = lambda[tape.a[i]]
+      elseif op == "add" then v[i] = a + b
+      elseif op == "multiply" then v[i] = a * b
+      elseif op == "scale" then v[i] = c * a
+      elseif op == "power" then v[i] = a ^ c
+      elseif op == "pow" then v[i] = a ^ b
+      else v[i] = math[op](a)
+      end
+    end
+    local r = {}
+    for i, o in ipairs(tape.outputs) do r[i] = v[o] end
+    return r
+  end
+
+  local x, y = R"x, y"
+  local variables = { { ref = x }, { ref = y } }
+
+  do
+    local e = { 3 + x, 2*x*y, x / y, x^y, interface.math.exp(x) - 2*interface.math.sqrt(y), 7 }
+    local tape = interface.tape(e, variables)
+    local f = interface.compile(e, variables)
+    local args = { 1.5, 2.5 }
+    local expected, got = f(args), run(tape, args)
+    T:check_equal(#got, 6)
+    for i = 1, 6 do
+      T:check_equal(got[i], expected[i])
+    end
+  end
+
+  do
+    local f = interface.compile({ x + y, x * y }, variables, "args", "result")
+    local result = {}
+    f({ 2, 3 }, result)
+    T:check_equal(result[1], 5)
+    T:check_equal(result[2], 6)
+  end
+
+  do
+    -- x*y appears in both expressions, but is only on the tape once
+    local tape = interface.tape({ 2 * x * y, 3 * x * y }, variables)
+    local multiplies = 0
+    for _, op in ipairs(tape.op) do
+      if op == "multiply" then multiplies = multiplies + 1 end
+    end
+    T:check_equal(multiplies, 1)
+    T:check_equal(run(tape, { 2, 3 })[2], 18)
+  end
+
+  do
+    local sigma, lambda = R"sigma, lambda"
+    local tape = interface.tape(sigma * x^2 + lambda[2] * y, variables)
+    T:check_equal(run(tape, { 3, 5 }, 2, { 7, 11 })[1], 73)
+  end
+
+  T:expect_error(function() interface.tape(R"z" + x, variables) end, "can't put 'z' on a tape")
+end
+
+
+------------------------------------------------------------------------------
@@ -19,6 +19,15 @@ return function(T)
   T:check_equal(D(1), "1")
   T:check_equal(D("a"), '"a"')
   T:check_equal(D(nil), "nil")
+
+  -- time
+  local timings = {}
+  local a, b = lib.time(timings, "add", function(x, y) return x + y, x - y end, 3, 2)
+  T:check_equal(a, 5)
+  T:check_equal(b, 1)
+  lib.time(timings, "add", function() end)
+  T:test(timings.add >= 0, "lib.time")
+  T:check_equal(lib.time(nil, "add", function(x) return x end, 4), 4)
 end
 
 
@@ -48,6 +48,57 @@ Subject to:
     end
   end
 
+  do
+    local x, y = R"x, y"
+    local S = mp.new()
+    S.c1 = interface.mp.constraint(x + 2*y, "<=", 3)
+    S.c2 = interface.mp.constraint(2*x + y, "<=", 3)
+    S.objective = x + y
+    S.sense = "maximise"
+    S.x = number_t.positive()
+    S.y = number_t.positive()
+
+    local primal, dual, info = mp.solve_with("clp", S, mp.options{ algorithm = "dual" })
+    if primal then
+      T:check_equal(primal.objective, 2)
+      T:check_equal(info.algorithm, "dual")
+    end
+
+    local m = mp.build_with("clp", S)
+    primal = m:solve()
+    if primal then
+      T:check_equal(primal.objective, 2)
+      m:set_constraint_bounds("c2", -math.huge, 6)
+      primal = m:solve()
+      T:check_equal(primal.objective, 3)
+      T:check_equal(primal.x, 3)
+      T:check_equal(primal.y, 0)
+      m:set_bounds(x, 0, 1)
+      primal = m:solve()
+      T:check_equal(primal.objective, 2)
+      T:check_equal(primal.x, 1)
+      T:check_equal(primal.y, 1)
+      m:set_cost(y, 2)
+      primal = m:solve()
+      T:check_equal(primal.objective, 3)
+
+      local filename = os.tmpname()
+      m:write(filename, { names = true })
+      local f = io.open(filename)
+      local mps = f:read("*a")
+      f:close()
+      T:test(mps:find("ROWS") and mps:find("c2") and mps:find("x"), "write mps")
+
+      -- MPS files written by CLP don't record the direction
+      local replay = mp.read_with("clp", filename)
+      os.remove(filename)
+      local replayed, _, info = replay:solve()
+      T:check_equal(info.sense, "minimise")
+      T:check_equal(replayed.c2 + replayed.y, primal.c2 + primal.y)
+      T:expect_error(function() m:write(filename, { format = "xml" }) end, "bad option 'format'")
+    end
+  end
+
   do
     local x, i, j = R"x, i, j"
     local S = mp.new()
@@ -75,6 +126,145 @@ Subject to:
       T:check_equal(primal.c1, 3)
       T:check_equal(primal.c2, 3)
     end
+
+    local _, info
+    primal, _, info = mp.solve_with("cbc", S,
+      mp.options{ threads = 2, relative_gap = 0.01, cuts = { "probing", "gomory" }, heuristics = { "rounding" } })
+    if primal then
+      T:check_equal(primal.objective, 2)
+      T:check_equal(info.status, "optimal")
+      T:check_equal(info.gap, 0)
+    end
+
+    primal = mp.solve_with("cbc", S, mp.options{ start = { ["x[1, 1].a"] = 1, ["x[1, 2].a"] = 1 } })
+    if primal then
+      T:check_equal(primal.objective, 2)
+    end
+  end
+
+  do
+    -- A solver that returns a solution object has its values looked up
+    -- only when they're asked for
+    local solvers = require("rima.solvers")
+    local lookups = 0
+    local solution =
+    {
+      column = function(self, i) lookups = lookups + 1; return i, -i end,
+      row = function(self, i) lookups = lookups + 1; return 10 * i, -10 * i end,
+    }
+    solvers.lazy_test =
+    {
+      available = true, preference = 100,
+      objective = { linear = true }, constraints = { linear = true }, variables = { continuous = true },
+      solve = function(options) return { objective = 7, status = "optimal", solution = solution } end,
+    }
+
+    local x, y = R"x, y"
+    local S = mp.new()
+    S.c1 = interface.mp.constraint(x[1][1].a + 2*x[1][2].a + y, "<=", 3)
+    S.c2 = interface.mp.constraint(2*x[1][1].a + x[1][2].a, "<=", 3)
+    S.objective = x[1][1].a + x[1][2].a + y
+    S.sense = "maximise"
+    S.x[1][1].a = number_t.positive()
+    S.x[1][2].a = number_t.positive()
+    S.y = number_t.positive()
+
+    local primal, dual, info = mp.solve_with("lazy_test", S)
+    solvers.lazy_test = nil
+
+    T:check_equal(primal.objective, 7)
+    T:check_equal(info.status, "optimal")
+    T:check_equal(info.solution, nil)
+    -- Only the names without indexes have been looked up
+    T:check_equal(lookups, 3)
+    T:check_equal(primal.y, 3)
+    T:check_equal(primal.c2, 20)
+    T:check_equal(dual.c1, -10)
+    T:check_equal(lookups, 3)
+    T:check_equal(primal.x[1][1].a, 1)
+    T:check_equal(dual.x[1][2].a, -2)
+    T:check_equal(lookups, 5)
+    T:check_equal(primal.z, nil)
+    T:check_equal(lookups, 5)
+
+    -- Every top-level name shows up when the results are iterated
+    local names = {}
+    for k, v in pairs(dual) do names[#names+1] = k end
+    table.sort(names)
+    T:check_equal(table.concat(names, ","), "c1,c2,x,y")
+    local count = 0
+    for k in pairs(primal) do count = count + 1 end
+    T:check_equal(count, 5)
+  end
+
+  do
+    -- With a cache directory, a model that's been solved with the same data
+    -- before is loaded from its cache file rather than built again
+    local solvers = require("rima.solvers")
+    local linear = require("rima.solvers.linear")
+    local files, builds, reads = {}, 0, 0
+    local solution =
+    {
+      column = function(self, i) return i, -i end,
+      row = function(self, i) return 10 * i, -10 * i end,
+    }
+    local core =
+    {
+      solve = function(self) return true end,
+      get_solution = function(self) return { objective = 7, status = "optimal", solution = solution } end,
+    }
+    solvers.cache_test =
+    {
+      available = true, preference = 100,
+      objective = { linear = true }, constraints = { linear = true }, variables = { continuous = true },
+      solve = function(options)
+        builds = builds + 1
+        linear.build_linear_problem(options)
+        return { objective = 7, status = "optimal", solution = solution }
+      end,
+      cache =
+      {
+        key = function(s) return s end,
+        info = function(f) return files[f] and { integer = false } end,
+        read = function(f) reads = reads + 1 return core, files[f] end,
+        write = function(f, P, names) files[f] = names return true end,
+      },
+    }
+
+    local x, y, b = R"x, y, b"
+    local S = mp.new()
+    S.c1 = interface.mp.constraint(x[1][1].a + 2*x[1][2].a + y, "<=", b)
+    S.c2 = interface.mp.constraint(2*x[1][1].a + x[1][2].a, "<=", 3)
+    S.objective = x[1][1].a + x[1][2].a + y
+    S.sense = "maximise"
+    S.x[1][1].a = number_t.positive()
+    S.x[1][2].a = number_t.positive()
+    S.y = number_t.positive()
+
+    local o = mp.options{ cache = "cache" }
+    local primal, dual, info = mp.solve_with("cache_test", S, { b = 3, c = { 1, 2 } }, o)
+    T:check_equal(builds, 1)
+    T:check_equal(reads, 0)
+    T:check_equal(primal.x[1][2].a, 2)
+    local first = info.cache
+
+    local timings = {}
+    primal, dual, info = mp.solve_with("cache_test", S, { c = { 1, 2 }, b = 3 }, mp.options{ cache = "cache", timings = timings })
+    solvers.cache_test.preference = 100
+    T:check_equal(builds, 1)
+    T:check_equal(reads, 1)
+    T:check_equal(info.cache, first)
+    T:test(timings.read_cache and not timings.find_constraints, "cached model timings")
+    T:check_equal(primal.objective, 7)
+    T:check_equal(primal.x[1][1].a, 1)
+    T:check_equal(dual.x[1][2].a, -2)
+    T:check_equal(primal.y, 3)
+    T:check_equal(primal.c2, 20)
+
+    primal = mp.solve_with("cache_test", S, { b = 4, c = { 1, 2 } }, o)
+    solvers.cache_test = nil
+    T:check_equal(builds, 2)
+    T:check_equal(reads, 1)
   end
 
   do
@@ -94,14 +284,15 @@ Subject to:
   0 <= x[n] <= inf, x[n] real for all n
 ]])
 
-    local primal, dual = mp.solve_with("lpsolve", S,
+    local data =
       {
         M = interface.range(1, 2),
         N = interface.range(1, 2),
         A = {{1, 2}, {2, 1}},
         b = {3, 3},
         c = {1, 1},
-      })
+      }
+    local primal, dual = mp.solve_with("lpsolve", S, data)
 
     if primal then
       T:check_equal(primal.objective, 2)
@@ -109,6 +300,116 @@ Subject to:
       T:check_equal(primal.x[2], 1)
       T:check_equal(primal.constraint[1], 3)
       T:check_equal(primal.constraint[2], 3)
+
+      -- lp_solve keeps the direction in the MPS files it writes
+      local filename = os.tmpname()
+      local m = mp.build_with("lpsolve", S, data)
+      m:write(filename)
+      local replay = mp.read_with("lpsolve", filename)
+      os.remove(filename)
+      local replayed, _, info = replay:solve()
+      T:check_equal(info.sense, "maximise")
+      T:check_equal(replayed.objective, 2)
+    end
+  end
+
+  do
+    -- Constraints generated by worker threads come out the same as those
+    -- generated serially
+    local filename = os.tmpname()
+    local f = io.open(filename, "w")
+    f:write([[
+local interface = require("rima.interface")
+local mp = require("rima.mp")
+local number_t = require("rima.types.number_t")
+local m, M, n, N, A, b, c, x = interface.R"m, M, n, N, A, b, c, x"
+local S = mp.new()
+S.constraint[{m=M}] = interface.mp.constraint(interface.sum{n=N}(A[m][n] * x[n]), "<=", b[m])
+S.objective = interface.sum{n=N}(c[n] * x[n])
+S.sense = "maximise"
+S.x[n] = number_t.positive()
+return S, { M = interface.range(1, 3), N = interface.range(1, 2),
+  A = {{1, 2}, {2, 1}, {3, 3}}, b = {3, 3, 5}, c = {1, 2} }
+]])
+    f:close()
+
+    local serial = mp.solve_file(filename)
+    local parallel = mp.solve_file(filename, mp.options{ threads = 3 })
+    os.remove(filename)
+    if serial then
+      T:check_equal(parallel.objective, serial.objective)
+      T:check_equal(parallel.x[1], serial.x[1])
+      T:check_equal(parallel.x[2], serial.x[2])
+      T:check_equal(parallel.constraint[3], serial.constraint[3])
+    end
+
+    -- Workers that find the constraints in different orders are caught
+    local status, parallel_core = pcall(require, "rima_parallel_core")
+    if status then
+      local pool = parallel_core.new(2)
+      local P, message = pool:generate([[
+local number = ...
+emit_constraints(number == 1 and { "a", "b" } or { "b", "a" })
+emit_row(number, "a", 0, 1, {}, {})
+]])
+      T:check_equal(P, nil)
+      T:test(message:find("same order"), "parallel constraint order")
+      P, message = pool:generate([[
+emit_constraints{ "a", "b" }
+emit_row(1, "a", 0, 1, {}, {})
+]])
+      T:check_equal(P, nil)
+      T:test(message:find("more than once"), "parallel duplicate rows")
+    end
+  end
+
+  do
+    -- Symbolic and automatic derivatives should take IPOPT to the same place
+    local x, X = R"x, X"
+    local S = mp.new()
+    S.objective = X[1]*X[4]*(X[1] + X[2] + X[3]) + X[3]
+    S.c1 = interface.mp.constraint(interface.product{x=X}(x), ">=", 25)
+    S.c2 = interface.mp.constraint(sum{x=X}(x^2), "==", 40)
+    S.X = { number_t.free(1, 5), number_t.free(1, 5), number_t.free(1, 5), number_t.free(1, 5) }
+
+    local symbolic = mp.solve_with("ipopt", S, mp.options{ derivatives = "symbolic" })
+    local automatic = mp.solve_with("ipopt", S, mp.options{ derivatives = "automatic" })
+    if symbolic and automatic then
+      T:test(math.abs(symbolic.objective - automatic.objective) < 1e-6, "ipopt derivatives",
+        ("symbolic objective %.10g, automatic %.10g"):format(symbolic.objective, automatic.objective))
+      for i = 1, 4 do
+        T:test(math.abs(symbolic.X[i] - automatic.X[i]) < 1e-5, "ipopt derivatives")
+      end
+    end
+
+    -- A kept model restarts from the last solution after its bounds change
+    local m = mp.build_with("ipopt", S)
+    local cold, _, info
+    if m then
+      cold, _, info = m:solve{ ipopt = { acceptable_tol = 1e-8, mu_strategy = "monotone" } }
+    end
+    if cold then
+      m:set_bounds(X[4], 1, 4.5)
+      local warm = m:solve()
+      T:test(warm.X[4] <= 4.5 + 1e-6, "ipopt warm start")
+      T:test(warm.objective >= cold.objective - 1e-6, "ipopt warm start")
+      local r, message = m:solve{ ipopt = { no_such_option = 1 } }
+      T:check_equal(message, "unknown IPOPT option 'no_such_option'")
+
+      -- Each solve reports what IPOPT did at each iteration and where the time
+      -- went, and an iteration callback can stop it early
+      local statistics = info.statistics
+      T:check_equal(#statistics.objective, statistics.iterations)
+      T:check_equal(#statistics.mu, statistics.iterations)
+      T:test(statistics.callbacks.eval_f.calls > 0, "ipopt statistics")
+      T:test(statistics.callback_time <= statistics.total_time, "ipopt statistics")
+
+      local seen = 0
+      r, message = m:solve{ warm_start = false,
+        iteration_callback = function(i) seen = seen + 1; return i.iteration < 2 end }
+      T:check_equal(r, nil)
+      T:check_equal(message, "Solve stopped by the iteration callback")
+      T:check_equal(seen, 3)
     end
   end
 
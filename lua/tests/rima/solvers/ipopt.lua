@@ -0,0 +1,144 @@
+-- Copyright (c) 2009-2012 Incremental IP Limited
+-- see LICENSE for license information
+
+local ipopt = require("rima.solvers.ipopt")
+local interface = require("rima.interface")
+
+
+------------------------------------------------------------------------------
+
+return function(T)
+  local function join(t)
+    local s = {}
+    for i, v in ipairs(t) do s[i] = tostring(v) end
+    return table.concat(s, " ")
+  end
+
+  do
+    local x, y, z = interface.R"x, y, z"
+    local function variable(name, ref)
+      return { name = name, ref = ref, type = { lower = 0, upper = math.huge } }
+    end
+    local F = ipopt.build_problem
+    {
+      sense = "minimise",
+      objective = x * y + z^2 + x,
+      constraint_expressions = { x^2 * z + y, x + y + z },
+      constraint_info = { { lower = -math.huge, upper = 10 }, { lower = 1, upper = math.huge } },
+      ordered_variables = { variable("x", x), variable("y", y), variable("z", z) },
+      variable_names = { x = 1, y = 2, z = 3 },
+    }
+
+    -- Only the lower triangle, and only where there's a second derivative
+    T:check_equal(join(F.hessian_rows), "1 2 3 3")
+    T:check_equal(join(F.hessian_cols), "1 1 1 3")
+    T:check_equal(join(F.cj_rows), "1 1 1 2 2 2")
+    T:check_equal(join(F.cj_cols), "1 2 3 1 2 3")
+
+    -- Linear terms give constant jacobian entries, and quadratic terms give
+    -- constant multiples of sigma or lambda in the hessian
+    T:check_equal(join(F.cj_varying), "1 3")
+    T:check_equal(join(F.cj_values), "0 1 0 1 1 1")
+    T:check_equal(join(F.hessian_varying), "1 3")
+    T:check_equal(join(F.hessian_term_entries), "2 4")
+    T:check_equal(join(F.hessian_term_multipliers), "1 1")
+    T:check_equal(join(F.hessian_term_values), "1 2")
+    T:check_equal(#F.fused_tape.outputs, 1 + 3 + 2 + 2)
+    T:check_equal(#F.hessian_tape.outputs, 2)
+  end
+
+  do
+    local x, y = interface.R"x, y"
+    local F = ipopt.build_problem
+    {
+      sense = "minimise",
+      objective = x + y,
+      constraint_expressions = { x * y, x^2 },
+      constraint_info = { { lower = 1, upper = math.huge }, { lower = -math.huge, upper = 4 } },
+      ordered_variables =
+      {
+        { name = "x", ref = x, type = { lower = 0, upper = 10 } },
+        { name = "y", ref = y, type = { lower = 0, upper = 10 } },
+      },
+      variable_names = { x = 1, y = 2 },
+    }
+
+    -- A linear objective and constraints that don't depend on y don't add
+    -- hessian entries
+    T:check_equal(join(F.hessian_rows), "1 2")
+    T:check_equal(join(F.hessian_cols), "1 1")
+    T:check_equal(join(F.cj_rows), "1 1 2")
+    T:check_equal(join(F.cj_cols), "1 2 1")
+  end
+
+  do
+    local x, y = interface.R"x, y"
+    local options =
+    {
+      sense = "minimise",
+      objective = x * y,
+      constraint_expressions = { x^2 + y },
+      constraint_info = { { lower = 1, upper = math.huge } },
+      ordered_variables =
+      {
+        { name = "x", ref = x, type = { lower = 0, upper = 10 } },
+        { name = "y", ref = y, type = { lower = 0, upper = 10 } },
+      },
+      variable_names = { x = 1, y = 2 },
+      solver_options = { derivatives = "automatic" },
+    }
+    local F = ipopt.build_problem(options)
+
+    -- The core works out the derivatives and their sparsity from the tape
+    T:check_equal(#F.tape.outputs, 2)
+    T:check_equal(F.cj_rows, nil)
+    T:check_equal(F.hessian_rows, nil)
+    T:check_equal(F.fused_tape, nil)
+
+    options.solver_options.derivatives = "numeric"
+    T:expect_error(function() ipopt.build_problem(options) end, "bad option 'derivatives'")
+  end
+
+  do
+    local X = interface.R"X"
+    local function problem(n, solver_options)
+      local variables, names, s = {}, {}, 0
+      for i = 1, n do
+        variables[i] = { name = "X["..i.."]", ref = X[i], type = { lower = 0, upper = 1 } }
+        names["X["..i.."]"] = i
+        s = s + X[i]
+      end
+      return ipopt.build_problem
+      {
+        sense = "minimise",
+        objective = s^2,
+        constraint_expressions = { s },
+        constraint_info = { { lower = 1, upper = math.huge } },
+        ordered_variables = variables,
+        variable_names = names,
+        solver_options = solver_options,
+      }
+    end
+
+    -- Small problems get an exact hessian however dense it is
+    local F = problem(3)
+    T:check_equal(F.hessian_approximation, "exact")
+    T:check_equal(#F.hessian_rows, 6)
+
+    -- but large dense ones don't, unless we ask
+    F = problem(100)
+    T:check_equal(F.hessian_approximation, "limited-memory")
+    T:check_equal(F.hessian_rows, nil)
+    T:check_equal(F.hessian_tape, nil)
+    T:check_equal(#F.fused_tape.outputs, 1 + 100 + 1)
+
+    F = problem(100, { hessian_approximation = "exact" })
+    T:check_equal(#F.hessian_rows, 5050)
+
+    F = problem(3, { hessian_approximation = "limited-memory" })
+    T:check_equal(F.hessian_rows, nil)
+  end
+end
+
+
+------------------------------------------------------------------------------
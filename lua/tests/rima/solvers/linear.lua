@@ -0,0 +1,48 @@
+-- Copyright (c) 2009-2012 Incremental IP Limited
+-- see LICENSE for license information
+
+local linear = require("rima.solvers.linear")
+
+
+------------------------------------------------------------------------------
+
+return function(T)
+  local function join(t)
+    local s = {}
+    for i, v in ipairs(t) do s[i] = tostring(v) end
+    return table.concat(s, " ")
+  end
+
+  do
+    local x = { name = "x", index = 1, type = { lower = 0, upper = math.huge } }
+    local y = { name = "y", index = 2, type = { lower = 0, upper = 7, integer = true } }
+    local M =
+    {
+      sense = "maximise",
+      variable_map = { x = x, y = y },
+      ordered_variables = { x, y },
+      linear_objective = { x = { coeff = 3 } },
+      constraint_info =
+      {
+        { lower = -math.huge, upper = 3, linear_exp = { y = { coeff = 2 }, x = { coeff = 1 } } },
+        { lower = 1, upper = 1, linear_exp = {} },
+        { lower = 3, upper = math.huge, linear_exp = { y = { coeff = 4 } } },
+      }
+    }
+
+    local P = linear.build_linear_problem(M)
+    T:check_equal(P.sense, "maximise")
+    T:check_equal(join(P.row_starts), "0 2 2 3")
+    T:check_equal(join(P.columns), "1 2 2")
+    T:check_equal(join(P.values), "1 2 4")
+    T:check_equal(join(P.row_lower), "-inf 1 3")
+    T:check_equal(join(P.row_upper), "3 1 inf")
+    T:check_equal(join(P.column_lower), "0 0")
+    T:check_equal(join(P.column_upper), "inf 7")
+    T:check_equal(join(P.costs), "3 0")
+    T:check_equal(join(P.integer), "false true")
+  end
+end
+
+
+------------------------------------------------------------------------------